@@ -0,0 +1,338 @@
+/*
+ * Artifact Updates
+ * ================
+ *
+ * Updates named, versioned blobs such as CA certificates, configuration files
+ * and ML models without touching the app or rebooting. An artifact manifest
+ * (see gecl-ota-manifest.c) lists the artifacts; each is downloaded through
+ * the same image sources and verify pipeline as the app, over one connection.
+ *
+ * An artifact lives either in an A/B pair of data partitions, named
+ * "<partition>_a" and "<partition>_b", or in NVS as two blobs "<name>_a" and
+ * "<name>_b". The new copy is written to the inactive slot and verified, then
+ * the artifact's NVS record is switched to that slot in one write. Readers
+ * find either the old or the new copy, never a partial one. Artifacts whose
+ * recorded SHA-256 already matches the manifest are not downloaded again.
+ *
+ * Subscribers learn about a swap from GECL_OTA_EVENT_ARTIFACT_UPDATED.
+ *
+ * The CA certificate artifact is parsed before it is swapped in and is
+ * trusted in addition to the embedded root, so a bad certificate cannot lock
+ * the device out of the update that replaces it.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "mbedtls/x509_crt.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_ARTIFACT";
+
+#define ARTIFACT_NVS_NAMESPACE "gecl_art"
+#define ARTIFACT_DATA_NVS_NAMESPACE "gecl_art_d"
+
+typedef struct {
+    char version[32];
+    uint8_t sha256[OTA_SHA256_LEN];
+    uint32_t size;
+    char partition[17]; // A/B pair base name, empty for artifacts kept in NVS
+    uint8_t slot;       // Active slot, 0 for "_a" and 1 for "_b"
+} ota_artifact_record_t;
+
+static char *cert_copy = NULL; // CA artifact and embedded root loaded into RAM, NULL until read
+static bool cert_loaded = false;
+
+static esp_err_t load_record(const char *name, ota_artifact_record_t *record) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(ARTIFACT_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : err;
+    }
+    size_t len = sizeof(*record);
+    err = nvs_get_blob(nvs, name, record, &len);
+    nvs_close(nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && len != sizeof(*record))) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return err;
+}
+
+static esp_err_t store(const char *namespace, const char *key, const void *data, size_t len) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(namespace, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, key, data, len);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void slot_key(const char *name, uint8_t slot, char key[16]) { snprintf(key, 16, "%s_%c", name, 'a' + slot); }
+
+/**
+ * Downloads one artifact into the slot given by record. On success record
+ * describes the new copy, still inactive.
+ */
+static esp_err_t download(const ota_manifest_t *artifact, ota_source_t *source, ota_artifact_record_t *record) {
+    ota_pipeline_t pipe;
+    uint8_t *buf = NULL;
+    esp_err_t err;
+    if (artifact->label[0] != '\0') {
+        const esp_partition_t *pair[2];
+        if (!ota_slots_find_pair(artifact->label, pair)) {
+            ESP_LOGE(TAG, "No partitions %s_a/%s_b for %s", artifact->label, artifact->label, artifact->name);
+            return ESP_ERR_NOT_FOUND;
+        }
+        err = ota_pipeline_begin_partition(&pipe, artifact, pair[record->slot]);
+    } else {
+        if (artifact->image_size > CONFIG_GECL_OTA_ARTIFACT_NVS_MAX_SIZE) {
+            ESP_LOGE(TAG, "%s has %u bytes, NVS artifacts are limited to %d", artifact->name,
+                     (unsigned)artifact->image_size, CONFIG_GECL_OTA_ARTIFACT_NVS_MAX_SIZE);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        buf = malloc(artifact->image_size);
+        err = buf ? ota_pipeline_begin_buffer(&pipe, artifact, buf) : ESP_ERR_NO_MEM;
+    }
+    if (err == ESP_OK) {
+        err = ota_pipeline_run(&pipe, source);
+        if (err == ESP_OK) {
+            err = ota_pipeline_finish(&pipe);
+        } else {
+            ota_pipeline_abort(&pipe);
+        }
+    }
+    if (err == ESP_OK && buf != NULL) {
+        char key[16];
+        slot_key(artifact->name, record->slot, key);
+        err = store(ARTIFACT_DATA_NVS_NAMESPACE, key, buf, artifact->image_size);
+    }
+    free(buf);
+    if (err == ESP_OK) {
+        strlcpy(record->version, artifact->version, sizeof(record->version));
+        memcpy(record->sha256, artifact->image_sha256, OTA_SHA256_LEN);
+        record->size = artifact->image_size;
+        strlcpy(record->partition, artifact->label, sizeof(record->partition));
+    }
+    return err;
+}
+
+static esp_err_t read_slot(const char *name, const ota_artifact_record_t *record, void *buf, size_t len) {
+    if (record->partition[0] != '\0') {
+        const esp_partition_t *pair[2];
+        if (!ota_slots_find_pair(record->partition, pair)) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        return esp_partition_read(pair[record->slot], 0, buf, len);
+    }
+    char key[16];
+    slot_key(name, record->slot, key);
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(ARTIFACT_DATA_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_get_blob(nvs, key, buf, &len);
+        nvs_close(nvs);
+    }
+    return err;
+}
+
+/**
+ * Reads the CA certificate artifact of a slot into a NUL-terminated string,
+ * leaving room for extra bytes behind it, and checks that it parses.
+ */
+static esp_err_t read_cert(const ota_artifact_record_t *record, size_t extra, char **out_pem) {
+    char *pem = malloc(record->size + 1 + extra);
+    if (pem == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = read_slot(CONFIG_GECL_OTA_CA_CERT_ARTIFACT, record, pem, record->size);
+    if (err == ESP_OK) {
+        pem[record->size] = '\0';
+        mbedtls_x509_crt crt;
+        mbedtls_x509_crt_init(&crt);
+        if (mbedtls_x509_crt_parse(&crt, (const unsigned char *)pem, record->size + 1) != 0) {
+            err = ESP_ERR_INVALID_RESPONSE;
+        }
+        mbedtls_x509_crt_free(&crt);
+    }
+    if (err != ESP_OK) {
+        free(pem);
+        return err;
+    }
+    *out_pem = pem;
+    return ESP_OK;
+}
+
+/**
+ * Re-reads the CA artifact after it changed. The previous copy is freed, so
+ * this runs only once the update's own connections are closed.
+ */
+static void reload_cert(void) {
+    free(cert_copy);
+    cert_copy = NULL;
+    cert_loaded = false;
+    ota_get_server_cert();
+}
+
+/**
+ * Updates the artifacts listed in an artifact manifest. Each artifact is
+ * swapped in and announced as soon as it is verified; the first failure stops
+ * the update and leaves the remaining artifacts at their current version.
+ */
+esp_err_t ota_artifact_update(const char *manifest_url) {
+    if (!ota_claim_session()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    ota_manifest_t manifest;
+    ota_source_t source = {0};
+    ota_config_t ota = {0};
+    bool cert_changed = false;
+    esp_err_t err = ota_artifacts_fetch(manifest_url, &ota, &source, &manifest);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to fetch artifact manifest: %s", esp_err_to_name(err));
+        ota_source_close(&source);
+        ota_trace_stop(err);
+        ota_release_session();
+        return err;
+    }
+
+    for (uint8_t i = 0; i < manifest.artifact_count; i++) {
+        const ota_manifest_t *artifact = &manifest.artifacts[i];
+        ota_artifact_record_t record = {0};
+        bool installed = load_record(artifact->name, &record) == ESP_OK;
+        if (installed && memcmp(record.sha256, artifact->image_sha256, OTA_SHA256_LEN) == 0) {
+            ESP_LOGI(TAG, "%s %s is current", artifact->name, record.version);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "Updating %s to %s from %s", artifact->name, artifact->version, artifact->image_url);
+        strlcpy(ota.url, artifact->image_url, sizeof(ota.url));
+        err = ota_source_reopen(&source, artifact->image_url, &ota); // The manifest's connection
+        if (err != ESP_OK) {
+            break;
+        }
+        record.slot = installed ? 1 - record.slot : 0;
+        err = download(artifact, &source, &record);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to update %s: %s", artifact->name, esp_err_to_name(err));
+            break;
+        }
+
+        bool is_cert = strcmp(artifact->name, CONFIG_GECL_OTA_CA_CERT_ARTIFACT) == 0;
+        if (is_cert) {
+            char *pem;
+            err = read_cert(&record, 0, &pem);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "%s is not a valid PEM certificate", artifact->name);
+                break;
+            }
+            free(pem);
+        }
+
+        err = store(ARTIFACT_NVS_NAMESPACE, artifact->name, &record, sizeof(record)); // The swap
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to record %s: %s", artifact->name, esp_err_to_name(err));
+            break;
+        }
+
+        cert_changed |= is_cert;
+        ota_artifact_info_t info;
+        if (ota_artifact_get(artifact->name, &info) == ESP_OK) {
+            esp_event_post(GECL_OTA_EVENT, GECL_OTA_EVENT_ARTIFACT_UPDATED, &info, sizeof(info), portMAX_DELAY);
+        }
+    }
+
+    ota_source_close(&source);
+    if (cert_changed) {
+        reload_cert();
+    }
+    ota_manifest_free(&manifest);
+    ota_trace_stop(err);
+    ota_release_session();
+    return err;
+}
+
+/**
+ * Describes the installed copy of an artifact. Returns ESP_ERR_NOT_FOUND when
+ * none was installed yet.
+ */
+esp_err_t ota_artifact_get(const char *name, ota_artifact_info_t *out_info) {
+    ota_artifact_record_t record;
+    esp_err_t err = load_record(name, &record);
+    if (err != ESP_OK) {
+        return err;
+    }
+    memset(out_info, 0, sizeof(*out_info));
+    strlcpy(out_info->name, name, sizeof(out_info->name));
+    memcpy(out_info->version, record.version, sizeof(out_info->version));
+    memcpy(out_info->sha256, record.sha256, sizeof(out_info->sha256));
+    out_info->size = record.size;
+    if (record.partition[0] != '\0') {
+        const esp_partition_t *pair[2];
+        if (!ota_slots_find_pair(record.partition, pair)) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        out_info->partition = pair[record.slot];
+    }
+    return ESP_OK;
+}
+
+/**
+ * Copies the installed copy of an artifact into buf. *len is the size of buf
+ * on entry and the artifact size on return; a NULL buf only queries the size.
+ */
+esp_err_t ota_artifact_read(const char *name, void *buf, size_t *len) {
+    ota_artifact_record_t record;
+    esp_err_t err = load_record(name, &record);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (buf == NULL) {
+        *len = record.size;
+        return ESP_OK;
+    }
+    if (*len < record.size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = record.size;
+    return read_slot(name, &record, buf, record.size);
+}
+
+/**
+ * Returns the CA certificate artifact named by GECL_OTA_CA_CERT_ARTIFACT
+ * followed by the embedded root as one NUL-terminated PEM bundle, or NULL when
+ * none is configured or installed, or the installed one does not parse.
+ */
+const char *ota_artifact_cert(const char *embedded) {
+    if (cert_loaded || CONFIG_GECL_OTA_CA_CERT_ARTIFACT[0] == '\0') {
+        return cert_copy;
+    }
+    cert_loaded = true;
+
+    ota_artifact_record_t record;
+    if (load_record(CONFIG_GECL_OTA_CA_CERT_ARTIFACT, &record) != ESP_OK) {
+        return NULL;
+    }
+    size_t embedded_len = strlen(embedded);
+    char *pem;
+    esp_err_t err = read_cert(&record, embedded_len + 1, &pem);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "CA certificate artifact %s unusable: %s", CONFIG_GECL_OTA_CA_CERT_ARTIFACT,
+                 esp_err_to_name(err));
+        return NULL;
+    }
+    pem[record.size] = '\n';
+    memcpy(pem + record.size + 1, embedded, embedded_len + 1);
+    cert_copy = pem;
+    ESP_LOGI(TAG, "Using CA certificate artifact %s", CONFIG_GECL_OTA_CA_CERT_ARTIFACT);
+    return cert_copy;
+}
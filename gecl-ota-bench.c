@@ -0,0 +1,331 @@
+/*
+ * Co-Tenant Interference Benchmark
+ * ================================
+ *
+ * Measures what an update costs the application rather than how fast it is.
+ * While an image is downloaded and written, a representative workload runs:
+ *
+ *   - a hardware timer alarm every GECL_OTA_BENCH_PERIOD_US, whose ISR wakes
+ *   - a high-priority application task that busy-works for
+ *     GECL_OTA_BENCH_WORK_US and must finish within GECL_OTA_BENCH_DEADLINE_US
+ *     of the alarm, and
+ *   - an MQTT publish loop, when the configuration carries an MQTT client and
+ *     GECL_OTA_MQTT_TRANSPORT is enabled.
+ *
+ * Each mode sets the update pacing (chunk delay, flash stall budget) and
+ * whether the application task declares critical periods. For every mode the
+ * benchmark reports the scheduling latency percentiles of the application
+ * task (alarm to task running), its missed deadlines, the worst ISR latency
+ * and the update's own duration. The image is written to the passive
+ * partition but never made bootable, so the benchmark can be repeated.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "sdkconfig.h"
+
+#if CONFIG_GECL_OTA_BENCH
+
+#include "driver/gptimer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_BENCH";
+
+#define BENCH_BUCKET_US 10 // Latency histogram resolution
+#define BENCH_BUCKETS 2000 // Latencies beyond 20 ms land in the last bucket
+#define BENCH_APP_DONE (1 << 0)
+#define BENCH_MQTT_DONE (1 << 1)
+
+static const ota_bench_mode_t default_modes[OTA_BENCH_DEFAULT_MODES] = {
+    {.idle = true},
+    {.pacing = {.delay_ms = CONFIG_GECL_OTA_PACING_DELAY_MS, .max_stall_us = CONFIG_GECL_OTA_MAX_STALL_US}},
+    {.pacing = {.delay_ms = 0, .max_stall_us = 0}},
+    {.pacing = {.delay_ms = CONFIG_GECL_OTA_PACING_DELAY_MS, .max_stall_us = 1000}},
+    {.pacing = {.delay_ms = CONFIG_GECL_OTA_PACING_DELAY_MS, .max_stall_us = CONFIG_GECL_OTA_MAX_STALL_US},
+     .critical_periods = true},
+};
+
+typedef struct {
+    gptimer_handle_t timer;
+    TaskHandle_t app_task;
+    esp_mqtt_client_handle_t mqtt;
+    bool critical_periods;
+    volatile bool stop;
+    EventGroupHandle_t done;
+    uint32_t *histogram;
+    volatile uint32_t isr_max_us;
+    ota_bench_result_t *result;
+} bench_t;
+
+static bool IRAM_ATTR on_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg) {
+    bench_t *bench = arg;
+    uint32_t latency = (uint32_t)(edata->count_value - edata->alarm_value);
+    if (latency > bench->isr_max_us) {
+        bench->isr_max_us = latency;
+    }
+    gptimer_alarm_config_t next = {.alarm_count = edata->alarm_value + CONFIG_GECL_OTA_BENCH_PERIOD_US};
+    gptimer_set_alarm_action(timer, &next);
+
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(bench->app_task, (uint32_t)edata->alarm_value, eSetValueWithOverwrite, &woken);
+    return woken == pdTRUE;
+}
+
+/**
+ * The application: woken by each alarm, works for a fixed time and checks its
+ * deadline. Alarms overwritten before the task ran count as missed.
+ */
+static void app_task(void *arg) {
+    bench_t *bench = arg;
+    ota_bench_result_t *result = bench->result;
+    uint32_t last_alarm = 0;
+    while (!bench->stop) {
+        uint32_t alarm;
+        if (xTaskNotifyWait(0, 0, &alarm, pdMS_TO_TICKS(100)) != pdTRUE) {
+            continue;
+        }
+        uint64_t now;
+        gptimer_get_raw_count(bench->timer, &now);
+        uint32_t latency = (uint32_t)now - alarm;
+        uint32_t bucket = latency / BENCH_BUCKET_US;
+        bench->histogram[bucket < BENCH_BUCKETS ? bucket : BENCH_BUCKETS - 1]++;
+        if (latency > result->latency_max_us) {
+            result->latency_max_us = latency;
+        }
+        if (last_alarm != 0 && alarm - last_alarm > CONFIG_GECL_OTA_BENCH_PERIOD_US) {
+            result->missed += (alarm - last_alarm) / CONFIG_GECL_OTA_BENCH_PERIOD_US - 1;
+        }
+        last_alarm = alarm;
+        result->activations++;
+
+        if (bench->critical_periods) {
+            ota_critical_enter();
+        }
+        do {
+            gptimer_get_raw_count(bench->timer, &now);
+        } while ((uint32_t)now - alarm < latency + CONFIG_GECL_OTA_BENCH_WORK_US);
+        if (bench->critical_periods) {
+            ota_critical_exit();
+        }
+        if ((uint32_t)now - alarm > CONFIG_GECL_OTA_BENCH_DEADLINE_US) {
+            result->missed++;
+        }
+    }
+    xEventGroupSetBits(bench->done, BENCH_APP_DONE);
+    vTaskDelete(NULL);
+}
+
+#if CONFIG_GECL_OTA_MQTT_TRANSPORT
+static void mqtt_task(void *arg) {
+    bench_t *bench = arg;
+    ota_bench_result_t *result = bench->result;
+    TickType_t wake = xTaskGetTickCount();
+    while (!bench->stop) {
+        int64_t start_us = esp_timer_get_time();
+        if (esp_mqtt_client_publish(bench->mqtt, "gecl/ota/bench", "tick", 4, 0, 0) >= 0) {
+            result->mqtt_published++;
+        }
+        uint32_t took = (uint32_t)(esp_timer_get_time() - start_us);
+        if (took > result->mqtt_max_us) {
+            result->mqtt_max_us = took;
+        }
+        xTaskDelayUntil(&wake, pdMS_TO_TICKS(CONFIG_GECL_OTA_BENCH_MQTT_PERIOD_MS));
+    }
+    xEventGroupSetBits(bench->done, BENCH_MQTT_DONE);
+    vTaskDelete(NULL);
+}
+#endif
+
+/**
+ * Downloads and writes the image like ota_task, without switching the boot
+ * partition.
+ */
+static esp_err_t bench_update(const ota_config_t *ota) {
+    ota_source_t source = {0};
+    ota_manifest_t manifest = {0};
+    const ota_manifest_t *verify = NULL;
+    const char *uri = ota->url;
+    esp_err_t err = ESP_OK;
+    if (ota->manifest_url[0] != '\0') {
+        err = ota_manifest_fetch(ota, &source, &manifest);
+        verify = &manifest;
+        uri = manifest.image_url;
+    }
+
+    if (err == ESP_OK) {
+        err = ota_source_reopen(&source, uri, ota);
+    }
+    if (err == ESP_OK) {
+        ota_pipeline_t pipe;
+        err = ota_pipeline_begin(&pipe, verify != NULL ? verify : source.manifest);
+        if (err == ESP_OK) {
+            pipe.defer_boot = true;
+            err = ota_pipeline_run(&pipe, &source);
+            if (err == ESP_OK) {
+                err = ota_pipeline_finish(&pipe);
+            } else {
+                ota_pipeline_abort(&pipe);
+            }
+        }
+    }
+    ota_source_close(&source);
+    ota_manifest_free(&manifest);
+    return err;
+}
+
+static uint32_t percentile(const uint32_t *histogram, uint32_t total, uint32_t per_mille) {
+    uint32_t rank = (uint32_t)(((uint64_t)total * per_mille + 999) / 1000);
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < BENCH_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= rank && seen > 0) {
+            return (i + 1) * BENCH_BUCKET_US;
+        }
+    }
+    return 0;
+}
+
+static esp_err_t run_mode(const ota_config_t *ota, const ota_bench_mode_t *mode, ota_bench_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    result->mode = *mode;
+
+    bench_t bench = {.mqtt = ota->mqtt_client, .critical_periods = mode->critical_periods, .result = result};
+    bench.histogram = calloc(BENCH_BUCKETS, sizeof(uint32_t));
+    bench.done = xEventGroupCreate();
+    if (bench.histogram == NULL || bench.done == NULL) {
+        free(bench.histogram);
+        if (bench.done != NULL) {
+            vEventGroupDelete(bench.done);
+        }
+        return ESP_ERR_NO_MEM;
+    }
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000, // 1 us per count
+    };
+    gptimer_event_callbacks_t callbacks = {.on_alarm = on_alarm};
+    gptimer_alarm_config_t first = {.alarm_count = CONFIG_GECL_OTA_BENCH_PERIOD_US};
+    esp_err_t err = gptimer_new_timer(&timer_config, &bench.timer);
+    if (err == ESP_OK) {
+        err = gptimer_register_event_callbacks(bench.timer, &callbacks, &bench);
+    }
+    if (err == ESP_OK) {
+        err = gptimer_set_alarm_action(bench.timer, &first);
+    }
+    EventBits_t helpers = BENCH_APP_DONE;
+    if (err == ESP_OK && xTaskCreate(app_task, "ota_bench_app", 3072, &bench, CONFIG_GECL_OTA_BENCH_PRIORITY,
+                                     &bench.app_task) != pdPASS) {
+        err = ESP_ERR_NO_MEM;
+    }
+#if CONFIG_GECL_OTA_MQTT_TRANSPORT
+    if (err == ESP_OK && bench.mqtt != NULL) {
+        if (xTaskCreate(mqtt_task, "ota_bench_mqtt", 3072, &bench, 5, NULL) == pdPASS) {
+            helpers |= BENCH_MQTT_DONE;
+        }
+    }
+#endif
+    if (err == ESP_OK) {
+        gptimer_enable(bench.timer);
+        gptimer_start(bench.timer);
+
+        ota_set_pacing(&mode->pacing);
+        int64_t start_us = esp_timer_get_time();
+        if (mode->idle) {
+            vTaskDelay(pdMS_TO_TICKS(CONFIG_GECL_OTA_BENCH_IDLE_MS));
+            result->ota_result = ESP_OK;
+        } else {
+            result->ota_result = bench_update(ota);
+            ota_metrics_t metrics;
+            if (ota_get_last_metrics(&metrics) == ESP_OK) {
+                result->max_stall_us = metrics.max_stall_us;
+            }
+        }
+        result->ota_duration_us = esp_timer_get_time() - start_us;
+        ota_set_pacing(NULL);
+
+        bench.stop = true;
+        xEventGroupWaitBits(bench.done, helpers, pdFALSE, pdTRUE, portMAX_DELAY);
+        gptimer_stop(bench.timer);
+        gptimer_disable(bench.timer);
+
+        result->isr_latency_max_us = bench.isr_max_us;
+        result->latency_p50_us = percentile(bench.histogram, result->activations, 500);
+        result->latency_p99_us = percentile(bench.histogram, result->activations, 990);
+        result->latency_p999_us = percentile(bench.histogram, result->activations, 999);
+    }
+
+    if (bench.timer != NULL) {
+        gptimer_del_timer(bench.timer);
+    }
+    vEventGroupDelete(bench.done);
+    free(bench.histogram);
+    return err;
+}
+
+/**
+ * Runs the benchmark once per mode and logs a summary table. modes may be NULL
+ * for the OTA_BENCH_DEFAULT_MODES default modes: idle baseline, Kconfig
+ * pacing, no pacing, 1 ms stall budget, critical periods. results receives
+ * count entries. The image is written to the passive partition each time but
+ * never set as boot partition.
+ */
+esp_err_t ota_bench_run(const ota_config_t *ota, const ota_bench_mode_t *modes, size_t count,
+                        ota_bench_result_t *results) {
+    if (modes == NULL) {
+        modes = default_modes;
+        count = count < OTA_BENCH_DEFAULT_MODES ? count : OTA_BENCH_DEFAULT_MODES;
+    }
+    if (!ota_claim_session()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < count && err == ESP_OK; i++) {
+        err = run_mode(ota, &modes[i], &results[i]);
+    }
+    ota_trace_stop(err);
+    ota_release_session();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Benchmark failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "period %d us, work %d us, deadline %d us", CONFIG_GECL_OTA_BENCH_PERIOD_US,
+             CONFIG_GECL_OTA_BENCH_WORK_US, CONFIG_GECL_OTA_BENCH_DEADLINE_US);
+    ESP_LOGI(TAG, "mode                      p50    p99  p99.9    max  missed  isr max  stall    ota ms");
+    for (size_t i = 0; i < count; i++) {
+        const ota_bench_result_t *r = &results[i];
+        char name[32];
+        if (r->mode.idle) {
+            strlcpy(name, "idle", sizeof(name));
+        } else {
+            snprintf(name, sizeof(name), "%" PRIu32 "ms/%" PRIu32 "us%s", r->mode.pacing.delay_ms,
+                     r->mode.pacing.max_stall_us, r->mode.critical_periods ? "/critical" : "");
+        }
+        ESP_LOGI(TAG, "%-22s %6" PRIu32 " %6" PRIu32 " %6" PRIu32 " %6" PRIu32 " %7" PRIu32 " %8" PRIu32 " %6" PRIi64
+                      " %9" PRIi64 "%s",
+                 name, r->latency_p50_us, r->latency_p99_us, r->latency_p999_us, r->latency_max_us, r->missed,
+                 r->isr_latency_max_us, r->max_stall_us, r->ota_duration_us / 1000,
+                 r->ota_result == ESP_OK ? "" : " (update failed)");
+    }
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t ota_bench_run(const ota_config_t *ota, const ota_bench_mode_t *modes, size_t count,
+                        ota_bench_result_t *results) {
+    return ESP_ERR_NOT_SUPPORTED; // Enable GECL_OTA_BENCH
+}
+
+#endif // CONFIG_GECL_OTA_BENCH
@@ -0,0 +1,604 @@
+/*
+ * CoAP Block-Wise Image Source
+ * ============================
+ *
+ * Fetches the image with CoAP block-wise transfer (RFC 7959, Block2) for
+ * devices on lossy, high-latency links where a TLS connection per Range
+ * request is too heavy:
+ *
+ *   coap://<host>[:port]/<path>    plain UDP, port 5683 by default
+ *   coaps://<host>[:port]/<path>   DTLS, port 5684 by default
+ *
+ * coaps uses the pre-shared key from GECL_OTA_COAP_PSK_IDENTITY and
+ * GECL_OTA_COAP_PSK when set, the embedded CA certificate otherwise.
+ *
+ * Every block is a confirmable GET retransmitted with exponential back-off as
+ * RFC 7252 prescribes. The block size adapts to the link: a block that needed
+ * a retransmission halves the size of the following requests, and a run of
+ * blocks acknowledged on first transmission doubles it again, up to
+ * GECL_OTA_COAP_MAX_BLOCK_SIZE. Since any byte offset aligned to the block size
+ * maps to a block number, resuming after a failure and ranged re-fetches are
+ * plain Block2 requests.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ssl.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_COAP";
+
+// RFC 7252 transmission parameters
+#define COAP_ACK_TIMEOUT_MS 2000
+#define COAP_MAX_RETRANSMIT 4
+#define COAP_EXCHANGE_LIFETIME_MS 30000 // Wait for a separate response after an empty ACK
+
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+#define COAP_CODE_EMPTY 0x00
+#define COAP_CODE_GET 0x01
+#define COAP_CODE_CONTENT 0x45   // 2.05
+#define COAP_CODE_NOT_FOUND 0x84 // 4.04
+
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_URI_QUERY 15
+#define COAP_OPTION_BLOCK2 23
+#define COAP_OPTION_SIZE2 28
+
+#define COAP_TOKEN_LEN 4
+#define COAP_MIN_SZX 2     // 64-byte blocks
+#define COAP_GROW_STREAK 8 // Clean exchanges before the block size doubles
+#define COAP_MESSAGE_SIZE (CONFIG_GECL_OTA_COAP_MAX_BLOCK_SIZE + 256)
+
+typedef struct {
+    int sock;
+    bool secure;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt ca;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    int64_t timer_start_us; // DTLS retransmission timer
+    uint32_t timer_int_ms;
+    uint32_t timer_fin_ms;
+    char host[64];
+    char path[192]; // Path and query of the image resource, without the leading '/'
+    uint16_t message_id;
+    uint32_t token;
+    uint8_t szx; // Current block size exponent, blocks are 16 << szx bytes
+    uint8_t max_szx;
+    uint32_t streak; // Exchanges completed without a retransmission
+    uint8_t *msg;
+    size_t pos; // Next byte read() returns
+} coap_source_t;
+
+/* Datagram transport, plain or DTLS */
+
+static int dtls_send(void *ctx, const unsigned char *buf, size_t len) {
+    coap_source_t *coap = ctx;
+    int n = send(coap->sock, buf, len, 0);
+    return n < 0 ? MBEDTLS_ERR_SSL_WANT_WRITE : n;
+}
+
+static int wait_readable(int sock, uint32_t timeout_ms) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    return select(sock + 1, &fds, NULL, NULL, &tv);
+}
+
+static int dtls_recv_timeout(void *ctx, unsigned char *buf, size_t len, uint32_t timeout_ms) {
+    coap_source_t *coap = ctx;
+    if (wait_readable(coap->sock, timeout_ms) <= 0) {
+        return MBEDTLS_ERR_SSL_TIMEOUT;
+    }
+    int n = recv(coap->sock, buf, len, 0);
+    return n < 0 ? MBEDTLS_ERR_SSL_WANT_READ : n;
+}
+
+static void dtls_set_timer(void *ctx, uint32_t int_ms, uint32_t fin_ms) {
+    coap_source_t *coap = ctx;
+    coap->timer_start_us = esp_timer_get_time();
+    coap->timer_int_ms = int_ms;
+    coap->timer_fin_ms = fin_ms;
+}
+
+static int dtls_get_timer(void *ctx) {
+    coap_source_t *coap = ctx;
+    if (coap->timer_fin_ms == 0) {
+        return -1; // Cancelled
+    }
+    int64_t elapsed_ms = (esp_timer_get_time() - coap->timer_start_us) / 1000;
+    if (elapsed_ms >= coap->timer_fin_ms) {
+        return 2;
+    }
+    return elapsed_ms >= coap->timer_int_ms ? 1 : 0;
+}
+
+static void dtls_init(coap_source_t *coap) {
+    mbedtls_ssl_init(&coap->ssl);
+    mbedtls_ssl_config_init(&coap->conf);
+    mbedtls_x509_crt_init(&coap->ca);
+    mbedtls_entropy_init(&coap->entropy);
+    mbedtls_ctr_drbg_init(&coap->drbg);
+}
+
+static esp_err_t dtls_connect(coap_source_t *coap) {
+    if (mbedtls_ctr_drbg_seed(&coap->drbg, mbedtls_entropy_func, &coap->entropy, NULL, 0) != 0 ||
+        mbedtls_ssl_config_defaults(&coap->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_DATAGRAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+        return ESP_FAIL;
+    }
+    mbedtls_ssl_conf_rng(&coap->conf, mbedtls_ctr_drbg_random, &coap->drbg);
+    mbedtls_ssl_conf_handshake_timeout(&coap->conf, COAP_ACK_TIMEOUT_MS, COAP_EXCHANGE_LIFETIME_MS);
+
+    const char *identity = CONFIG_GECL_OTA_COAP_PSK_IDENTITY;
+    if (identity[0] != '\0') {
+        uint8_t psk[32];
+        size_t psk_len = strlen(CONFIG_GECL_OTA_COAP_PSK) / 2;
+        if (psk_len == 0 || psk_len > sizeof(psk) || ota_hex_decode(CONFIG_GECL_OTA_COAP_PSK, psk, psk_len) != ESP_OK ||
+            mbedtls_ssl_conf_psk(&coap->conf, psk, psk_len, (const unsigned char *)identity, strlen(identity)) != 0) {
+            ESP_LOGE(TAG, "Invalid DTLS pre-shared key");
+            return ESP_ERR_INVALID_ARG;
+        }
+    } else {
+        const char *cert = ota_get_server_cert();
+        if (mbedtls_x509_crt_parse(&coap->ca, (const unsigned char *)cert, strlen(cert) + 1) < 0) {
+            return ESP_FAIL;
+        }
+        mbedtls_ssl_conf_ca_chain(&coap->conf, &coap->ca, NULL);
+        mbedtls_ssl_conf_authmode(&coap->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+
+    if (mbedtls_ssl_setup(&coap->ssl, &coap->conf) != 0 || mbedtls_ssl_set_hostname(&coap->ssl, coap->host) != 0) {
+        return ESP_FAIL;
+    }
+    mbedtls_ssl_set_bio(&coap->ssl, coap, dtls_send, NULL, dtls_recv_timeout);
+    mbedtls_ssl_set_timer_cb(&coap->ssl, coap, dtls_set_timer, dtls_get_timer);
+
+    int ret;
+    do {
+        ret = mbedtls_ssl_handshake(&coap->ssl);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "DTLS handshake failed: -0x%04x", (unsigned)-ret);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void dtls_free(coap_source_t *coap) {
+    mbedtls_ssl_free(&coap->ssl);
+    mbedtls_ssl_config_free(&coap->conf);
+    mbedtls_x509_crt_free(&coap->ca);
+    mbedtls_ctr_drbg_free(&coap->drbg);
+    mbedtls_entropy_free(&coap->entropy);
+}
+
+static esp_err_t transport_send(coap_source_t *coap, const uint8_t *buf, size_t len) {
+    int n = coap->secure ? mbedtls_ssl_write(&coap->ssl, buf, len) : send(coap->sock, buf, len, 0);
+    return n == (int)len ? ESP_OK : ESP_FAIL;
+}
+
+/**
+ * Receives one datagram. Returns its length, 0 on timeout and -1 when the
+ * DTLS session is gone.
+ */
+static int transport_recv(coap_source_t *coap, uint8_t *buf, size_t len, uint32_t timeout_ms) {
+    if (!coap->secure) {
+        if (wait_readable(coap->sock, timeout_ms) <= 0) {
+            return 0;
+        }
+        int n = recv(coap->sock, buf, len, 0);
+        return n < 0 ? 0 : n;
+    }
+    mbedtls_ssl_conf_read_timeout(&coap->conf, timeout_ms);
+    int n = mbedtls_ssl_read(&coap->ssl, buf, len);
+    if (n == MBEDTLS_ERR_SSL_TIMEOUT || n == MBEDTLS_ERR_SSL_WANT_READ) {
+        return 0;
+    }
+    return n > 0 ? n : -1;
+}
+
+/* CoAP messages */
+
+static uint8_t *put_option(uint8_t *p, uint16_t *last, uint16_t number, const uint8_t *value, size_t len) {
+    uint16_t delta = number - *last;
+    *last = number;
+    uint8_t *head = p++;
+    uint8_t d = delta < 13 ? delta : delta < 269 ? 13 : 14;
+    uint8_t l = len < 13 ? len : len < 269 ? 13 : 14;
+    *head = d << 4 | l;
+    if (d == 13) {
+        *p++ = delta - 13;
+    } else if (d == 14) {
+        *p++ = (delta - 269) >> 8;
+        *p++ = (delta - 269) & 0xff;
+    }
+    if (l == 13) {
+        *p++ = len - 13;
+    } else if (l == 14) {
+        *p++ = (len - 269) >> 8;
+        *p++ = (len - 269) & 0xff;
+    }
+    memcpy(p, value, len);
+    return p + len;
+}
+
+static uint8_t *put_uint_option(uint8_t *p, uint16_t *last, uint16_t number, uint32_t value) {
+    uint8_t bytes[4];
+    size_t len = 0;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if (len > 0 || (value >> shift) & 0xff) {
+            bytes[len++] = (value >> shift) & 0xff;
+        }
+    }
+    return put_option(p, last, number, bytes, len);
+}
+
+/**
+ * Builds a confirmable GET for one block of the image resource.
+ */
+static size_t build_request(coap_source_t *coap, uint32_t num, uint8_t szx, bool ask_size) {
+    uint8_t *p = coap->msg;
+    *p++ = 0x40 | COAP_TYPE_CON << 4 | COAP_TOKEN_LEN;
+    *p++ = COAP_CODE_GET;
+    *p++ = coap->message_id >> 8;
+    *p++ = coap->message_id & 0xff;
+    memcpy(p, &coap->token, COAP_TOKEN_LEN);
+    p += COAP_TOKEN_LEN;
+
+    uint16_t last = 0;
+    const char *query = strchr(coap->path, '?');
+    size_t path_len = query != NULL ? (size_t)(query - coap->path) : strlen(coap->path);
+    for (size_t start = 0; start < path_len;) {
+        const char *slash = memchr(coap->path + start, '/', path_len - start);
+        size_t end = slash != NULL ? (size_t)(slash - coap->path) : path_len;
+        p = put_option(p, &last, COAP_OPTION_URI_PATH, (const uint8_t *)coap->path + start, end - start);
+        start = end + 1;
+    }
+    for (const char *q = query; q != NULL;) {
+        const char *amp = strchr(q + 1, '&');
+        size_t len = amp != NULL ? (size_t)(amp - q - 1) : strlen(q + 1);
+        p = put_option(p, &last, COAP_OPTION_URI_QUERY, (const uint8_t *)q + 1, len);
+        q = amp;
+    }
+    p = put_uint_option(p, &last, COAP_OPTION_BLOCK2, num << 4 | szx);
+    if (ask_size) {
+        p = put_uint_option(p, &last, COAP_OPTION_SIZE2, 0);
+    }
+    return p - coap->msg;
+}
+
+typedef struct {
+    uint8_t type;
+    uint8_t code;
+    uint16_t message_id;
+    bool token_ok;
+    bool has_block2;
+    uint32_t block_num;
+    bool block_more;
+    uint8_t block_szx;
+    uint32_t size2;
+    const uint8_t *payload;
+    size_t payload_len;
+} coap_response_t;
+
+static uint32_t read_uint(const uint8_t *p, size_t len) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < len && i < 4; i++) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+static bool parse_response(coap_source_t *coap, const uint8_t *msg, size_t len, coap_response_t *res) {
+    memset(res, 0, sizeof(*res));
+    if (len < 4 || msg[0] >> 6 != 1) {
+        return false;
+    }
+    res->type = msg[0] >> 4 & 0x3;
+    uint8_t tkl = msg[0] & 0xf;
+    res->code = msg[1];
+    res->message_id = msg[2] << 8 | msg[3];
+    if (tkl > 8 || (size_t)4 + tkl > len) {
+        return false;
+    }
+    res->token_ok = tkl == COAP_TOKEN_LEN && memcmp(&msg[4], &coap->token, COAP_TOKEN_LEN) == 0;
+
+    const uint8_t *p = msg + 4 + tkl;
+    const uint8_t *end = msg + len;
+    uint16_t number = 0;
+    while (p < end && *p != 0xff) {
+        uint32_t delta = *p >> 4;
+        uint32_t olen = *p & 0xf;
+        p++;
+        if (delta == 13 || olen == 13 || delta == 14 || olen == 14) {
+            if (delta == 13 && p < end) {
+                delta = 13 + *p++;
+            } else if (delta == 14 && p + 1 < end) {
+                delta = 269 + (p[0] << 8 | p[1]);
+                p += 2;
+            }
+            if (olen == 13 && p < end) {
+                olen = 13 + *p++;
+            } else if (olen == 14 && p + 1 < end) {
+                olen = 269 + (p[0] << 8 | p[1]);
+                p += 2;
+            }
+        }
+        if (delta == 15 || olen == 15 || p + olen > end) {
+            return false;
+        }
+        number += delta;
+        if (number == COAP_OPTION_BLOCK2) {
+            uint32_t value = read_uint(p, olen);
+            res->has_block2 = true;
+            res->block_num = value >> 4;
+            res->block_more = value & 0x8;
+            res->block_szx = value & 0x7;
+        } else if (number == COAP_OPTION_SIZE2) {
+            res->size2 = read_uint(p, olen);
+        }
+        p += olen;
+    }
+    if (p < end) {
+        res->payload = p + 1; // Skip the payload marker
+        res->payload_len = end - p - 1;
+    }
+    return true;
+}
+
+static void send_empty_ack(coap_source_t *coap, uint16_t message_id) {
+    uint8_t ack[4] = {0x40 | COAP_TYPE_ACK << 4, COAP_CODE_EMPTY, message_id >> 8, message_id & 0xff};
+    transport_send(coap, ack, sizeof(ack));
+}
+
+/**
+ * Fetches block num at size 16 << szx and copies up to cap bytes of its
+ * payload, starting skip bytes in, to out. Adapts the block size from whether a retransmission was
+ * needed.
+ */
+static esp_err_t fetch_block(ota_source_t *src, coap_source_t *coap, uint32_t num, uint8_t szx, size_t skip,
+                             uint8_t *out, size_t cap, size_t *out_len) {
+    coap->message_id++;
+    coap->token = esp_random();
+    size_t req_len = build_request(coap, num, szx, src->size == 0);
+    uint8_t *request = malloc(req_len);
+    if (request == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(request, coap->msg, req_len);
+    src->requests++;
+
+    // Initial timeout randomised between ACK_TIMEOUT and 1.5 * ACK_TIMEOUT
+    uint32_t timeout_ms = COAP_ACK_TIMEOUT_MS + esp_random() % (COAP_ACK_TIMEOUT_MS / 2);
+    esp_err_t err = ESP_ERR_TIMEOUT;
+    bool acked = false; // An empty ACK promised a separate response
+    int transmissions = 0;
+    while (transmissions <= COAP_MAX_RETRANSMIT && err == ESP_ERR_TIMEOUT) {
+        if (!acked) {
+            transport_send(coap, request, req_len);
+            transmissions++;
+        }
+        int64_t deadline = esp_timer_get_time() + (int64_t)(acked ? COAP_EXCHANGE_LIFETIME_MS : timeout_ms) * 1000;
+        while (err == ESP_ERR_TIMEOUT) {
+            int64_t remaining_us = deadline - esp_timer_get_time();
+            if (remaining_us <= 0) {
+                break;
+            }
+            int n = transport_recv(coap, coap->msg, COAP_MESSAGE_SIZE, remaining_us / 1000 + 1);
+            coap_response_t res;
+            if (n < 0) {
+                err = ESP_FAIL;
+            } else if (n > 0 && parse_response(coap, coap->msg, n, &res)) {
+                if (res.type == COAP_TYPE_RST && res.message_id == coap->message_id) {
+                    err = ESP_ERR_INVALID_RESPONSE;
+                } else if (res.type == COAP_TYPE_ACK && res.code == COAP_CODE_EMPTY &&
+                           res.message_id == coap->message_id) {
+                    acked = true;
+                    deadline = esp_timer_get_time() + (int64_t)COAP_EXCHANGE_LIFETIME_MS * 1000;
+                } else if (res.token_ok && res.code != COAP_CODE_EMPTY) {
+                    if (res.type == COAP_TYPE_CON) {
+                        send_empty_ack(coap, res.message_id);
+                    }
+                    if (res.code != COAP_CODE_CONTENT) {
+                        ESP_LOGE(TAG, "Server answered %u.%02u", res.code >> 5, res.code & 0x1f);
+                        err = res.code == COAP_CODE_NOT_FOUND ? ESP_ERR_NOT_FOUND : ESP_ERR_INVALID_RESPONSE;
+                    } else if (!res.has_block2 || res.block_szx > szx ||
+                               ((size_t)res.block_num << (res.block_szx + 4)) != ((size_t)num << (szx + 4))) {
+                        err = ESP_ERR_INVALID_RESPONSE; // Not the block asked for
+                    } else {
+                        if (res.size2 != 0) {
+                            src->size = res.size2;
+                        }
+                        if (szx != res.block_szx) {
+                            coap->szx = res.block_szx; // The server prefers smaller blocks
+                        }
+                        size_t avail = res.payload_len > skip ? res.payload_len - skip : 0;
+                        *out_len = avail < cap ? avail : cap;
+                        memcpy(out, res.payload + skip, *out_len);
+                        src->copied += *out_len;
+                        if (!res.block_more && src->size == 0) {
+                            src->size = ((size_t)num << (szx + 4)) + res.payload_len;
+                        }
+                        err = ESP_OK;
+                    }
+                }
+            }
+        }
+        if (acked && err == ESP_ERR_TIMEOUT) {
+            break; // The separate response never came
+        }
+        timeout_ms *= 2;
+    }
+    free(request);
+
+    if (err == ESP_OK && transmissions == 1) {
+        if (++coap->streak >= COAP_GROW_STREAK && coap->szx < coap->max_szx) {
+            coap->szx++;
+            coap->streak = 0;
+        }
+    } else if (transmissions > 1) {
+        coap->streak = 0;
+        if (coap->szx > COAP_MIN_SZX) {
+            coap->szx--;
+            ESP_LOGW(TAG, "Retransmission needed, block size now %u", 16u << coap->szx);
+        }
+    }
+    return err;
+}
+
+/**
+ * Reads the image bytes at offset, preferring the largest allowed block whose
+ * boundaries line up with the offset.
+ */
+static esp_err_t fetch_at(ota_source_t *src, coap_source_t *coap, size_t offset, uint8_t *out, size_t cap,
+                          size_t *out_len) {
+    uint8_t szx = coap->szx;
+    while (szx > 0 && (offset % (16u << szx) != 0 || (16u << szx) > cap)) {
+        szx--;
+    }
+    return fetch_block(src, coap, offset >> (szx + 4), szx, offset & ((16u << szx) - 1), out, cap, out_len);
+}
+
+static esp_err_t coap_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    bool secure = strncmp(uri, "coaps://", strlen("coaps://")) == 0;
+    const char *hostport = uri + strlen(secure ? "coaps://" : "coap://");
+    const char *slash = strchr(hostport, '/');
+    const char *colon = memchr(hostport, ':', slash != NULL ? (size_t)(slash - hostport) : strlen(hostport));
+    const char *host_end = colon != NULL ? colon : slash != NULL ? slash : hostport + strlen(hostport);
+
+    coap_source_t *coap = calloc(1, sizeof(*coap));
+    if (coap == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    coap->sock = -1;
+    coap->secure = secure;
+    if (secure) {
+        dtls_init(coap);
+    }
+    esp_err_t err = ESP_OK;
+    if ((size_t)(host_end - hostport) >= sizeof(coap->host) ||
+        (slash != NULL && strlen(slash + 1) >= sizeof(coap->path))) {
+        err = ESP_ERR_INVALID_ARG;
+        goto cleanup;
+    }
+    memcpy(coap->host, hostport, host_end - hostport);
+    if (slash != NULL) {
+        strcpy(coap->path, slash + 1);
+    }
+    char port[8];
+    snprintf(port, sizeof(port), "%d", colon != NULL ? atoi(colon + 1) : secure ? 5684 : 5683);
+
+    coap->msg = malloc(COAP_MESSAGE_SIZE);
+    if (coap->msg == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(coap->host, port, &hints, &res) != 0 || res == NULL) {
+        err = ESP_ERR_NOT_FOUND;
+        goto cleanup;
+    }
+    coap->sock = socket(res->ai_family, res->ai_socktype, 0);
+    if (coap->sock < 0 || connect(coap->sock, res->ai_addr, res->ai_addrlen) != 0) {
+        freeaddrinfo(res);
+        err = ESP_FAIL;
+        goto cleanup;
+    }
+    freeaddrinfo(res);
+
+    if (secure) {
+        err = dtls_connect(coap);
+        if (err != ESP_OK) {
+            goto cleanup;
+        }
+    }
+
+    for (uint8_t szx = 0; szx <= 6 && (16u << szx) <= CONFIG_GECL_OTA_COAP_MAX_BLOCK_SIZE; szx++) {
+        coap->max_szx = szx;
+    }
+    coap->szx = coap->max_szx;
+    coap->message_id = esp_random();
+    src->ctx = coap;
+    ESP_LOGI(TAG, "Fetching /%s from %s:%s over %s", coap->path, coap->host, port, secure ? "DTLS" : "UDP");
+    return ESP_OK;
+
+cleanup:
+    if (secure) {
+        dtls_free(coap);
+    }
+    if (coap->sock >= 0) {
+        close(coap->sock);
+    }
+    free(coap->msg);
+    free(coap);
+    return err;
+}
+
+static int coap_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    coap_source_t *coap = src->ctx;
+    if (src->size != 0 && coap->pos >= src->size) {
+        return 0;
+    }
+    size_t n = 0;
+    esp_err_t err = fetch_at(src, coap, coap->pos, buf, len, &n);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Block at offset %u failed: %s", (unsigned)coap->pos, esp_err_to_name(err));
+        return -1; // The next read resumes at the same block
+    }
+    coap->pos += n;
+    return (int)n;
+}
+
+static esp_err_t coap_read_range(ota_source_t *src, size_t offset, uint8_t *buf, size_t len) {
+    coap_source_t *coap = src->ctx;
+    for (size_t done = 0; done < len;) {
+        size_t n = 0;
+        esp_err_t err = fetch_at(src, coap, offset + done, buf + done, len - done, &n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (n == 0) {
+            return ESP_ERR_INVALID_SIZE; // Past the end of the resource
+        }
+        done += n;
+    }
+    return ESP_OK;
+}
+
+static void coap_close(ota_source_t *src) {
+    coap_source_t *coap = src->ctx;
+    if (coap->secure) {
+        mbedtls_ssl_close_notify(&coap->ssl);
+        dtls_free(coap);
+    }
+    close(coap->sock);
+    free(coap->msg);
+    free(coap);
+}
+
+const ota_source_ops_t ota_source_coap = {
+    .name = "CoAP",
+    .open = coap_open,
+    .read = coap_read,
+    .read_range = coap_read_range,
+    .close = coap_close,
+};
@@ -0,0 +1,223 @@
+/*
+ * Pre-Encrypted Images
+ * ====================
+ *
+ * Decrypts app images stored encrypted at rest, in the format of Espressif's
+ * esp_encrypted_img component, so images produced by its esp_enc_img_gen.py
+ * can be served from a CDN unchanged:
+ *
+ *   offset 0    magic 0x0788b6cf, little endian
+ *   offset 4    AES-256 key, RSA-3072 OAEP (SHA-256) encrypted (384 bytes)
+ *   offset 388  GCM IV (16 bytes)
+ *   offset 404  size of the plaintext image, little endian
+ *   offset 408  GCM tag (16 bytes)
+ *   offset 512  AES-256-GCM ciphertext of the app image
+ *
+ * The stage sits between chunk verification and the write in the pipeline, so
+ * a manifest describes the encrypted file as it is served and chunks are still
+ * verified before they are decrypted. Plaintext is written as it is produced;
+ * the GCM tag is checked in ota_decrypt_finish(), before the image can become
+ * the boot partition.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/pk.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_DECRYPT";
+
+#define ENC_MAGIC 0x0788b6cf
+#define ENC_HEADER_LEN 512
+#define ENC_KEY_LEN 32
+#define ENC_RSA_LEN 384
+#define ENC_IV_OFFSET 388
+#define ENC_IV_LEN 16
+#define ENC_SIZE_OFFSET 404
+#define ENC_TAG_OFFSET 408
+#define ENC_TAG_LEN 16
+
+struct ota_decrypt {
+    uint8_t header[ENC_HEADER_LEN];
+    size_t header_fill;
+    uint32_t plain_size;  // From the header
+    size_t plain_written; // Plaintext bytes produced so far
+    mbedtls_gcm_context gcm;
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+    mbedtls_sha256_context plain_ctx; // Digest of the plaintext, for readback verification
+#endif
+};
+
+static const char *private_key = NULL;
+static size_t private_key_len = 0;
+
+/**
+ * Sets the RSA-3072 private key that unwraps the image keys, as PEM or DER.
+ * For PEM, len includes the terminating NUL. The key is not copied and must
+ * stay valid while updates run.
+ */
+esp_err_t ota_set_decryption_key(const char *rsa_private_key, size_t len) {
+    if (rsa_private_key == NULL || len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    private_key = rsa_private_key;
+    private_key_len = len;
+    return ESP_OK;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Unwraps the image key from the complete header and starts GCM decryption.
+ */
+static esp_err_t start_gcm(ota_decrypt_t *dec) {
+    if (get_le32(dec->header) != ENC_MAGIC) {
+        ESP_LOGE(TAG, "Image is not pre-encrypted");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    dec->plain_size = get_le32(&dec->header[ENC_SIZE_OFFSET]);
+
+    mbedtls_pk_context pk;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_pk_init(&pk);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+
+    esp_err_t err = ESP_FAIL;
+    uint8_t key[ENC_KEY_LEN];
+    size_t key_len = 0;
+    int ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, NULL, 0);
+    if (ret == 0) {
+        ret = mbedtls_pk_parse_key(&pk, (const unsigned char *)private_key, private_key_len, NULL, 0,
+                                   mbedtls_ctr_drbg_random, &drbg);
+    }
+    if (ret != 0 || mbedtls_pk_get_type(&pk) != MBEDTLS_PK_RSA) {
+        ESP_LOGE(TAG, "Invalid decryption key (-0x%x)", (unsigned)-ret);
+        goto cleanup;
+    }
+    mbedtls_rsa_set_padding(mbedtls_pk_rsa(pk), MBEDTLS_RSA_PKCS_V21, MBEDTLS_MD_SHA256);
+    ret = mbedtls_pk_decrypt(&pk, &dec->header[4], ENC_RSA_LEN, key, &key_len, sizeof(key), mbedtls_ctr_drbg_random,
+                             &drbg);
+    if (ret != 0 || key_len != ENC_KEY_LEN) {
+        ESP_LOGE(TAG, "Failed to unwrap the image key (-0x%x), image encrypted for another device?", (unsigned)-ret);
+        goto cleanup;
+    }
+    if (mbedtls_gcm_setkey(&dec->gcm, MBEDTLS_CIPHER_ID_AES, key, ENC_KEY_LEN * 8) != 0 ||
+        mbedtls_gcm_starts(&dec->gcm, MBEDTLS_GCM_DECRYPT, &dec->header[ENC_IV_OFFSET], ENC_IV_LEN) != 0) {
+        goto cleanup;
+    }
+    ESP_LOGI(TAG, "Decrypting image of %" PRIu32 " bytes", dec->plain_size);
+    err = ESP_OK;
+
+cleanup:
+    memset(key, 0, sizeof(key));
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+    mbedtls_pk_free(&pk);
+    return err;
+}
+
+esp_err_t ota_decrypt_begin(ota_decrypt_t **out_dec) {
+    if (private_key == NULL) {
+        ESP_LOGE(TAG, "Pre-encrypted images need ota_set_decryption_key()");
+        return ESP_ERR_INVALID_STATE;
+    }
+    ota_decrypt_t *dec = calloc(1, sizeof(*dec));
+    if (dec == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    mbedtls_gcm_init(&dec->gcm);
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+    mbedtls_sha256_init(&dec->plain_ctx);
+    mbedtls_sha256_starts(&dec->plain_ctx, 0);
+#endif
+    *out_dec = dec;
+    return ESP_OK;
+}
+
+/**
+ * Decrypts the next len bytes of the encrypted file into out, which holds at
+ * least len bytes. *out_len is less than len while the header is consumed.
+ */
+esp_err_t ota_decrypt_update(ota_decrypt_t *dec, const uint8_t *in, size_t len, uint8_t *out, size_t *out_len) {
+    *out_len = 0;
+    if (dec->header_fill < ENC_HEADER_LEN) {
+        size_t take = ENC_HEADER_LEN - dec->header_fill < len ? ENC_HEADER_LEN - dec->header_fill : len;
+        memcpy(&dec->header[dec->header_fill], in, take);
+        dec->header_fill += take;
+        in += take;
+        len -= take;
+        if (dec->header_fill < ENC_HEADER_LEN) {
+            return ESP_OK;
+        }
+        esp_err_t err = start_gcm(dec);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    if (len == 0) {
+        return ESP_OK;
+    }
+    if (dec->plain_written + len > dec->plain_size) {
+        ESP_LOGE(TAG, "Ciphertext longer than the %" PRIu32 " bytes announced", dec->plain_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (mbedtls_gcm_update(&dec->gcm, in, len, out, len, out_len) != 0) {
+        return ESP_FAIL;
+    }
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+    mbedtls_sha256_update(&dec->plain_ctx, out, *out_len);
+#endif
+    dec->plain_written += *out_len;
+    return ESP_OK;
+}
+
+/**
+ * Checks the plaintext size and the GCM tag. plain_sha256 receives the digest
+ * of the plaintext when readback verification is enabled.
+ */
+esp_err_t ota_decrypt_finish(ota_decrypt_t *dec, uint8_t plain_sha256[OTA_SHA256_LEN]) {
+    if (dec->header_fill < ENC_HEADER_LEN || dec->plain_written != dec->plain_size) {
+        ESP_LOGE(TAG, "Decrypted %u of %" PRIu32 " bytes", (unsigned)dec->plain_written, dec->plain_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t tag[ENC_TAG_LEN];
+    size_t tail_len = 0;
+    if (mbedtls_gcm_finish(&dec->gcm, NULL, 0, &tail_len, tag, sizeof(tag)) != 0) {
+        return ESP_FAIL;
+    }
+    uint8_t diff = 0;
+    for (int i = 0; i < ENC_TAG_LEN; i++) {
+        diff |= tag[i] ^ dec->header[ENC_TAG_OFFSET + i]; // Constant time
+    }
+    if (diff != 0) {
+        ESP_LOGE(TAG, "Image authentication tag mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+    mbedtls_sha256_finish(&dec->plain_ctx, plain_sha256);
+#endif
+    return ESP_OK;
+}
+
+void ota_decrypt_free(ota_decrypt_t *dec) {
+    if (dec == NULL) {
+        return;
+    }
+    mbedtls_gcm_free(&dec->gcm);
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+    mbedtls_sha256_free(&dec->plain_ctx);
+#endif
+    memset(dec, 0, sizeof(*dec));
+    free(dec);
+}
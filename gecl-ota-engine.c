@@ -0,0 +1,264 @@
+/*
+ * Step-Driven OTA Engine
+ * ======================
+ *
+ * Runs an update from the application's own main loop or event handler
+ * instead of a dedicated task, so no OTA task stack sits idle in RAM:
+ *
+ *   ota_engine_start() -> ota_engine_step() ... until it returns ESP_OK
+ *
+ * ota_engine_step() returns ESP_ERR_NOT_FINISHED while work remains. Each step
+ * does one bounded piece of work: fetching the manifest, opening the source,
+ * or transferring image data until the step budget is spent, finishing an
+ * image. A transfer step checks its time and byte budget after every source
+ * read, so it overruns by at most one read; a read may still wait for the
+ * network up to the transport's timeout.
+ *
+ * The engine installs the app image and the manifest's data partition images
+ * from the origin, like ota_task without peer-to-peer distribution, and sets
+ * the boot partition. Rebooting is left to the application. The step budget
+ * takes the place of GECL_OTA_PACING_DELAY_MS: the engine never delays.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_ENGINE";
+
+typedef enum {
+    ENGINE_MANIFEST,
+    ENGINE_OPEN,
+    ENGINE_APP,
+    ENGINE_APP_FINISH,
+    ENGINE_PARTITION_BEGIN,
+    ENGINE_PARTITION,
+    ENGINE_PARTITION_FINISH,
+    ENGINE_COMMIT,
+    ENGINE_DONE,
+} engine_state_t;
+
+struct ota_engine {
+    engine_state_t state;
+    ota_config_t config;
+    ota_manifest_t manifest;
+    const ota_manifest_t *verify; // manifest, the transport's in-band manifest or NULL
+    ota_source_t source;
+    ota_pipeline_t pipe;                                    // Image being written
+    const esp_partition_t *app;                             // App partition once written
+    const esp_partition_t *targets[OTA_MAX_PARTITION_IMAGES]; // Data partition image targets
+    int8_t slots[OTA_MAX_PARTITION_IMAGES];
+    uint8_t next; // Data partition image being written
+};
+
+static void end_engine(ota_engine_handle_t engine, esp_err_t err) {
+    ota_pipeline_abort(&engine->pipe); // Nothing to do once the image is finished
+    ota_source_close(&engine->source);
+    ota_manifest_free(&engine->manifest);
+    free(engine);
+    ota_trace_stop(err);
+    ota_release_session();
+    esp_event_post(GECL_OTA_EVENT, err == ESP_OK ? GECL_OTA_EVENT_FINISH : GECL_OTA_EVENT_ABORT, NULL, 0,
+                   portMAX_DELAY);
+}
+
+/**
+ * Starts an update driven by ota_engine_step(). Fails with
+ * ESP_ERR_INVALID_STATE while another OTA session is running.
+ */
+esp_err_t ota_engine_start(const ota_config_t *config, ota_engine_handle_t *out_engine) {
+    if (config == NULL || out_engine == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!ota_claim_session()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    ota_engine_handle_t engine = calloc(1, sizeof(*engine));
+    if (engine == NULL) {
+        ota_trace_stop(ESP_ERR_NO_MEM);
+        ota_release_session();
+        return ESP_ERR_NO_MEM;
+    }
+    engine->config = *config;
+    engine->state = config->manifest_url[0] != '\0' ? ENGINE_MANIFEST : ENGINE_OPEN;
+    esp_event_post(GECL_OTA_EVENT, GECL_OTA_EVENT_START, NULL, 0, portMAX_DELAY);
+    *out_engine = engine;
+    return ESP_OK;
+}
+
+static bool within_budget(const ota_step_budget_t *budget, int64_t start_us, size_t bytes) {
+    if (budget == NULL) {
+        return false; // One read per step
+    }
+    return (budget->max_us == 0 || esp_timer_get_time() - start_us < budget->max_us) &&
+           (budget->max_bytes == 0 || bytes < budget->max_bytes);
+}
+
+/**
+ * Pulls image data until the budget is spent or the image is complete.
+ */
+static esp_err_t transfer(ota_engine_handle_t engine, const ota_step_budget_t *budget) {
+    int64_t start_us = esp_timer_get_time();
+    size_t start_bytes = engine->pipe.metrics.bytes_received;
+    bool done = false;
+    esp_err_t err;
+    do {
+        err = ota_pipeline_pull(&engine->pipe, &engine->source, &done);
+    } while (err == ESP_OK && !done &&
+             within_budget(budget, start_us, engine->pipe.metrics.bytes_received - start_bytes));
+    if (err == ESP_OK && done) {
+        engine->state = engine->state == ENGINE_APP ? ENGINE_APP_FINISH : ENGINE_PARTITION_FINISH;
+    }
+    return err;
+}
+
+/**
+ * Starts the pipeline of the current image. The step budget paces the engine.
+ */
+static void prepare_pipe(ota_engine_handle_t engine) {
+    engine->pipe.pacing.delay_ms = 0;
+    engine->pipe.metrics.buffer_bytes += engine->source.buffer_bytes;
+}
+
+/**
+ * Resolves the A/B slots of the manifest's data partition images, as
+ * plan_partitions() in gecl-ota-manager.c does, before anything is written.
+ */
+static esp_err_t plan_partitions(ota_engine_handle_t engine) {
+    const ota_manifest_t *manifest = engine->verify;
+    for (uint8_t i = 0; i < manifest->artifact_count; i++) {
+        esp_err_t err = ota_slots_target(manifest->artifacts[i].label, &engine->targets[i], &engine->slots[i]);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t step(ota_engine_handle_t engine, const ota_step_budget_t *budget) {
+    esp_err_t err = ESP_OK;
+    uint8_t index = engine->next;
+    switch (engine->state) {
+    case ENGINE_MANIFEST:
+        ESP_LOGI(TAG, "Using manifest: %s", engine->config.manifest_url);
+        err = ota_manifest_fetch(&engine->config, &engine->source, &engine->manifest);
+        if (err == ESP_OK) {
+            engine->verify = &engine->manifest;
+            engine->state = ENGINE_OPEN;
+        }
+        break;
+
+    case ENGINE_OPEN:
+        err = ota_source_check_verified(engine->config.url, engine->verify);
+        if (err == ESP_OK) {
+            // Reuses the manifest's connection when the image is on the same server
+            err = ota_source_reopen(&engine->source,
+                                    engine->verify != NULL ? engine->manifest.image_url : engine->config.url,
+                                    &engine->config);
+        }
+        if (err != ESP_OK) {
+            break;
+        }
+        esp_event_post(GECL_OTA_EVENT, GECL_OTA_EVENT_CONNECTED, NULL, 0, portMAX_DELAY);
+        if (engine->verify == NULL) {
+            engine->verify = engine->source.manifest; // Delivered in-band by the transport, if at all
+        }
+        if (engine->verify != NULL && engine->verify->artifact_count > 0) {
+            err = plan_partitions(engine);
+        }
+        if (err == ESP_OK) {
+            err = ota_pipeline_begin(&engine->pipe, engine->verify);
+        }
+        if (err == ESP_OK) {
+            engine->pipe.defer_boot = true; // Set in ENGINE_COMMIT, after the data partitions
+            prepare_pipe(engine);
+            engine->state = ENGINE_APP;
+        }
+        break;
+
+    case ENGINE_APP:
+    case ENGINE_PARTITION:
+        err = transfer(engine, budget);
+        break;
+
+    case ENGINE_APP_FINISH:
+        err = ota_pipeline_finish(&engine->pipe);
+        if (err == ESP_OK) {
+            engine->app = engine->pipe.partition;
+            bool partitions = engine->verify != NULL && engine->verify->artifact_count > 0;
+            engine->state = partitions ? ENGINE_PARTITION_BEGIN : ENGINE_COMMIT;
+        }
+        break;
+
+    case ENGINE_PARTITION_BEGIN: {
+        const ota_manifest_t *image = &engine->verify->artifacts[index];
+        ESP_LOGI(TAG, "Updating partition %s from %s", engine->targets[index]->label, image->image_url);
+        err = ota_source_reopen(&engine->source, image->image_url, &engine->config);
+        if (err == ESP_OK) {
+            err = ota_pipeline_begin_partition(&engine->pipe, image, engine->targets[index]);
+        }
+        if (err == ESP_OK) {
+            prepare_pipe(engine);
+            engine->state = ENGINE_PARTITION;
+        }
+        break;
+    }
+
+    case ENGINE_PARTITION_FINISH:
+        err = ota_pipeline_finish(&engine->pipe);
+        if (err == ESP_OK) {
+            engine->state = ++engine->next < engine->verify->artifact_count ? ENGINE_PARTITION_BEGIN : ENGINE_COMMIT;
+        }
+        break;
+
+    case ENGINE_COMMIT:
+        if (engine->verify != NULL && engine->verify->artifact_count > 0) {
+            err = ota_slots_commit(engine->app, engine->verify, engine->slots);
+        }
+        if (err == ESP_OK) {
+            err = esp_ota_set_boot_partition(engine->app);
+        }
+        engine->state = ENGINE_DONE;
+        break;
+
+    case ENGINE_DONE:
+        break;
+    }
+    return err;
+}
+
+/**
+ * Does the next piece of the update within budget; a NULL budget allows one
+ * source read. Returns ESP_ERR_NOT_FINISHED while more steps are needed and
+ * ESP_OK once the new image is the boot partition. On ESP_OK or an error the
+ * engine is released and the handle becomes invalid.
+ */
+esp_err_t ota_engine_step(ota_engine_handle_t engine, const ota_step_budget_t *budget) {
+    if (engine == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = step(engine, budget);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Update failed: %s", esp_err_to_name(err));
+        end_engine(engine, err);
+        return err;
+    }
+    if (engine->state != ENGINE_DONE) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+    ESP_LOGI(TAG, "Update installed, reboot to run it");
+    end_engine(engine, ESP_OK);
+    return ESP_OK;
+}
+
+/**
+ * Discards everything written so far and releases the engine.
+ */
+void ota_engine_abort(ota_engine_handle_t engine) {
+    if (engine != NULL) {
+        end_engine(engine, ESP_FAIL);
+    }
+}
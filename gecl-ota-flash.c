@@ -0,0 +1,175 @@
+/*
+ * OTA Flash Writes and Critical Periods
+ * =====================================
+ *
+ * Every flash erase or program disables the flash cache: the other core stalls
+ * on its next flash access and only IRAM interrupt handlers run. This file
+ * bounds those stalls for real-time tasks sharing the chip with an update:
+ *
+ *   - Programs are split into slices. With a stall budget set
+ *     (GECL_OTA_MAX_STALL_US or ota_set_pacing()), the slice size adapts
+ *     between one flash page and one sector so that each program stays within
+ *     the budget. Erases cannot be split below one sector; they are issued
+ *     one sector at a time.
+ *   - Applications bracket deadline-sensitive work with ota_critical_enter()
+ *     and ota_critical_exit(). No flash operation runs inside such a period;
+ *     the update waits for it to end. Entering waits for an operation already
+ *     in progress, at most one slice.
+ *
+ * The longest single operation and the time spent waiting for critical
+ * periods are reported in the session metrics.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <inttypes.h>
+
+static const char *TAG = "OTA_FLASH";
+
+// Smallest program slice, one flash page
+#define OTA_MIN_SLICE 256
+
+#define GATE_OPEN_BIT (1 << 0)
+
+static SemaphoreHandle_t gate_mutex = NULL; // Held for the duration of each flash operation
+static EventGroupHandle_t gate_events = NULL;
+static uint32_t critical_depth = 0;
+
+void ota_flash_gate_init(void) {
+    if (gate_mutex == NULL) {
+        gate_mutex = xSemaphoreCreateMutex();
+        gate_events = xEventGroupCreate();
+        xEventGroupSetBits(gate_events, GATE_OPEN_BIT);
+    }
+}
+
+/**
+ * Starts a critical period: OTA flash operations are deferred until the
+ * matching ota_critical_exit(). Periods may nest and overlap across tasks.
+ * Returns once no flash operation is in progress.
+ */
+void ota_critical_enter(void) {
+    if (gate_mutex == NULL) {
+        return; // init_ota_handler() not called, no update can run
+    }
+    xSemaphoreTake(gate_mutex, portMAX_DELAY);
+    if (critical_depth++ == 0) {
+        xEventGroupClearBits(gate_events, GATE_OPEN_BIT);
+    }
+    xSemaphoreGive(gate_mutex);
+}
+
+void ota_critical_exit(void) {
+    if (gate_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(gate_mutex, portMAX_DELAY);
+    if (critical_depth > 0 && --critical_depth == 0) {
+        xEventGroupSetBits(gate_events, GATE_OPEN_BIT);
+    }
+    xSemaphoreGive(gate_mutex);
+}
+
+/**
+ * Waits until no critical period is active and holds the gate.
+ */
+static void gate_acquire(ota_pipeline_t *pipe) {
+    if (gate_mutex == NULL) {
+        return;
+    }
+    int64_t start_us = esp_timer_get_time();
+    xSemaphoreTake(gate_mutex, portMAX_DELAY);
+    bool deferred = critical_depth > 0;
+    while (critical_depth > 0) {
+        xSemaphoreGive(gate_mutex);
+        xEventGroupWaitBits(gate_events, GATE_OPEN_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(gate_mutex, portMAX_DELAY);
+    }
+    pipe->metrics.deferred_us += esp_timer_get_time() - start_us;
+    if (deferred) {
+        ota_trace_event(OTA_TRACE_DEFER, start_us, 0);
+    }
+}
+
+static void gate_release(void) {
+    if (gate_mutex != NULL) {
+        xSemaphoreGive(gate_mutex);
+    }
+}
+
+/**
+ * Records the duration of one flash operation and, when it was a program
+ * slice without an erase, adapts the slice size to the stall budget.
+ */
+static void account(ota_pipeline_t *pipe, int64_t stall_us, bool adapt) {
+    if (stall_us > pipe->metrics.max_stall_us) {
+        pipe->metrics.max_stall_us = stall_us;
+    }
+    uint32_t budget_us = pipe->pacing.max_stall_us;
+    if (!adapt || budget_us == 0) {
+        return;
+    }
+    if (stall_us > budget_us && pipe->slice > OTA_MIN_SLICE) {
+        pipe->slice /= 2;
+        ESP_LOGD(TAG, "Program took %" PRIi64 " us, slice now %u bytes", stall_us, (unsigned)pipe->slice);
+    } else if (stall_us < budget_us / 2 && pipe->slice < OTA_SECTOR_SIZE) {
+        pipe->slice *= 2;
+    }
+}
+
+/**
+ * Erases and programs one sector at offset, or the leading part of it for the
+ * last sector of the image. Each sector is erased just before it is written,
+ * so the erase time is spread over the download.
+ */
+esp_err_t ota_flash_write_sector(ota_pipeline_t *pipe, size_t offset, const uint8_t *data, size_t len) {
+    esp_err_t err = ESP_OK;
+    if (pipe->slice == 0) {
+        pipe->slice = pipe->pacing.max_stall_us > 0 ? OTA_MIN_SLICE : OTA_SECTOR_SIZE;
+    }
+
+    if (pipe->target == OTA_TARGET_PARTITION) {
+        gate_acquire(pipe);
+        int64_t start_us = esp_timer_get_time();
+        err = esp_partition_erase_range(pipe->partition, offset, OTA_SECTOR_SIZE);
+        account(pipe, esp_timer_get_time() - start_us, false);
+        gate_release();
+        ota_trace_event(OTA_TRACE_ERASE, start_us, (int32_t)offset);
+    }
+    pipe->metrics.sector_erases++; // esp_ota_write() erases app sectors with their first slice
+
+    int64_t trace_us = ota_trace_now();
+    for (size_t done = 0; err == ESP_OK && done < len;) {
+        size_t n = len - done < pipe->slice ? len - done : pipe->slice;
+        gate_acquire(pipe);
+        bool erases = pipe->target == OTA_TARGET_APP && done == 0;
+        int64_t start_us = esp_timer_get_time();
+        ota_cycles_t cycles = ota_cycles_now();
+        if (pipe->target == OTA_TARGET_PARTITION) {
+            err = esp_partition_write(pipe->partition, offset + done, data + done, n);
+        } else {
+            err = esp_ota_write(pipe->ota_handle, data + done, n); // Erases the sector first, see ota_pipeline_begin()
+        }
+        if (!erases) {
+            ota_cycles_add(pipe, OTA_CYCLES_FLASH, cycles); // Erases may yield the CPU
+        }
+        account(pipe, esp_timer_get_time() - start_us, !erases);
+        gate_release();
+        pipe->metrics.sector_programs++;
+        done += n;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Write failed at offset %u: %s", (unsigned)offset, esp_err_to_name(err));
+        return err;
+    }
+    pipe->metrics.bytes_written += len;
+    ota_trace_event(OTA_TRACE_WRITE, trace_us, (int32_t)offset);
+    return ESP_OK;
+}
@@ -0,0 +1,461 @@
+/*
+ * Direct HTTP(S) Image Source
+ * ===========================
+ *
+ * A minimal HTTP/1.1 client on esp_tls for image downloads. esp_http_client
+ * reads the response body into its own receive buffer and copies it from there
+ * into the caller's; this source reads the body straight into the caller's
+ * buffer, which ota_pipeline_run() points at the pipeline's landing buffer.
+ * The only copy of a body byte is then the one mbedtls makes when it decrypts
+ * the TLS record, none for plain http://. Only the response headers, and body
+ * bytes that arrive in the same read, pass through the source's own buffer.
+ *
+ * Requests and resumption follow gecl-ota-http.c: one GET over a kept-alive
+ * connection, bounded Range requests for ranged reads and open-ended ones to
+ * resume the stream. Up to HTTP_MAX_REDIRECTS redirects to absolute URLs or
+ * absolute paths are followed. Responses without a Content-Length (chunked
+ * transfer encoding), other redirects, and URLs or response headers that do
+ * not fit the source's fixed buffers are declined with ESP_ERR_NOT_SUPPORTED
+ * before any body byte is consumed, and the esp_http_client source serves
+ * them instead.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *TAG = "OTA_HTTP_DIRECT";
+
+// Request and response headers
+#define HTTP_HEAD_SIZE 1024
+#define HTTP_MAX_REDIRECTS 5
+
+typedef struct {
+    esp_tls_t *tls; // NULL while disconnected
+    bool plain;     // http://, no TLS
+    char host[64];
+    int port;
+    char path[512];
+    size_t pos;       // Next byte the sequential stream returns
+    size_t body_left; // Unread bytes of the current response body
+    bool streaming;   // A sequential response body is being read
+    bool keep_alive;  // The server keeps the connection after the response
+    char head[HTTP_HEAD_SIZE];
+    size_t spill_off; // Body bytes received with the headers, head[spill_off, spill_off + spill_len)
+    size_t spill_len;
+} direct_source_t;
+
+/**
+ * Splits an http:// or https:// URL into the connection target and the path.
+ */
+static esp_err_t parse_url(direct_source_t *d, const char *uri) {
+    d->plain = strncmp(uri, "http://", strlen("http://")) == 0;
+    const char *hostport = uri + strlen(d->plain ? "http://" : "https://");
+    const char *slash = strchr(hostport, '/');
+    size_t hostport_len = slash != NULL ? (size_t)(slash - hostport) : strlen(hostport);
+    const char *colon = memchr(hostport, ':', hostport_len);
+    size_t host_len = colon != NULL ? (size_t)(colon - hostport) : hostport_len;
+    const char *path = slash != NULL ? slash : "/";
+
+    if (host_len == 0) {
+        ESP_LOGE(TAG, "Invalid URL %s", uri);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (host_len >= sizeof(d->host) || strlen(path) >= sizeof(d->path)) {
+        ESP_LOGI(TAG, "URL too long, leaving %s to esp_http_client", uri);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    memcpy(d->host, hostport, host_len);
+    d->host[host_len] = '\0';
+    d->port = colon != NULL ? atoi(colon + 1) : d->plain ? 80 : 443;
+    strcpy(d->path, path);
+    return ESP_OK;
+}
+
+static void disconnect(direct_source_t *d) {
+    if (d->tls != NULL) {
+        esp_tls_conn_destroy(d->tls);
+        d->tls = NULL;
+    }
+    d->body_left = 0;
+    d->spill_len = 0;
+}
+
+static esp_err_t connect_server(direct_source_t *d) {
+    d->tls = esp_tls_init();
+    if (d->tls == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const char *cert = ota_get_server_cert();
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = (const unsigned char *)cert,
+        .cacert_bytes = strlen(cert) + 1,
+        .timeout_ms = 10000,
+        .is_plain_tcp = d->plain,
+    };
+    int64_t trace_us = ota_trace_now();
+    if (esp_tls_conn_new_sync(d->host, strlen(d->host), d->port, &cfg, d->tls) != 1) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", d->host, d->port);
+        disconnect(d);
+        return ESP_FAIL;
+    }
+    ota_trace_event(OTA_TRACE_CONNECT, trace_us, !d->plain);
+    return ESP_OK;
+}
+
+static esp_err_t write_all(esp_tls_t *tls, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = esp_tls_conn_write(tls, data, len);
+        if (n == ESP_TLS_ERR_SSL_WANT_READ || n == ESP_TLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (n <= 0) {
+            return ESP_FAIL;
+        }
+        data += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Reads the response headers into head and NUL-terminates them. Body bytes
+ * read along with them are kept behind the headers.
+ */
+static esp_err_t read_head(direct_source_t *d) {
+    size_t fill = 0;
+    while (fill < HTTP_HEAD_SIZE - 1) {
+        ssize_t n = esp_tls_conn_read(d->tls, d->head + fill, HTTP_HEAD_SIZE - 1 - fill);
+        if (n == ESP_TLS_ERR_SSL_WANT_READ || n == ESP_TLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (n <= 0) {
+            return ESP_FAIL;
+        }
+        fill += n;
+        d->head[fill] = '\0';
+        char *end = strstr(d->head, "\r\n\r\n");
+        if (end != NULL) {
+            end[2] = '\0'; // Keep the last header line terminated, cut off the body
+            d->spill_off = end + 4 - d->head;
+            d->spill_len = fill - d->spill_off;
+            return ESP_OK;
+        }
+    }
+    ESP_LOGI(TAG, "Response headers exceed %d bytes, leaving the response to esp_http_client", HTTP_HEAD_SIZE);
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+/**
+ * Value of a response header, NULL when absent.
+ */
+static const char *header_value(const char *head, const char *name) {
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+static bool is_redirect(int status) {
+    return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+}
+
+/**
+ * Points the source at the Location of a redirect response, an absolute URL or
+ * a path on the same server. The connection is kept when the target is on the
+ * same server and the redirect body arrived with the headers.
+ */
+static esp_err_t follow_redirect(direct_source_t *d) {
+    const char *location = header_value(d->head, "Location");
+    if (location == NULL) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    char url[sizeof(d->host) + sizeof(d->path) + 16];
+    size_t len = strcspn(location, "\r");
+    if (len >= sizeof(url)) {
+        ESP_LOGI(TAG, "Redirect target too long, leaving the response to esp_http_client");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    memcpy(url, location, len);
+    url[len] = '\0';
+
+    const char *length = header_value(d->head, "Content-Length");
+    const char *connection = header_value(d->head, "Connection");
+    bool reusable = length != NULL && strtoul(length, NULL, 10) <= d->spill_len &&
+                    (connection == NULL || strncasecmp(connection, "close", strlen("close")) != 0);
+    char host[sizeof(d->host)];
+    int port = d->port;
+    bool plain = d->plain;
+    strcpy(host, d->host);
+
+    esp_err_t err = ESP_OK;
+    if (url[0] == '/' && url[1] != '/') {
+        if (len >= sizeof(d->path)) {
+            ESP_LOGI(TAG, "Redirect target too long, leaving the response to esp_http_client");
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        strcpy(d->path, url);
+    } else if (strncmp(url, "http://", strlen("http://")) == 0 || strncmp(url, "https://", strlen("https://")) == 0) {
+        err = parse_url(d, url);
+    } else {
+        ESP_LOGI(TAG, "Redirect to %s, leaving the response to esp_http_client", url);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (err != ESP_OK || !reusable || d->plain != plain || d->port != port || strcmp(d->host, host) != 0) {
+        disconnect(d);
+    }
+    d->spill_len = 0;
+    ESP_LOGI(TAG, "Redirected to %s", url);
+    return err;
+}
+
+/**
+ * Sends a GET with the given Range header line for the current URL and reads
+ * the response headers.
+ */
+static esp_err_t send_request(ota_source_t *src, const char *range) {
+    direct_source_t *d = src->ctx;
+    char port[8] = "";
+    if (d->port != (d->plain ? 80 : 443)) {
+        snprintf(port, sizeof(port), ":%d", d->port);
+    }
+    src->requests++;
+
+    esp_err_t err = ESP_FAIL;
+    for (int attempt = 0; attempt < 2 && err != ESP_OK; attempt++) {
+        if (attempt > 0 || d->tls == NULL) {
+            // The server may have dropped the kept-alive connection, reconnect once
+            disconnect(d);
+            err = connect_server(d);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        int len = snprintf(d->head, HTTP_HEAD_SIZE, "GET %s HTTP/1.1\r\nHost: %s%s\r\n%sUser-Agent: gecl-ota\r\n\r\n",
+                           d->path, d->host, port, range);
+        if (len >= HTTP_HEAD_SIZE) {
+            return ESP_ERR_NOT_SUPPORTED; // Only with a host and path near their limits
+        }
+        err = write_all(d->tls, d->head, len);
+        if (err == ESP_OK) {
+            err = read_head(d);
+        }
+    }
+    return err;
+}
+
+/**
+ * Sends a GET for bytes [from, to] (to == SIZE_MAX for open-ended) on the
+ * kept-alive connection and reads the response headers. Redirects are
+ * followed up to HTTP_MAX_REDIRECTS times, and later requests go to the
+ * redirect target.
+ */
+static esp_err_t http_request(ota_source_t *src, size_t from, size_t to) {
+    direct_source_t *d = src->ctx;
+    char range[48] = "";
+    if (to != SIZE_MAX) {
+        snprintf(range, sizeof(range), "Range: bytes=%u-%u\r\n", (unsigned)from, (unsigned)to);
+    } else if (from != 0) {
+        snprintf(range, sizeof(range), "Range: bytes=%u-\r\n", (unsigned)from);
+    }
+
+    int64_t trace_us = ota_trace_now();
+    esp_err_t err = send_request(src, range);
+    for (int redirects = 0; err == ESP_OK && redirects < HTTP_MAX_REDIRECTS; redirects++) {
+        int status = strncmp(d->head, "HTTP/1.", strlen("HTTP/1.")) == 0 ? atoi(d->head + strlen("HTTP/1.x ")) : 0;
+        if (!is_redirect(status)) {
+            break;
+        }
+        err = follow_redirect(d);
+        if (err == ESP_OK) {
+            err = send_request(src, range);
+        }
+    }
+    if (err != ESP_OK) {
+        if (err != ESP_ERR_NOT_SUPPORTED) {
+            ESP_LOGE(TAG, "Request for offset %u failed: %s", (unsigned)from, esp_err_to_name(err));
+        }
+        disconnect(d);
+        return err;
+    }
+    ota_trace_event(OTA_TRACE_REQUEST, trace_us, (int32_t)from);
+
+    int status = strncmp(d->head, "HTTP/1.", strlen("HTTP/1.")) == 0 ? atoi(d->head + strlen("HTTP/1.x ")) : 0;
+    const char *length = header_value(d->head, "Content-Length");
+    const char *connection = header_value(d->head, "Connection");
+    bool ranged = from != 0 || to != SIZE_MAX;
+    if (status != (ranged ? 206 : 200)) {
+        ESP_LOGE(TAG, "Request for offset %u returned HTTP %d", (unsigned)from, status);
+        disconnect(d);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (length == NULL) {
+        ESP_LOGI(TAG, "No Content-Length, leaving the response to esp_http_client");
+        disconnect(d);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    d->keep_alive = connection == NULL || strncasecmp(connection, "close", strlen("close")) != 0;
+    d->body_left = strtoul(length, NULL, 10);
+    if (d->spill_len > d->body_left) {
+        d->spill_len = d->body_left;
+    }
+    if (!ranged) {
+        src->size = d->body_left;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Reads up to len bytes of the response body into buf. Returns 0 at the end of
+ * the body and a negative value when the connection failed.
+ */
+static int read_body(ota_source_t *src, uint8_t *buf, size_t len) {
+    direct_source_t *d = src->ctx;
+    if (d->body_left == 0) {
+        return 0;
+    }
+    if (len > d->body_left) {
+        len = d->body_left;
+    }
+
+    ssize_t n;
+    if (d->spill_len > 0) {
+        n = d->spill_len < len ? d->spill_len : len;
+        memcpy(buf, d->head + d->spill_off, n);
+        d->spill_off += n;
+        d->spill_len -= n;
+        src->copied += n;
+    } else {
+        do {
+            n = esp_tls_conn_read(d->tls, buf, len); // Decrypts straight into buf
+        } while (n == ESP_TLS_ERR_SSL_WANT_READ || n == ESP_TLS_ERR_SSL_WANT_WRITE);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    d->body_left -= n;
+    if (d->body_left == 0 && !d->keep_alive) {
+        disconnect(d);
+    }
+    return (int)n;
+}
+
+static esp_err_t direct_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    direct_source_t *d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    src->ctx = d;
+    src->buffer_bytes = sizeof(*d);
+
+    esp_err_t err = parse_url(d, uri);
+    if (err == ESP_OK) {
+        err = http_request(src, 0, SIZE_MAX);
+    }
+    if (err != ESP_OK) {
+        disconnect(d);
+        free(d);
+        src->ctx = NULL;
+        return err;
+    }
+    d->streaming = true;
+    return ESP_OK;
+}
+
+static int direct_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    direct_source_t *d = src->ctx;
+
+    if (!d->streaming) {
+        if (src->size != 0 && d->pos >= src->size) {
+            return 0;
+        }
+        if (http_request(src, d->pos, SIZE_MAX) != ESP_OK) {
+            return -1;
+        }
+        d->streaming = true;
+    }
+
+    int n = read_body(src, buf, len);
+    if (n >= 0) {
+        d->pos += n;
+        return n;
+    }
+
+    ESP_LOGW(TAG, "Connection lost at offset %u, resuming", (unsigned)d->pos);
+    disconnect(d);
+    d->streaming = false;
+    return -1;
+}
+
+static esp_err_t direct_read_range(ota_source_t *src, size_t offset, uint8_t *buf, size_t len) {
+    direct_source_t *d = src->ctx;
+
+    if (d->body_left > 0) {
+        disconnect(d); // The rest of the stream cannot be skipped on this connection
+    }
+    d->streaming = false;
+
+    esp_err_t err = http_request(src, offset, offset + len - 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (size_t total = 0; total < len;) {
+        int n = read_body(src, buf + total, len - total);
+        if (n <= 0) {
+            ESP_LOGE(TAG, "Connection lost during range at offset %u", (unsigned)offset);
+            disconnect(d);
+            return ESP_FAIL;
+        }
+        total += n;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t direct_reopen(ota_source_t *src, const char *uri) {
+    direct_source_t *d = src->ctx;
+    char host[sizeof(d->host)];
+    int port = d->port;
+    bool plain = d->plain;
+    strcpy(host, d->host);
+
+    esp_err_t err = parse_url(d, uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (d->body_left > 0 || d->plain != plain || d->port != port || strcmp(d->host, host) != 0) {
+        disconnect(d); // Unread body or another server, the connection cannot be reused
+    }
+    d->pos = 0;
+    err = http_request(src, 0, SIZE_MAX);
+    d->streaming = err == ESP_OK;
+    return err;
+}
+
+static void direct_close(ota_source_t *src) {
+    direct_source_t *d = src->ctx;
+    disconnect(d);
+    free(d);
+}
+
+const ota_source_ops_t ota_source_http_direct = {
+    .name = "HTTP direct",
+    .open = direct_open,
+    .read = direct_read,
+    .read_range = direct_read_range,
+    .close = direct_close,
+    .reopen = direct_reopen,
+};
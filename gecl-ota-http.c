@@ -0,0 +1,212 @@
+/*
+ * HTTP(S) Image Source
+ * ====================
+ *
+ * Streams the image with a single GET over a kept-alive connection. A ranged
+ * read drops the stream and issues a bounded Range request; the next
+ * sequential read resumes with an open-ended Range request from the position
+ * the stream had reached. Connection losses are resumed the same way, and
+ * redirects are followed up to OTA_HTTP_MAX_REDIRECTS times. Reopening the
+ * source for another image on the same server reuses the kept-alive
+ * connection and its TLS session.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_HTTP";
+
+#define OTA_HTTP_MAX_REDIRECTS 5
+
+typedef struct {
+    esp_http_client_handle_t client;
+    size_t pos;     // Next byte the sequential stream returns
+    bool streaming; // A sequential response body is being read
+} http_source_t;
+
+/**
+ * Sends a GET for bytes [from, to] (to == SIZE_MAX for open-ended) on the
+ * kept-alive connection and reads the response headers.
+ */
+static esp_err_t http_request(ota_source_t *src, size_t from, size_t to) {
+    http_source_t *http = src->ctx;
+    char range[48];
+
+    if (from == 0 && to == SIZE_MAX) {
+        esp_http_client_delete_header(http->client, "Range");
+    } else if (to == SIZE_MAX) {
+        snprintf(range, sizeof(range), "bytes=%u-", (unsigned)from);
+        esp_http_client_set_header(http->client, "Range", range);
+    } else {
+        snprintf(range, sizeof(range), "bytes=%u-%u", (unsigned)from, (unsigned)to);
+        esp_http_client_set_header(http->client, "Range", range);
+    }
+    src->requests++;
+
+    int64_t trace_us = ota_trace_now();
+    int64_t content_length = 0;
+    int status = 0;
+    for (int redirects = 0; redirects <= OTA_HTTP_MAX_REDIRECTS; redirects++) {
+        if (redirects > 0) {
+            // Later requests, resumptions included, go to the redirect target
+            esp_http_client_flush_response(http->client, NULL);
+            esp_err_t err = esp_http_client_set_redirection(http->client);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Redirect with HTTP %d failed: %s", status, esp_err_to_name(err));
+                esp_http_client_close(http->client);
+                return err;
+            }
+        }
+        esp_err_t err = esp_http_client_open(http->client, 0);
+        if (err != ESP_OK) {
+            // The server may have dropped the kept-alive connection, reconnect once
+            esp_http_client_close(http->client);
+            err = esp_http_client_open(http->client, 0);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to open connection: %s", esp_err_to_name(err));
+            return err;
+        }
+
+        content_length = esp_http_client_fetch_headers(http->client);
+        status = esp_http_client_get_status_code(http->client);
+        if (status != 301 && status != 302 && status != 303 && status != 307 && status != 308) {
+            break;
+        }
+    }
+    ota_trace_event(OTA_TRACE_REQUEST, trace_us, (int32_t)from);
+    bool ranged = from != 0 || to != SIZE_MAX;
+    if (status != (ranged ? 206 : 200)) {
+        ESP_LOGE(TAG, "Request for offset %u returned HTTP %d", (unsigned)from, status);
+        esp_http_client_close(http->client);
+        return ranged && status == 200 ? ESP_ERR_NOT_SUPPORTED : ESP_ERR_INVALID_RESPONSE;
+    }
+    if (!ranged && content_length > 0) {
+        src->size = (size_t)content_length;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t http_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    http_source_t *http = calloc(1, sizeof(*http));
+    if (http == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_http_client_config_t http_config = {
+        .url = uri,
+        .cert_pem = ota_get_server_cert(),
+        .timeout_ms = 10000,
+        .keep_alive_enable = true,
+    };
+    http->client = esp_http_client_init(&http_config);
+    if (http->client == NULL) {
+        free(http);
+        return ESP_ERR_NO_MEM;
+    }
+    src->ctx = http;
+    src->buffer_bytes = sizeof(*http) + 2 * 512; // esp_http_client's default receive and transmit buffers
+
+    esp_err_t err = http_request(src, 0, SIZE_MAX);
+    if (err != ESP_OK) {
+        esp_http_client_cleanup(http->client);
+        free(http);
+        src->ctx = NULL;
+        return err;
+    }
+    http->streaming = true;
+    return ESP_OK;
+}
+
+static int http_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    http_source_t *http = src->ctx;
+
+    if (!http->streaming) {
+        if (src->size != 0 && http->pos >= src->size) {
+            return 0;
+        }
+        if (http_request(src, http->pos, SIZE_MAX) != ESP_OK) {
+            return -1;
+        }
+        http->streaming = true;
+    }
+
+    int n = esp_http_client_read(http->client, (char *)buf, len);
+    if (n > 0) {
+        http->pos += n;
+        src->copied += n; // From esp_http_client's receive buffer
+        return n;
+    }
+    if (n == 0 && esp_http_client_is_complete_data_received(http->client)) {
+        return 0;
+    }
+
+    ESP_LOGW(TAG, "Connection lost at offset %u, resuming", (unsigned)http->pos);
+    esp_http_client_close(http->client);
+    http->streaming = false;
+    return -1;
+}
+
+static esp_err_t http_read_range(ota_source_t *src, size_t offset, uint8_t *buf, size_t len) {
+    http_source_t *http = src->ctx;
+
+    if (http->streaming) {
+        // The rest of the stream cannot be skipped on this connection
+        esp_http_client_close(http->client);
+        http->streaming = false;
+    }
+
+    esp_err_t err = http_request(src, offset, offset + len - 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    size_t total = 0;
+    while (total < len) {
+        int n = esp_http_client_read(http->client, (char *)buf + total, len - total);
+        if (n <= 0) {
+            ESP_LOGE(TAG, "Connection lost during range at offset %u", (unsigned)offset);
+            esp_http_client_close(http->client);
+            return ESP_FAIL;
+        }
+        total += n;
+    }
+    src->copied += len;
+    return ESP_OK;
+}
+
+static esp_err_t http_reopen(ota_source_t *src, const char *uri) {
+    http_source_t *http = src->ctx;
+    if (http->streaming && !esp_http_client_is_complete_data_received(http->client)) {
+        esp_http_client_close(http->client); // Unread body, the connection cannot be reused
+    }
+    http->streaming = false;
+    http->pos = 0;
+
+    // esp_http_client keeps the connection when scheme, host and port are unchanged
+    esp_err_t err = esp_http_client_set_url(http->client, uri);
+    if (err == ESP_OK) {
+        err = http_request(src, 0, SIZE_MAX);
+    }
+    http->streaming = err == ESP_OK;
+    return err;
+}
+
+static void http_close(ota_source_t *src) {
+    http_source_t *http = src->ctx;
+    esp_http_client_cleanup(http->client);
+    free(http);
+}
+
+const ota_source_ops_t ota_source_http = {
+    .name = "HTTP",
+    .open = http_open,
+    .read = http_read,
+    .read_range = http_read_range,
+    .close = http_close,
+    .reopen = http_reopen,
+};
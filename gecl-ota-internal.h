@@ -0,0 +1,302 @@
+#ifndef OTA_INTERNAL_H
+#define OTA_INTERNAL_H
+
+#include "gecl-ota-manager.h"
+
+#include "mbedtls/sha256.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OTA_SHA256_LEN 32
+
+// Unit of flash writes, the flash erase sector
+#define OTA_SECTOR_SIZE 4096
+
+// Most data partition images one manifest can update together with the app
+#define OTA_MAX_PARTITION_IMAGES 8
+
+// ota_config_t.url prefix selecting the MQTT transport, optionally followed by a topic base
+#define OTA_MQTT_URL_PREFIX "mqtt:"
+
+/**
+ * Parsed OTA manifest.
+ *
+ * The image is split into fixed-size chunks (the last one may be short). Each
+ * chunk's leaf hash is listed in the chunk map, and the chunk map itself is
+ * authenticated by the Merkle root carried in the manifest. Data partition
+ * images updated in the same session, and the named blobs of an artifact
+ * manifest, are described by nested manifests.
+ */
+typedef struct ota_manifest {
+    char version[32];                      // Firmware version announced by the manifest
+    char image_url[512];                   // Absolute URL of the image
+    size_t image_size;                     // Total image size in bytes
+    size_t chunk_size;                     // Size of each verified chunk in bytes
+    uint32_t chunk_count;                  // Number of chunks (and leaves)
+    uint8_t image_sha256[OTA_SHA256_LEN];  // SHA-256 of the whole image
+    uint8_t merkle_root[OTA_SHA256_LEN];   // Root of the Merkle tree over the chunk leaves
+    uint8_t *leaves;                       // chunk_count * OTA_SHA256_LEN bytes, verified against merkle_root
+    char *chunk_map_url;                   // Chunk map location until the map is loaded, NULL when inline
+    char name[14];                         // Artifact name, empty for app and partition images
+    char label[17];                        // Target data partition, empty for the app image
+    struct ota_manifest *artifacts;        // Data partition images
+    uint8_t artifact_count;
+} ota_manifest_t;
+
+/**
+ * Download loop sections counted by GECL_OTA_CYCLE_PROFILE. Only sections
+ * that keep the CPU busy are counted, see ota_cycles_add().
+ */
+typedef enum {
+    OTA_CYCLES_HASH,    // Chunk leaf and image digests
+    OTA_CYCLES_DECRYPT, // Pre-encrypted image decryption
+    OTA_CYCLES_FLASH,   // Program calls that do not erase
+    OTA_CYCLES_STAGES,
+} ota_cycles_stage_t;
+
+/**
+ * Verify/write pipeline shared by all download paths.
+ *
+ * Data is fed in arbitrary slices. It is assembled into chunks, each chunk is
+ * verified against the manifest (when one is present) and only verified chunks
+ * are written to the update partition. A rejected chunk is discarded and the
+ * caller re-sends it starting at ota_pipeline_resume_offset().
+ *
+ * Sources pulled by ota_pipeline_run() receive straight into the pipeline's
+ * landing buffer (ota_pipeline_recv_buf()), where plain images are verified and
+ * written in place.
+ *
+ * Pre-encrypted app images are decrypted between verification and the write.
+ *
+ * The target is the passive app partition, written through esp_ota_* and set
+ * as boot partition on finish unless defer_boot is set, a data partition
+ * written in place, or a RAM buffer for small artifacts stored elsewhere.
+ */
+typedef enum {
+    OTA_TARGET_APP,
+    OTA_TARGET_PARTITION,
+    OTA_TARGET_BUFFER,
+} ota_target_t;
+
+typedef struct ota_decrypt ota_decrypt_t;
+
+typedef struct {
+    const ota_manifest_t *manifest; // Optional, NULL disables chunk verification
+    ota_target_t target;
+    const esp_partition_t *partition; // App or data partition target
+    uint8_t *buffer;                  // Buffer target, manifest image_size bytes
+    bool defer_boot;                  // Leave the boot partition to the caller
+    bool open;                        // Between begin and finish or abort
+    uint8_t *sector_buf;              // Partly received flash sector of pre-encrypted images
+    size_t slice;                     // Bytes per flash program call, adapted to pacing.max_stall_us
+    ota_pacing_t pacing;
+    ota_decrypt_t *decrypt;           // Pre-encrypted app image stage, NULL for plain images
+    uint8_t *plain_buf;               // Decrypted chunk
+    esp_ota_handle_t ota_handle;
+    mbedtls_sha256_context image_ctx;
+    uint8_t *chunk_buf; // Landing buffer, for plain flash targets preceded by the partly received sector
+    size_t chunk_fill;
+    uint32_t chunk_index;
+    size_t written;       // Image bytes accepted, the resume offset
+    size_t stored;        // Bytes written to the target, less than written for pre-encrypted images
+    size_t stream_pos;    // Bytes read from the source's sequential stream
+    uint32_t retries;     // Failed reads and re-fetches since retry_chunk
+    uint32_t retry_chunk; // Chunk index when the retry count was last reset
+    ota_metrics_t metrics;
+#if CONFIG_GECL_OTA_CYCLE_PROFILE
+    uint64_t cycles[OTA_CYCLES_STAGES]; // CPU cycles spent per section
+    uint32_t cycles_dropped;            // Samples discarded because the task changed cores
+    uint64_t cpu_start;                 // Run-time counter of the task at begin
+#endif
+} ota_pipeline_t;
+
+// CPU cycle counter samples, compiled out without GECL_OTA_CYCLE_PROFILE
+#if CONFIG_GECL_OTA_CYCLE_PROFILE
+#include "esp_cpu.h"
+
+typedef struct {
+    uint32_t count;
+    int core; // -1 when the task changed cores while sampling
+} ota_cycles_t;
+
+static inline ota_cycles_t ota_cycles_now(void) {
+    ota_cycles_t now = {.core = esp_cpu_get_core_id()};
+    now.count = esp_cpu_get_cycle_count();
+    if (esp_cpu_get_core_id() != now.core) {
+        now.core = -1;
+    }
+    return now;
+}
+
+/**
+ * Adds the cycles since a sample to a section. The cycle counter is per core
+ * and keeps running while the task is blocked or preempted, so it is only
+ * sampled around sections that do not block, and a sample is dropped when the
+ * task, which may run on either core, moved to the other core meanwhile.
+ */
+static inline void ota_cycles_add(ota_pipeline_t *pipe, ota_cycles_stage_t stage, ota_cycles_t since) {
+    uint32_t count = esp_cpu_get_cycle_count();
+    if (since.core >= 0 && esp_cpu_get_core_id() == since.core) {
+        pipe->cycles[stage] += count - since.count;
+    } else {
+        pipe->cycles_dropped++;
+    }
+}
+#else
+typedef int ota_cycles_t;
+#define ota_cycles_now() 0
+#define ota_cycles_add(pipe, stage, since) ((void)(since))
+#endif
+
+typedef struct ota_source ota_source_t;
+
+/**
+ * Trace events, see gecl-ota-trace.c.
+ */
+typedef enum {
+    OTA_TRACE_IMAGE,
+    OTA_TRACE_RECV,
+    OTA_TRACE_CHUNK,
+    OTA_TRACE_WRITE,
+    OTA_TRACE_DEFER,
+    OTA_TRACE_REFETCH,
+    OTA_TRACE_ERROR,
+    OTA_TRACE_END,
+    OTA_TRACE_CONNECT,
+    OTA_TRACE_REQUEST,
+    OTA_TRACE_HASH,
+    OTA_TRACE_DECRYPT,
+    OTA_TRACE_ERASE,
+} ota_trace_type_t;
+
+/**
+ * Image source operations.
+ *
+ * read() returns the number of bytes copied into buf, 0 at the end of the
+ * image and a negative value on a transient error; the next read() resumes
+ * at the same position. read_range() fills exactly len bytes starting at
+ * offset without disturbing the sequential position, and is NULL for sources
+ * that cannot seek (serial and socket streams). The optional reopen() points
+ * an open source at another image of the same server, reusing its connection.
+ * Sources whose transport does not authenticate the sender set
+ * needs_manifest; their images are only installed against a manifest.
+ */
+typedef struct {
+    const char *name;
+    esp_err_t (*open)(ota_source_t *src, const char *uri, const ota_config_t *ota);
+    int (*read)(ota_source_t *src, uint8_t *buf, size_t len);
+    esp_err_t (*read_range)(ota_source_t *src, size_t offset, uint8_t *buf, size_t len);
+    void (*close)(ota_source_t *src);
+    esp_err_t (*reopen)(ota_source_t *src, const char *uri);
+    bool needs_manifest;
+} ota_source_ops_t;
+
+struct ota_source {
+    const ota_source_ops_t *ops;
+    void *ctx;                      // Source private state
+    size_t size;                    // Image size when the transport reports it, 0 otherwise
+    const ota_manifest_t *manifest; // Manifest delivered in-band by the transport, if any
+    uint32_t requests;              // Requests issued to the remote end
+    size_t copied;                  // Image bytes copied inside the source before they reached the caller
+    size_t buffer_bytes;            // Receive buffers held by the source
+};
+
+/**
+ * Role of this device in a LAN peer-to-peer distribution round.
+ */
+typedef enum {
+    OTA_P2P_ORIGIN, // Download from the origin, no leader on the LAN
+    OTA_P2P_LEADER, // Download from the origin, then serve peers
+    OTA_P2P_PEER,   // Download from the leader
+} ota_p2p_role_t;
+
+extern const ota_source_ops_t ota_source_http;
+extern const ota_source_ops_t ota_source_http_direct;
+extern const ota_source_ops_t ota_source_mqtt;
+extern const ota_source_ops_t ota_source_mcast;
+extern const ota_source_ops_t ota_source_coap;
+extern const ota_source_ops_t ota_source_file;
+extern const ota_source_ops_t ota_source_uart;
+extern const ota_source_ops_t ota_source_tcp;
+
+// gecl-ota-artifact.c
+const char *ota_artifact_cert(const char *embedded);
+
+// gecl-ota-decrypt.c
+esp_err_t ota_decrypt_begin(ota_decrypt_t **out_dec);
+esp_err_t ota_decrypt_update(ota_decrypt_t *dec, const uint8_t *in, size_t len, uint8_t *out, size_t *out_len);
+esp_err_t ota_decrypt_finish(ota_decrypt_t *dec, uint8_t plain_sha256[OTA_SHA256_LEN]);
+void ota_decrypt_free(ota_decrypt_t *dec);
+
+// gecl-ota-flash.c
+void ota_flash_gate_init(void);
+esp_err_t ota_flash_write_sector(ota_pipeline_t *pipe, size_t offset, const uint8_t *data, size_t len);
+
+// gecl-ota-manager.c
+bool ota_claim_session(void);
+void ota_release_session(void);
+
+// gecl-ota-manifest.c
+esp_err_t ota_manifest_parse(const char *json, size_t len, const char *manifest_url, const char *default_image_url,
+                             ota_manifest_t *manifest);
+esp_err_t ota_manifest_authenticate(const ota_manifest_t *manifest);
+esp_err_t ota_manifest_load(const char *json, size_t len, const char *manifest_url, const char *default_image_url,
+                            const ota_config_t *ota, ota_source_t *source, ota_manifest_t *manifest);
+esp_err_t ota_manifest_fetch(const ota_config_t *ota, ota_source_t *source, ota_manifest_t *manifest);
+esp_err_t ota_artifacts_fetch(const char *manifest_url, const ota_config_t *ota, ota_source_t *source,
+                              ota_manifest_t *manifest);
+void ota_manifest_free(ota_manifest_t *manifest);
+size_t ota_manifest_chunk_len(const ota_manifest_t *manifest, uint32_t index);
+bool ota_manifest_chunk_ok(const ota_manifest_t *manifest, uint32_t index, const uint8_t *data, size_t len);
+void ota_merkle_leaf_hash(const uint8_t *data, size_t len, uint8_t out[OTA_SHA256_LEN]);
+esp_err_t ota_merkle_root(const uint8_t *leaves, uint32_t count, uint8_t out[OTA_SHA256_LEN]);
+esp_err_t ota_hex_decode(const char *hex, uint8_t *out, size_t out_len);
+
+// gecl-ota-p2p.c
+ota_p2p_role_t ota_p2p_elect(const ota_manifest_t *manifest, char *peer_url, size_t peer_url_len);
+void ota_p2p_serve(void);
+void ota_p2p_stop(void);
+
+// gecl-ota-pipeline.c
+esp_err_t ota_pipeline_begin(ota_pipeline_t *pipe, const ota_manifest_t *manifest);
+esp_err_t ota_pipeline_begin_partition(ota_pipeline_t *pipe, const ota_manifest_t *manifest,
+                                       const esp_partition_t *partition);
+esp_err_t ota_pipeline_begin_buffer(ota_pipeline_t *pipe, const ota_manifest_t *manifest, uint8_t *buffer);
+esp_err_t ota_pipeline_feed(ota_pipeline_t *pipe, const uint8_t *data, size_t len);
+uint8_t *ota_pipeline_recv_buf(ota_pipeline_t *pipe, size_t *room);
+esp_err_t ota_pipeline_received(ota_pipeline_t *pipe, size_t len);
+size_t ota_pipeline_resume_offset(const ota_pipeline_t *pipe);
+esp_err_t ota_pipeline_finish(ota_pipeline_t *pipe);
+void ota_pipeline_abort(ota_pipeline_t *pipe);
+esp_err_t ota_pipeline_pull(ota_pipeline_t *pipe, ota_source_t *src, bool *done);
+esp_err_t ota_pipeline_run(ota_pipeline_t *pipe, ota_source_t *src);
+void ota_pipeline_get_pacing(ota_pacing_t *out_pacing);
+
+// gecl-ota-trace.c, compiled out without GECL_OTA_TRACE
+#if CONFIG_GECL_OTA_TRACE
+#include "esp_timer.h"
+#define ota_trace_now() esp_timer_get_time()
+void ota_trace_start(void);
+void ota_trace_event(ota_trace_type_t type, int64_t since_us, int32_t value);
+void ota_trace_stop(esp_err_t result);
+#else
+#define ota_trace_now() ((int64_t)0)
+static inline void ota_trace_start(void) {}
+static inline void ota_trace_event(ota_trace_type_t type, int64_t since_us, int32_t value) {}
+static inline void ota_trace_stop(esp_err_t result) {}
+#endif
+
+// gecl-ota-source.c
+esp_err_t ota_source_check_verified(const char *uri, const ota_manifest_t *verify);
+esp_err_t ota_source_open(ota_source_t *src, const char *uri, const ota_config_t *ota);
+esp_err_t ota_source_reopen(ota_source_t *src, const char *uri, const ota_config_t *ota);
+esp_err_t ota_source_get(ota_source_t *src, const char *url, const ota_config_t *ota, uint8_t *buf, size_t max_len,
+                         size_t *out_len);
+void ota_source_close(ota_source_t *src);
+
+// gecl-ota-slots.c
+bool ota_slots_find_pair(const char *label, const esp_partition_t *pair[2]);
+esp_err_t ota_slots_target(const char *label, const esp_partition_t **target, int8_t *slot);
+esp_err_t ota_slots_commit(const esp_partition_t *app, const ota_manifest_t *manifest, const int8_t *slots);
+
+#endif // OTA_INTERNAL_H
@@ -7,22 +7,23 @@
  */
 
 #include "gecl-ota-manager.h"
+#include "gecl-ota-internal.h"
 
-#include "cJSON.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_sleep.h"
 #include "esp_system.h"
 #include "esp_task_wdt.h"
 #include "esp_timer.h"
-#include "esp_wifi.h"
 #include "freertos/timers.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "sdkconfig.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <inttypes.h> // For PRI macros
+#include <string.h>
 #include <time.h>
 
 // External Certificate Authority (CA) certificate for HTTPS connection
@@ -32,10 +33,23 @@ extern const uint8_t server_cert_pem_end[] asm("_binary_AmazonRootCA1_pem_end");
 // Logging tag
 static const char *TAG = "OTA";
 
+ESP_EVENT_DEFINE_BASE(GECL_OTA_EVENT);
+
 // Global variables
 static bool ota_in_progress = false;
 static SemaphoreHandle_t ota_mutex = NULL;
 
+/**
+ * Returns the CA certificates trusted for HTTPS and DTLS connections: the
+ * configured CA artifact, when one is installed, together with the embedded
+ * certificate, or the embedded certificate alone.
+ */
+const char *ota_get_server_cert(void) {
+    const char *cert = ota_artifact_cert((const char *)server_cert_pem_start);
+    return cert != NULL ? cert : (const char *)server_cert_pem_start;
+}
+
+#if CONFIG_GECL_OTA_UPDATE_HISTORY
 /**
  * Retrieves the current local timestamp and formats it as a string.
  */
@@ -82,24 +96,153 @@ esp_err_t write_ota_timestamp_to_nvs(const char *timestamp) {
     return err;
 }
 
+#define TASK_HISTORY_KEY "ota_task_hist"
+
+/**
+ * Run-time counters of ota_task at the start of a session.
+ */
+typedef struct {
+    int64_t start_us;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total;
+    configRUN_TIME_COUNTER_TYPE task;
+#endif
+    ota_pacing_t pacing;
+} task_sample_t;
+
+static void task_sample_begin(task_sample_t *sample) {
+    sample->start_us = esp_timer_get_time();
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    sample->total = portGET_RUN_TIME_COUNTER_VALUE();
+    sample->task = ulTaskGetRunTimeCounter(NULL);
+#endif
+    ota_pipeline_get_pacing(&sample->pacing);
+}
+
+static esp_err_t write_task_history(const ota_task_stats_t *history, size_t count) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, TASK_HISTORY_KEY, history, count * sizeof(history[0]));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    return err;
+}
+
+/**
+ * Records the stack high-water mark and CPU share of ota_task over the
+ * session in the update history, newest first. ota_task is created per
+ * session, so its high-water mark covers this session only. Called after the
+ * session's other NVS writes; the high-water mark is read again after the
+ * history write, which is repeated if it reached deeper into the stack.
+ */
+static void task_sample_end(const task_sample_t *sample, esp_err_t result) {
+    time_t now = time(NULL);
+    ota_task_stats_t stats = {
+        .time = now >= 1577836800 ? (uint32_t)now : 0, // Clock values before 2020 mean it was never set
+        .result = result,
+        .duration_ms = (uint32_t)((esp_timer_get_time() - sample->start_us) / 1000),
+        .stack_free = uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t),
+        .cpu_permille = OTA_CPU_UNKNOWN,
+        .pacing = sample->pacing,
+    };
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total = portGET_RUN_TIME_COUNTER_VALUE() - sample->total;
+    if (total > 0) {
+        stats.cpu_permille = (uint16_t)((uint64_t)(ulTaskGetRunTimeCounter(NULL) - sample->task) * 1000 / total);
+    }
+#endif
+
+    ota_task_stats_t history[OTA_TASK_HISTORY_LEN] = {0};
+    size_t count;
+    if (ota_get_task_history(history, OTA_TASK_HISTORY_LEN, &count) != ESP_OK) {
+        count = 0;
+    }
+    memmove(&history[1], &history[0], (OTA_TASK_HISTORY_LEN - 1) * sizeof(history[0]));
+    history[0] = stats;
+    count = count < OTA_TASK_HISTORY_LEN ? count + 1 : OTA_TASK_HISTORY_LEN;
+
+    esp_err_t err = write_task_history(history, count);
+    uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t);
+    if (err == ESP_OK && stack_free < history[0].stack_free) {
+        history[0].stack_free = stack_free; // The same write again does not reach deeper
+        err = write_task_history(history, count);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to record task usage: %s", esp_err_to_name(err));
+    }
+    ESP_LOGI(TAG, "ota_task: %" PRIu32 " bytes of stack never used, %u.%u%% CPU", history[0].stack_free,
+             stats.cpu_permille / 10, stats.cpu_permille % 10);
+}
+#else
+typedef int task_sample_t; // Nothing to sample without the history
+
+static void task_sample_begin(task_sample_t *sample) {}
+static void task_sample_end(const task_sample_t *sample, esp_err_t result) {}
+#endif
+
+/**
+ * Copies up to max of the sessions recorded by GECL_OTA_UPDATE_HISTORY,
+ * newest first, with the stack and CPU ota_task used in each.
+ */
+esp_err_t ota_get_task_history(ota_task_stats_t *out_stats, size_t max, size_t *out_count) {
+#if CONFIG_GECL_OTA_UPDATE_HISTORY
+    if (out_stats == NULL || out_count == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_count = 0;
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK; // Nothing recorded yet
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    ota_task_stats_t history[OTA_TASK_HISTORY_LEN];
+    size_t len = sizeof(history);
+    err = nvs_get_blob(nvs, TASK_HISTORY_KEY, history, &len);
+    nvs_close(nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    *out_count = len / sizeof(history[0]) < max ? len / sizeof(history[0]) : max;
+    memcpy(out_stats, history, *out_count * sizeof(history[0]));
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 /**
  * Event handler for OTA events.
  */
 static void ota_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
-    if (event_base == ESP_HTTPS_OTA_EVENT) {
+    if (event_base == GECL_OTA_EVENT) {
         switch (event_id) {
-        case ESP_HTTPS_OTA_START:
+        case GECL_OTA_EVENT_START:
             ESP_LOGI(TAG, "OTA started");
             break;
-        case ESP_HTTPS_OTA_CONNECTED:
+        case GECL_OTA_EVENT_CONNECTED:
             ESP_LOGI(TAG, "Connected to OTA server");
             break;
-        case ESP_HTTPS_OTA_FINISH:
+        case GECL_OTA_EVENT_FINISH:
             ESP_LOGI(TAG, "OTA finished successfully");
             break;
-        case ESP_HTTPS_OTA_ABORT:
+        case GECL_OTA_EVENT_ABORT:
             ESP_LOGE(TAG, "OTA aborted");
             break;
+        case GECL_OTA_EVENT_ARTIFACT_UPDATED: {
+            const ota_artifact_info_t *info = (const ota_artifact_info_t *)event_data;
+            ESP_LOGI(TAG, "Artifact %s updated to %s", info->name, info->version);
+            break;
+        }
         default:
             ESP_LOGW(TAG, "Unhandled OTA event: %" PRIi32, event_id); // Using PRI macro
             break;
@@ -118,92 +261,249 @@ void init_ota_handler() {
     if (ota_mutex == NULL) {
         ota_mutex = xSemaphoreCreateMutex();
     }
+    ota_flash_gate_init();
 
-    ESP_ERROR_CHECK(esp_event_handler_register(ESP_HTTPS_OTA_EVENT, ESP_EVENT_ANY_ID, &ota_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(GECL_OTA_EVENT, ESP_EVENT_ANY_ID, &ota_event_handler, NULL));
     ESP_LOGI(TAG, "OTA event handler registered.");
 }
 
 /**
- * OTA task to manage the firmware update process.
+ * Marks an OTA session as in progress. Returns false if another session, from
+ * ota_task or the push API, already holds it.
  */
-void ota_task(void *pvParameter) {
-    ESP_LOGI(TAG, "Starting OTA Task...");
+bool ota_claim_session(void) {
+    if (ota_mutex == NULL || xSemaphoreTake(ota_mutex, portMAX_DELAY) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to take OTA mutex.");
+        return false;
+    }
+    bool claimed = !ota_in_progress;
+    if (claimed) {
+        ota_in_progress = true; // Set the flag to indicate an OTA is in progress
+        ota_trace_start();
+    } else {
+        ESP_LOGW(TAG, "OTA process already in progress.");
+    }
+    xSemaphoreGive(ota_mutex);
+    return claimed;
+}
 
-    // Check if another OTA process is already running
+void ota_release_session(void) {
     if (xSemaphoreTake(ota_mutex, portMAX_DELAY) == pdTRUE) {
-        if (ota_in_progress) {
-            ESP_LOGW(TAG, "OTA process already in progress. Aborting new task.");
-            xSemaphoreGive(ota_mutex);
-            vTaskDelete(NULL);
-            return;
-        }
-        ota_in_progress = true; // Set the flag to indicate an OTA is in progress
+        ota_in_progress = false; // Reset the flag
         xSemaphoreGive(ota_mutex);
-    } else {
-        ESP_LOGE(TAG, "Failed to take OTA mutex. Aborting task.");
-        vTaskDelete(NULL);
-        return;
     }
+}
 
-    const ota_config_t *ota = (const ota_config_t *)pvParameter;
-    ESP_LOGI(TAG, "Using URL: %s", ota->url);
+/**
+ * Records the update timestamp, with GECL_OTA_UPDATE_HISTORY.
+ */
+static void record_update_time(void) {
+#if CONFIG_GECL_OTA_UPDATE_HISTORY
+    ESP_LOGI(TAG, "OTA update successful. Writing timestamp to NVS...");
 
-    esp_https_ota_handle_t https_ota_handle = NULL;
-    esp_err_t err = ESP_OK;
+    char timestamp[20];
+    get_current_timestamp(timestamp, sizeof(timestamp));
+    if (write_ota_timestamp_to_nvs(timestamp) == ESP_OK) {
+        ESP_LOGI(TAG, "OTA timestamp written to NVS: %s", timestamp);
+    }
+#endif
+}
 
-    // Configure OTA client
-    esp_http_client_config_t http_config = {
-        .url = ota->url,
-        .cert_pem = (char *)server_cert_pem_start,
-        .timeout_ms = 10000,
-        .keep_alive_enable = true,
-    };
+/**
+ * Pulls an image through a started pipeline and finishes it.
+ */
+static esp_err_t pull_image(ota_pipeline_t *pipe, ota_source_t *source) {
+    esp_err_t err = ota_pipeline_run(pipe, source);
+    if (err == ESP_OK) {
+        err = ota_pipeline_finish(pipe);
+    } else {
+        ota_pipeline_abort(pipe);
+    }
+    return err;
+}
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &http_config,
-        .partial_http_download = true,
-        .max_http_request_size = 4096,
-    };
+/**
+ * Resolves the A/B slot each of the manifest's data partition images goes to,
+ * before anything is written. Manifests naming a partition without an A/B pair
+ * are rejected.
+ */
+static esp_err_t plan_partitions(const ota_manifest_t *manifest, const esp_partition_t **targets, int8_t *slots) {
+    for (uint8_t i = 0; i < manifest->artifact_count; i++) {
+        esp_err_t err = ota_slots_target(manifest->artifacts[i].label, &targets[i], &slots[i]);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
 
-    err = esp_https_ota_begin(&ota_config, &https_ota_handle);
+/**
+ * Writes the manifest's data partition images to the slots the running app
+ * does not use, over the source's connection.
+ */
+static esp_err_t install_partitions(const ota_config_t *ota, const ota_manifest_t *manifest, ota_source_t *source,
+                                    const esp_partition_t **targets) {
+    for (uint8_t i = 0; i < manifest->artifact_count; i++) {
+        const ota_manifest_t *image = &manifest->artifacts[i];
+        ESP_LOGI(TAG, "Updating partition %s from %s", targets[i]->label, image->image_url);
+        esp_err_t err = ota_source_reopen(source, image->image_url, ota);
+        if (err != ESP_OK) {
+            return err;
+        }
+        ota_pipeline_t pipe;
+        err = ota_pipeline_begin_partition(&pipe, image, targets[i]);
+        if (err == ESP_OK) {
+            err = pull_image(&pipe, source);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Partition %s failed: %s", targets[i]->label, esp_err_to_name(err));
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Points the session's source at the image, reusing the connection the
+ * manifest was fetched over when the server is the same, and pulls the image
+ * through the verify/write pipeline, followed by the manifest's data partition
+ * images. Everything is written to partitions the running app does not use,
+ * and the app partition becomes the boot partition only once every image is
+ * verified and the data partition slots for the new app are recorded, so a
+ * failure at any point leaves the running app with its own data.
+ */
+static esp_err_t install_image(const ota_config_t *ota, const ota_manifest_t *verify, const char *uri,
+                               ota_source_t *source) {
+    esp_err_t err = ota_source_reopen(source, uri, ota);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "OTA Begin failed: %s", esp_err_to_name(err));
-        goto cleanup;
+        return err;
+    }
+    esp_event_post(GECL_OTA_EVENT, GECL_OTA_EVENT_CONNECTED, NULL, 0, portMAX_DELAY);
+    if (verify == NULL) {
+        verify = source->manifest; // Delivered in-band by the transport, if at all
     }
 
-    while (1) {
-        err = esp_https_ota_perform(https_ota_handle);
-        if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
-            break;
+    bool partitions = verify != NULL && verify->artifact_count > 0;
+    const esp_partition_t *targets[OTA_MAX_PARTITION_IMAGES];
+    int8_t slots[OTA_MAX_PARTITION_IMAGES];
+    if (partitions) {
+        err = plan_partitions(verify, targets, slots);
+    }
+    ota_pipeline_t pipe;
+    if (err == ESP_OK) {
+        err = ota_pipeline_begin(&pipe, verify);
+    }
+    if (err == ESP_OK) {
+        pipe.defer_boot = partitions;
+        err = pull_image(&pipe, source);
+    }
+    if (err == ESP_OK && partitions) {
+        err = install_partitions(ota, verify, source, targets);
+        if (err == ESP_OK) {
+            err = ota_slots_commit(pipe.partition, verify, slots);
+        }
+        if (err == ESP_OK) {
+            err = esp_ota_set_boot_partition(pipe.partition);
         }
-        vTaskDelay(pdMS_TO_TICKS(100)); // Allow other tasks to run
     }
+    return err;
+}
 
-    if (esp_https_ota_is_complete_data_received(https_ota_handle)) {
-        err = esp_https_ota_finish(https_ota_handle);
-        if (err == ESP_OK) {
-            ESP_LOGI(TAG, "OTA update successful. Writing timestamp to NVS...");
+/**
+ * Runs one update: fetches the manifest when configured and installs the
+ * image. With peer-to-peer distribution enabled, manifest-verified images are
+ * shared on the LAN: peers install from the elected leader and fall back to
+ * the origin, the leader serves the image after installing it.
+ */
+static esp_err_t run_update(const ota_config_t *ota) {
+    ota_source_t source = {0}; // One connection for the manifest, chunk maps and images
+    ota_manifest_t manifest = {0};
+    const ota_manifest_t *verify = NULL;
+    const char *uri = ota->url;
+    esp_err_t err = ESP_OK;
+
+    esp_event_post(GECL_OTA_EVENT, GECL_OTA_EVENT_START, NULL, 0, portMAX_DELAY);
 
-            char timestamp[20];
-            get_current_timestamp(timestamp, sizeof(timestamp));
-            if (write_ota_timestamp_to_nvs(timestamp) == ESP_OK) {
-                ESP_LOGI(TAG, "OTA timestamp written to NVS: %s", timestamp);
+    if (ota->manifest_url[0] != '\0') {
+        ESP_LOGI(TAG, "Using manifest: %s", ota->manifest_url);
+        err = ota_manifest_fetch(ota, &source, &manifest);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to fetch manifest: %s", esp_err_to_name(err));
+            goto done;
+        }
+        verify = &manifest;
+        uri = manifest.image_url;
+    }
+
+#if CONFIG_GECL_OTA_P2P_ENABLED
+    if (verify != NULL) {
+        char peer_url[96];
+        ota_p2p_role_t role = ota_p2p_elect(verify, peer_url, sizeof(peer_url));
+        if (role == OTA_P2P_PEER) {
+            err = install_image(ota, verify, peer_url, &source);
+            if (err == ESP_OK) {
+                goto done;
             }
-            ESP_LOGI(TAG, "Rebooting...");
-            esp_restart();
-        } else {
-            ESP_LOGE(TAG, "OTA Finish failed: %s", esp_err_to_name(err));
+            ESP_LOGW(TAG, "Peer download failed (%s), falling back to origin", esp_err_to_name(err));
         }
-    } else {
-        ESP_LOGE(TAG, "Incomplete data received during OTA.");
+        err = install_image(ota, verify, uri, &source);
+        if (role == OTA_P2P_LEADER) {
+            if (err == ESP_OK) {
+                ota_source_close(&source); // Idle while serving
+                ota_p2p_serve();
+            } else {
+                ota_p2p_stop();
+            }
+        }
+        goto done;
     }
+#endif
 
-cleanup:
-    esp_https_ota_abort(https_ota_handle);
-    if (xSemaphoreTake(ota_mutex, portMAX_DELAY) == pdTRUE) {
-        ota_in_progress = false; // Reset the flag
-        xSemaphoreGive(ota_mutex);
+    err = ota_source_check_verified(uri, verify);
+    if (err == ESP_OK) {
+        err = install_image(ota, verify, uri, &source);
+    }
+
+done:
+    ota_source_close(&source);
+    ota_manifest_free(&manifest);
+    ota_trace_stop(err); // Before ota_task reboots
+    esp_event_post(GECL_OTA_EVENT, err == ESP_OK ? GECL_OTA_EVENT_FINISH : GECL_OTA_EVENT_ABORT, NULL, 0,
+                   portMAX_DELAY);
+    return err;
+}
+
+/**
+ * OTA task to manage the firmware update process.
+ */
+void ota_task(void *pvParameter) {
+    ESP_LOGI(TAG, "Starting OTA Task...");
+
+    // Check if another OTA process is already running
+    if (!ota_claim_session()) {
+        ESP_LOGW(TAG, "Aborting new task.");
+        vTaskDelete(NULL);
+        return;
     }
+
+    const ota_config_t *ota = (const ota_config_t *)pvParameter;
+    ESP_LOGI(TAG, "Using URL: %s", ota->url);
+
+    task_sample_t sample;
+    task_sample_begin(&sample);
+    esp_err_t err = run_update(ota);
+    if (err == ESP_OK) {
+        record_update_time();
+    } else {
+        ESP_LOGE(TAG, "OTA failed: %s", esp_err_to_name(err));
+    }
+    task_sample_end(&sample, err); // After the other NVS writes, before the reboot
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Rebooting...");
+        esp_restart();
+    }
+
+    ota_release_session();
     ESP_LOGI(TAG, "OTA process ended.");
     vTaskDelete(NULL);
 }
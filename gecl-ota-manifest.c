@@ -0,0 +1,480 @@
+/*
+ * OTA Manifest and Merkle Verification
+ * ====================================
+ *
+ * Fetches and parses the JSON manifest that describes an image, downloads its
+ * chunk map and authenticates the chunk map against the manifest's Merkle root.
+ * The manifest and the chunk maps are read through the session's image source,
+ * so they share its kept-alive connection and TLS session with the images.
+ *
+ * Manifest format:
+ *
+ *   {
+ *     "version": "1.4.2",
+ *     "image": "firmware.bin",          // optional, absolute or relative to the manifest URL
+ *     "size": 1048576,
+ *     "sha256": "<64 hex chars>",       // digest of the whole image
+ *     "chunk_size": 16384,
+ *     "merkle_root": "<64 hex chars>",
+ *     "chunk_map": "firmware.chunks",   // absolute or relative to the manifest URL
+ *     "partitions": [                   // optional data partition images, same fields plus a label
+ *       {"label": "assets", "image": "assets.bin", "size": ..., "sha256": ..., ...}
+ *     ]
+ *   }
+ *
+ * Artifact manifests, fetched by ota_artifact_update(), list named blobs
+ * (certificates, configuration, models) instead of an app image:
+ *
+ *   {
+ *     "artifacts": [
+ *       {"name": "ca_cert", "version": "2024-06", "image": "ca.pem", "size": ..., "sha256": ..., ...},
+ *       {"name": "model", "partition": "model", ...}  // A/B pair "model_a"/"model_b", NVS otherwise
+ *     ]
+ *   }
+ *
+ * The chunk map is the binary concatenation of the 32-byte leaf hashes, one per
+ * chunk. Transports without a URL space (MQTT) carry it inline instead, as a
+ * hex string in a "leaves" field. Leaves are SHA-256(0x00 || chunk), interior
+ * nodes are SHA-256(0x01 || left || right), and an odd node at the end of a
+ * level is promoted unchanged to the next level.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_MANIFEST";
+
+// Smallest chunk size accepted for images longer than one chunk
+#define OTA_MIN_CHUNK_SIZE 256
+
+static const uint8_t MERKLE_LEAF_PREFIX = 0x00;
+static const uint8_t MERKLE_NODE_PREFIX = 0x01;
+
+/**
+ * Decodes a hex string into exactly out_len bytes.
+ */
+esp_err_t ota_hex_decode(const char *hex, uint8_t *out, size_t out_len) {
+    if (hex == NULL || strlen(hex) != out_len * 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < out_len; i++) {
+        unsigned int byte;
+        if (sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Resolves a manifest reference: absolute URLs are copied, relative ones replace
+ * the last path segment of the manifest URL.
+ */
+static esp_err_t resolve_url(const char *manifest_url, const char *ref, char *out, size_t out_len) {
+    if (strstr(ref, "://") != NULL) {
+        if (strlen(ref) >= out_len) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        strcpy(out, ref);
+        return ESP_OK;
+    }
+
+    const char *slash = strrchr(manifest_url, '/');
+    size_t base_len = slash ? (size_t)(slash - manifest_url) + 1 : 0;
+    if (base_len + strlen(ref) >= out_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(out, manifest_url, base_len);
+    strcpy(out + base_len, ref);
+    return ESP_OK;
+}
+
+void ota_merkle_leaf_hash(const uint8_t *data, size_t len, uint8_t out[OTA_SHA256_LEN]) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, &MERKLE_LEAF_PREFIX, 1);
+    mbedtls_sha256_update(&ctx, data, len);
+    mbedtls_sha256_finish(&ctx, out);
+    mbedtls_sha256_free(&ctx);
+}
+
+/**
+ * Computes the Merkle root over count leaf hashes.
+ */
+esp_err_t ota_merkle_root(const uint8_t *leaves, uint32_t count, uint8_t out[OTA_SHA256_LEN]) {
+    if (count == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t *level = malloc((size_t)count * OTA_SHA256_LEN);
+    if (level == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(level, leaves, (size_t)count * OTA_SHA256_LEN);
+
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    while (count > 1) {
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < count; i += 2, next++) {
+            uint8_t *dst = &level[next * OTA_SHA256_LEN];
+            if (i + 1 == count) {
+                memmove(dst, &level[i * OTA_SHA256_LEN], OTA_SHA256_LEN); // Promote odd node
+                continue;
+            }
+            mbedtls_sha256_starts(&ctx, 0);
+            mbedtls_sha256_update(&ctx, &MERKLE_NODE_PREFIX, 1);
+            mbedtls_sha256_update(&ctx, &level[i * OTA_SHA256_LEN], 2 * OTA_SHA256_LEN);
+            mbedtls_sha256_finish(&ctx, dst); // dst never overlaps a pair not yet consumed
+        }
+        count = next;
+    }
+    mbedtls_sha256_free(&ctx);
+
+    memcpy(out, level, OTA_SHA256_LEN);
+    free(level);
+    return ESP_OK;
+}
+
+size_t ota_manifest_chunk_len(const ota_manifest_t *manifest, uint32_t index) {
+    size_t offset = (size_t)index * manifest->chunk_size;
+    if (offset >= manifest->image_size) {
+        return 0;
+    }
+    size_t remaining = manifest->image_size - offset;
+    return remaining < manifest->chunk_size ? remaining : manifest->chunk_size;
+}
+
+/**
+ * Checks a received chunk against its leaf in the authenticated chunk map.
+ */
+bool ota_manifest_chunk_ok(const ota_manifest_t *manifest, uint32_t index, const uint8_t *data, size_t len) {
+    if (index >= manifest->chunk_count || len != ota_manifest_chunk_len(manifest, index)) {
+        return false;
+    }
+    uint8_t leaf[OTA_SHA256_LEN];
+    ota_merkle_leaf_hash(data, len, leaf);
+    return memcmp(leaf, &manifest->leaves[(size_t)index * OTA_SHA256_LEN], OTA_SHA256_LEN) == 0;
+}
+
+/**
+ * Whether a JSON value is a whole number that fits an int.
+ */
+static bool is_integer(const cJSON *item) {
+    return cJSON_IsNumber(item) && item->valuedouble == (double)item->valueint;
+}
+
+/**
+ * Parses the fields describing one image. The chunk map is either carried
+ * inline as a hex "leaves" string, in which case it is decoded into
+ * manifest->leaves, or referenced by "chunk_map", in which case its resolved
+ * URL is kept in manifest->chunk_map_url and manifest->leaves is left NULL.
+ */
+static esp_err_t parse_image(const cJSON *obj, const char *manifest_url, const char *default_image_url,
+                             ota_manifest_t *manifest) {
+    const cJSON *version = cJSON_GetObjectItemCaseSensitive(obj, "version");
+    const cJSON *image = cJSON_GetObjectItemCaseSensitive(obj, "image");
+    const cJSON *size = cJSON_GetObjectItemCaseSensitive(obj, "size");
+    const cJSON *sha256 = cJSON_GetObjectItemCaseSensitive(obj, "sha256");
+    const cJSON *chunk_size = cJSON_GetObjectItemCaseSensitive(obj, "chunk_size");
+    const cJSON *merkle_root = cJSON_GetObjectItemCaseSensitive(obj, "merkle_root");
+    const cJSON *chunk_map = cJSON_GetObjectItemCaseSensitive(obj, "chunk_map");
+    const cJSON *leaves = cJSON_GetObjectItemCaseSensitive(obj, "leaves");
+
+    if (!is_integer(size) || size->valueint <= 0 || !is_integer(chunk_size) ||
+        chunk_size->valueint > CONFIG_GECL_OTA_MAX_CHUNK_SIZE ||
+        (chunk_size->valueint < OTA_MIN_CHUNK_SIZE && chunk_size->valueint < size->valueint) ||
+        !cJSON_IsString(sha256) || !cJSON_IsString(merkle_root) ||
+        (!cJSON_IsString(chunk_map) && !cJSON_IsString(leaves))) {
+        ESP_LOGE(TAG, "Manifest is missing required fields");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    manifest->image_size = (size_t)size->valueint;
+    manifest->chunk_size = (size_t)chunk_size->valueint;
+    manifest->chunk_count = (manifest->image_size + manifest->chunk_size - 1) / manifest->chunk_size;
+
+    esp_err_t err;
+    if (cJSON_IsString(version)) {
+        strlcpy(manifest->version, version->valuestring, sizeof(manifest->version));
+    }
+    if (cJSON_IsString(image)) {
+        err = resolve_url(manifest_url, image->valuestring, manifest->image_url, sizeof(manifest->image_url));
+    } else {
+        err = resolve_url(manifest_url, default_image_url, manifest->image_url, sizeof(manifest->image_url));
+    }
+    if (err == ESP_OK) {
+        err = ota_hex_decode(sha256->valuestring, manifest->image_sha256, OTA_SHA256_LEN);
+    }
+    if (err == ESP_OK) {
+        err = ota_hex_decode(merkle_root->valuestring, manifest->merkle_root, OTA_SHA256_LEN);
+    }
+    if (err == ESP_OK && cJSON_IsString(leaves)) {
+        size_t map_len = (size_t)manifest->chunk_count * OTA_SHA256_LEN;
+        manifest->leaves = malloc(map_len);
+        err = manifest->leaves ? ota_hex_decode(leaves->valuestring, manifest->leaves, map_len) : ESP_ERR_NO_MEM;
+    } else if (err == ESP_OK) {
+        manifest->chunk_map_url = malloc(sizeof(manifest->image_url));
+        err = manifest->chunk_map_url ? resolve_url(manifest_url, chunk_map->valuestring, manifest->chunk_map_url,
+                                                    sizeof(manifest->image_url))
+                                      : ESP_ERR_NO_MEM;
+    }
+    return err;
+}
+
+/**
+ * Parses the images to write to data partitions in the same session.
+ */
+static esp_err_t parse_partitions(const cJSON *partitions, const char *manifest_url, ota_manifest_t *manifest) {
+    int count = cJSON_GetArraySize(partitions);
+    if (!cJSON_IsArray(partitions) || count > OTA_MAX_PARTITION_IMAGES) {
+        ESP_LOGE(TAG, "\"partitions\" must be an array of at most %d images", OTA_MAX_PARTITION_IMAGES);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    manifest->artifacts = calloc(count, sizeof(ota_manifest_t));
+    if (manifest->artifacts == NULL && count > 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    manifest->artifact_count = count;
+
+    for (int i = 0; i < count; i++) {
+        const cJSON *entry = cJSON_GetArrayItem(partitions, i);
+        const cJSON *label = cJSON_GetObjectItemCaseSensitive(entry, "label");
+        ota_manifest_t *artifact = &manifest->artifacts[i];
+        if (!cJSON_IsString(label) || strlen(label->valuestring) >= sizeof(artifact->label) ||
+            !cJSON_IsString(cJSON_GetObjectItemCaseSensitive(entry, "image"))) {
+            ESP_LOGE(TAG, "Partition image %d needs a label and an image", i);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        strcpy(artifact->label, label->valuestring);
+        esp_err_t err = parse_image(entry, manifest_url, "", artifact);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Parses the named artifacts of an artifact manifest.
+ */
+static esp_err_t parse_artifacts(const cJSON *artifacts, const char *manifest_url, ota_manifest_t *manifest) {
+    int count = cJSON_GetArraySize(artifacts);
+    if (!cJSON_IsArray(artifacts) || count > OTA_MAX_PARTITION_IMAGES) {
+        ESP_LOGE(TAG, "\"artifacts\" must be an array of at most %d entries", OTA_MAX_PARTITION_IMAGES);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    manifest->artifacts = calloc(count, sizeof(ota_manifest_t));
+    if (manifest->artifacts == NULL && count > 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    manifest->artifact_count = count;
+
+    for (int i = 0; i < count; i++) {
+        const cJSON *entry = cJSON_GetArrayItem(artifacts, i);
+        const cJSON *name = cJSON_GetObjectItemCaseSensitive(entry, "name");
+        const cJSON *partition = cJSON_GetObjectItemCaseSensitive(entry, "partition");
+        ota_manifest_t *artifact = &manifest->artifacts[i];
+        if (!cJSON_IsString(name) || name->valuestring[0] == '\0' ||
+            strlen(name->valuestring) >= sizeof(artifact->name) ||
+            !cJSON_IsString(cJSON_GetObjectItemCaseSensitive(entry, "image")) ||
+            (partition != NULL && (!cJSON_IsString(partition) ||
+                                   strlen(partition->valuestring) + 2 >= sizeof(artifact->label)))) {
+            ESP_LOGE(TAG, "Artifact %d needs a name of at most %u characters and an image", i,
+                     (unsigned)sizeof(artifact->name) - 1);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        strcpy(artifact->name, name->valuestring);
+        if (partition != NULL) {
+            strcpy(artifact->label, partition->valuestring);
+        }
+        esp_err_t err = parse_image(entry, manifest_url, "", artifact);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Parses a manifest document: the app image and, when present, the data
+ * partition images listed under "partitions".
+ */
+esp_err_t ota_manifest_parse(const char *json, size_t len, const char *manifest_url, const char *default_image_url,
+                             ota_manifest_t *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (root == NULL) {
+        ESP_LOGE(TAG, "Manifest is not valid JSON");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    esp_err_t err = parse_image(root, manifest_url, default_image_url, manifest);
+    const cJSON *partitions = cJSON_GetObjectItemCaseSensitive(root, "partitions");
+    if (err == ESP_OK && partitions != NULL) {
+        err = parse_partitions(partitions, manifest_url, manifest);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Malformed manifest: %s", esp_err_to_name(err));
+        ota_manifest_free(manifest);
+    }
+
+    cJSON_Delete(root);
+    return err;
+}
+
+/**
+ * Checks that the loaded chunk map hashes up to the manifest's Merkle root.
+ */
+esp_err_t ota_manifest_authenticate(const ota_manifest_t *manifest) {
+    uint8_t root[OTA_SHA256_LEN];
+    esp_err_t err = ota_merkle_root(manifest->leaves, manifest->chunk_count, root);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (memcmp(root, manifest->merkle_root, OTA_SHA256_LEN) != 0) {
+        ESP_LOGE(TAG, "Chunk map does not match the manifest Merkle root");
+        return ESP_ERR_INVALID_CRC;
+    }
+    ESP_LOGI(TAG, "Manifest %s: %u bytes in %" PRIu32 " chunks of %u bytes", manifest->version,
+             (unsigned)manifest->image_size, manifest->chunk_count, (unsigned)manifest->chunk_size);
+    return ESP_OK;
+}
+
+/**
+ * Downloads an image's chunk map through source when it is not inline and
+ * authenticates it against the Merkle root.
+ */
+static esp_err_t load_chunk_map(ota_manifest_t *manifest, const ota_config_t *ota, ota_source_t *source) {
+    esp_err_t err = ESP_OK;
+    if (manifest->leaves == NULL) {
+        size_t map_len = (size_t)manifest->chunk_count * OTA_SHA256_LEN;
+        size_t received = 0;
+        manifest->leaves = malloc(map_len);
+        err = manifest->leaves
+                  ? ota_source_get(source, manifest->chunk_map_url, ota, manifest->leaves, map_len, &received)
+                  : ESP_ERR_NO_MEM;
+        if (err == ESP_OK && received != map_len) {
+            ESP_LOGE(TAG, "Chunk map has %u bytes, expected %u", (unsigned)received, (unsigned)map_len);
+            err = ESP_ERR_INVALID_SIZE;
+        }
+    }
+    free(manifest->chunk_map_url);
+    manifest->chunk_map_url = NULL;
+
+    if (err == ESP_OK) {
+        err = ota_manifest_authenticate(manifest);
+    }
+    return err;
+}
+
+/**
+ * Parses a manifest document, then downloads the chunk maps of all its images
+ * through source and authenticates them.
+ */
+esp_err_t ota_manifest_load(const char *json, size_t len, const char *manifest_url, const char *default_image_url,
+                            const ota_config_t *ota, ota_source_t *source, ota_manifest_t *manifest) {
+    esp_err_t err = ota_manifest_parse(json, len, manifest_url, default_image_url, manifest);
+    if (err == ESP_OK) {
+        err = load_chunk_map(manifest, ota, source);
+    }
+    for (uint8_t i = 0; err == ESP_OK && i < manifest->artifact_count; i++) {
+        err = load_chunk_map(&manifest->artifacts[i], ota, source);
+    }
+    if (err != ESP_OK) {
+        ota_manifest_free(manifest);
+    }
+    return err;
+}
+
+/**
+ * Downloads a manifest document through source into a newly allocated buffer.
+ */
+static esp_err_t fetch_document(const char *manifest_url, const ota_config_t *ota, ota_source_t *source, char **json,
+                                size_t *json_len) {
+    *json = malloc(CONFIG_GECL_OTA_MANIFEST_MAX_SIZE);
+    if (*json == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err =
+        ota_source_get(source, manifest_url, ota, (uint8_t *)*json, CONFIG_GECL_OTA_MANIFEST_MAX_SIZE, json_len);
+    if (err != ESP_OK) {
+        free(*json);
+        *json = NULL;
+    }
+    return err;
+}
+
+/**
+ * Downloads the manifest at ota->manifest_url and loads it, with ota->url as
+ * the image when the manifest names none. The downloads go through source,
+ * which stays open for the image.
+ */
+esp_err_t ota_manifest_fetch(const ota_config_t *ota, ota_source_t *source, ota_manifest_t *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+
+    char *json;
+    size_t json_len = 0;
+    esp_err_t err = fetch_document(ota->manifest_url, ota, source, &json, &json_len);
+    if (err == ESP_OK) {
+        err = ota_manifest_load(json, json_len, ota->manifest_url, ota->url, ota, source, manifest);
+        free(json);
+    }
+    return err;
+}
+
+/**
+ * Downloads an artifact manifest and loads the chunk maps of all artifacts
+ * through source. The artifacts are returned in manifest->artifacts; the root
+ * describes no image.
+ */
+esp_err_t ota_artifacts_fetch(const char *manifest_url, const ota_config_t *ota, ota_source_t *source,
+                              ota_manifest_t *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+
+    char *json;
+    size_t json_len = 0;
+    esp_err_t err = fetch_document(manifest_url, ota, source, &json, &json_len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    cJSON *root = cJSON_ParseWithLength(json, json_len);
+    free(json);
+    if (root == NULL) {
+        ESP_LOGE(TAG, "Artifact manifest is not valid JSON");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    err = parse_artifacts(cJSON_GetObjectItemCaseSensitive(root, "artifacts"), manifest_url, manifest);
+    cJSON_Delete(root);
+    for (uint8_t i = 0; err == ESP_OK && i < manifest->artifact_count; i++) {
+        err = load_chunk_map(&manifest->artifacts[i], ota, source);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Malformed artifact manifest: %s", esp_err_to_name(err));
+        ota_manifest_free(manifest);
+    }
+    return err;
+}
+
+void ota_manifest_free(ota_manifest_t *manifest) {
+    for (uint8_t i = 0; i < manifest->artifact_count; i++) {
+        ota_manifest_free(&manifest->artifacts[i]);
+    }
+    free(manifest->artifacts);
+    manifest->artifacts = NULL;
+    manifest->artifact_count = 0;
+    free(manifest->chunk_map_url);
+    manifest->chunk_map_url = NULL;
+    free(manifest->leaves);
+    manifest->leaves = NULL;
+}
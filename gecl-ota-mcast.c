@@ -0,0 +1,408 @@
+/*
+ * UDP Multicast Image Source
+ * ==========================
+ *
+ * Receives an image that a sender streams to a multicast group, so a whole
+ * site can update from a single transmission. The URI is
+ *
+ *   mcast://<group>:<port>[?fallback=<url>]
+ *
+ * The image is cut into blocks, and every group of k data blocks is followed
+ * by one parity block (the XOR of the group), so any single lost block per
+ * group is rebuilt locally. The sender repeats the image in a carousel. Blocks
+ * still missing when the sender has moved past the receive window, or after
+ * GECL_OTA_MCAST_TIMEOUT_MS of silence, are fetched with ranged reads from the
+ * fallback URL. Without a fallback the receiver waits for the next carousel
+ * pass instead.
+ *
+ * Every datagram carries a 16-byte little-endian header followed by one block:
+ *
+ *   "GMCF" | image size (u32) | group (u32) | block size (u16) | k (u8) | index (u8)
+ *
+ * Indices 0..k-1 are data blocks, index k is the parity block. The last data
+ * block is zero-padded, and data blocks past the end of the image are implied
+ * zeros that are never sent.
+ *
+ * Blocks are delivered to the pipeline in order, so chunk verification and the
+ * ranged re-fetch of corrupted chunks work as for any other source.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_MCAST";
+
+#define MCAST_MAGIC "GMCF"
+#define MCAST_HEADER_LEN 16
+#define MCAST_MAX_PACKET 1472 // Largest UDP payload without IP fragmentation on Ethernet and Wi-Fi
+#define MCAST_FALLBACK_PARAM "?fallback="
+
+typedef struct {
+    uint32_t group;   // Group held by the slot, UINT32_MAX when free
+    uint32_t present; // Bitmap of received blocks, bit k is the parity block
+    uint8_t *blocks;  // (k + 1) * block_size bytes
+} mcast_slot_t;
+
+typedef struct {
+    int sock;
+    uint8_t *packet;
+    size_t block_size; // Learned from the first datagram
+    uint8_t k;
+    uint32_t group_count;
+    mcast_slot_t slots[CONFIG_GECL_OTA_MCAST_WINDOW];
+    uint8_t *slot_mem;
+    size_t pos;            // Next byte read() returns
+    int64_t last_heard_us; // Time of the last datagram of this image
+    char fallback_url[512];
+    const ota_config_t *ota; // Caller's configuration, for sources that need it
+    ota_source_t fallback;   // Opened on first use
+    bool fallback_open;
+} mcast_source_t;
+
+static inline uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static mcast_slot_t *slot_for(mcast_source_t *mc, uint32_t group) {
+    return &mc->slots[group % CONFIG_GECL_OTA_MCAST_WINDOW];
+}
+
+static uint32_t group_mask(const mcast_source_t *mc) { return (1u << mc->k) - 1; }
+
+static size_t group_offset(const mcast_source_t *mc, uint32_t group) {
+    return (size_t)group * mc->k * mc->block_size;
+}
+
+/**
+ * Claims the slot for a group. Data blocks that lie entirely past the end of
+ * the image are marked present as implied zeros.
+ */
+static void claim_slot(ota_source_t *src, mcast_source_t *mc, uint32_t group) {
+    mcast_slot_t *slot = slot_for(mc, group);
+    slot->group = group;
+    slot->present = 0;
+    memset(slot->blocks, 0, (mc->k + 1) * mc->block_size);
+    for (uint8_t i = 0; i < mc->k; i++) {
+        if (group_offset(mc, group) + (size_t)i * mc->block_size >= src->size) {
+            slot->present |= 1u << i;
+        }
+    }
+}
+
+/**
+ * Rebuilds a single missing data block from the parity block.
+ */
+static bool recover(mcast_source_t *mc, mcast_slot_t *slot) {
+    uint32_t missing = ~slot->present & group_mask(mc);
+    if (missing == 0) {
+        return true;
+    }
+    if ((missing & (missing - 1)) != 0 || (slot->present & (1u << mc->k)) == 0) {
+        return false; // More than one block lost, or the parity block itself
+    }
+
+    uint8_t lost = 0;
+    while ((missing & (1u << lost)) == 0) {
+        lost++;
+    }
+    uint8_t *dst = slot->blocks + (size_t)lost * mc->block_size;
+    memcpy(dst, slot->blocks + (size_t)mc->k * mc->block_size, mc->block_size);
+    for (uint8_t i = 0; i < mc->k; i++) {
+        if (i != lost) {
+            const uint8_t *block = slot->blocks + (size_t)i * mc->block_size;
+            for (size_t b = 0; b < mc->block_size; b++) {
+                dst[b] ^= block[b];
+            }
+        }
+    }
+    slot->present |= missing;
+    return true;
+}
+
+/**
+ * Sets up the receive window from the first datagram's geometry.
+ */
+static esp_err_t init_window(ota_source_t *src, mcast_source_t *mc, size_t image_size, size_t block_size, uint8_t k) {
+    if (block_size == 0 || block_size > MCAST_MAX_PACKET - MCAST_HEADER_LEN || k == 0 || k > 31 ||
+        image_size == 0) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    size_t slot_len = (k + 1) * block_size;
+    mc->slot_mem = malloc(slot_len * CONFIG_GECL_OTA_MCAST_WINDOW);
+    if (mc->slot_mem == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    mc->block_size = block_size;
+    mc->k = k;
+    src->size = image_size;
+    size_t group_len = (size_t)k * block_size;
+    mc->group_count = (image_size + group_len - 1) / group_len;
+    for (int i = 0; i < CONFIG_GECL_OTA_MCAST_WINDOW; i++) {
+        mc->slots[i].group = UINT32_MAX;
+        mc->slots[i].blocks = mc->slot_mem + i * slot_len;
+    }
+    ESP_LOGI(TAG, "Receiving %u bytes in %" PRIu32 " groups of %u x %u bytes", (unsigned)image_size,
+             mc->group_count, k, (unsigned)block_size);
+    return ESP_OK;
+}
+
+/**
+ * Receives one datagram and stores it if it falls inside the window. Sets
+ * *overrun when the sender has moved past the window, meaning the current
+ * group will not be completed from this carousel pass.
+ */
+static esp_err_t receive_block(ota_source_t *src, mcast_source_t *mc, uint32_t current, bool *overrun) {
+    int n = recv(mc->sock, mc->packet, MCAST_MAX_PACKET, 0);
+    if (n < 0) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (n < MCAST_HEADER_LEN || memcmp(mc->packet, MCAST_MAGIC, 4) != 0) {
+        return ESP_OK; // Not ours
+    }
+
+    size_t image_size = read_le32(&mc->packet[4]);
+    uint32_t group = read_le32(&mc->packet[8]);
+    size_t block_size = mc->packet[12] | mc->packet[13] << 8;
+    uint8_t k = mc->packet[14];
+    uint8_t index = mc->packet[15];
+
+    if (mc->block_size == 0) {
+        esp_err_t err = init_window(src, mc, image_size, block_size, k);
+        if (err != ESP_OK) {
+            return err == ESP_ERR_NO_MEM ? err : ESP_OK; // Ignore datagrams with an impossible geometry
+        }
+    }
+    if (image_size != src->size || block_size != mc->block_size || k != mc->k || index > k ||
+        (size_t)n != MCAST_HEADER_LEN + block_size || group >= mc->group_count) {
+        return ESP_OK; // A different image or a malformed datagram
+    }
+    mc->last_heard_us = esp_timer_get_time();
+    if (group < current) {
+        return ESP_OK; // Already delivered
+    }
+    if (group >= current + CONFIG_GECL_OTA_MCAST_WINDOW) {
+        *overrun = true;
+        return ESP_OK;
+    }
+
+    mcast_slot_t *slot = slot_for(mc, group);
+    if (slot->group != group) {
+        claim_slot(src, mc, group);
+    }
+    memcpy(slot->blocks + (size_t)index * block_size, &mc->packet[MCAST_HEADER_LEN], block_size);
+    slot->present |= 1u << index;
+    return ESP_OK;
+}
+
+static esp_err_t open_fallback(mcast_source_t *mc) {
+    if (mc->fallback_url[0] == '\0') {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (!mc->fallback_open) {
+        esp_err_t err = ota_source_open(&mc->fallback, mc->fallback_url, mc->ota);
+        if (err != ESP_OK) {
+            return err;
+        }
+        mc->fallback_open = true;
+    }
+    return mc->fallback.ops->read_range != NULL ? ESP_OK : ESP_ERR_NOT_SUPPORTED;
+}
+
+/**
+ * Fills the current group's missing data blocks from the fallback URL.
+ */
+static esp_err_t fetch_missing(ota_source_t *src, mcast_source_t *mc, mcast_slot_t *slot) {
+    esp_err_t err = open_fallback(mc);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    for (uint8_t i = 0; i < mc->k; i++) {
+        if (slot->present & (1u << i)) {
+            continue;
+        }
+        size_t offset = group_offset(mc, slot->group) + (size_t)i * mc->block_size;
+        size_t len = src->size - offset < mc->block_size ? src->size - offset : mc->block_size;
+        err = mc->fallback.ops->read_range(&mc->fallback, offset, slot->blocks + i * mc->block_size, len);
+        src->requests = mc->fallback.requests;
+        if (err != ESP_OK) {
+            return err;
+        }
+        slot->present |= 1u << i;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Waits until the group holding the read position is complete, rebuilding a
+ * lost block from parity. With a fallback, missing blocks are fetched as soon
+ * as the sender moves past the window or falls silent; without one, the
+ * receiver waits for the next carousel pass for as long as the sender is heard.
+ */
+static esp_err_t complete_group(ota_source_t *src, mcast_source_t *mc, uint32_t group) {
+    const int64_t timeout_us = (int64_t)CONFIG_GECL_OTA_MCAST_TIMEOUT_MS * 1000;
+    mc->last_heard_us = esp_timer_get_time();
+    while (true) {
+        if (mc->block_size != 0) {
+            mcast_slot_t *slot = slot_for(mc, group);
+            if (slot->group != group) {
+                claim_slot(src, mc, group);
+            }
+            if (recover(mc, slot)) {
+                return ESP_OK;
+            }
+        }
+
+        bool overrun = false;
+        esp_err_t err = receive_block(src, mc, group, &overrun);
+        if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
+            return err;
+        }
+        bool expired = esp_timer_get_time() - mc->last_heard_us >= timeout_us;
+        if (mc->block_size == 0) {
+            if (expired) {
+                return ESP_ERR_TIMEOUT; // Nothing heard from the sender yet
+            }
+            continue;
+        }
+        if ((overrun || expired) && mc->fallback_url[0] != '\0') {
+            mcast_slot_t *slot = slot_for(mc, group);
+            ESP_LOGW(TAG, "Group %" PRIu32 " incomplete, fetching missing blocks from fallback", group);
+            return fetch_missing(src, mc, slot);
+        }
+        if (expired) {
+            return ESP_ERR_TIMEOUT; // The sender stopped before the group was complete
+        }
+    }
+}
+
+static esp_err_t mcast_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    char addr[16];
+    const char *hostport = uri + strlen("mcast://");
+    const char *colon = strchr(hostport, ':');
+    if (colon == NULL || (size_t)(colon - hostport) >= sizeof(addr)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(addr, hostport, colon - hostport);
+    addr[colon - hostport] = '\0';
+    int port = atoi(colon + 1);
+
+    mcast_source_t *mc = calloc(1, sizeof(*mc));
+    if (mc == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    mc->ota = ota;
+    const char *fallback = strstr(colon, MCAST_FALLBACK_PARAM);
+    if (fallback != NULL) {
+        strlcpy(mc->fallback_url, fallback + strlen(MCAST_FALLBACK_PARAM), sizeof(mc->fallback_url));
+    }
+
+    esp_err_t err = ESP_OK;
+    struct ip_mreq mreq = {.imr_interface.s_addr = htonl(INADDR_ANY)};
+    struct sockaddr_in bind_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = 200 * 1000};
+    int enable = 1;
+
+    mc->packet = malloc(MCAST_MAX_PACKET);
+    mc->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (mc->packet == NULL || mc->sock < 0) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    setsockopt(mc->sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(mc->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (inet_pton(AF_INET, addr, &mreq.imr_multiaddr) != 1 || port <= 0 || port > 65535) {
+        err = ESP_ERR_INVALID_ARG;
+        goto cleanup;
+    }
+    if (bind(mc->sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) != 0 ||
+        setsockopt(mc->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+        ESP_LOGE(TAG, "Failed to join %s:%d", addr, port);
+        err = ESP_FAIL;
+        goto cleanup;
+    }
+
+    ESP_LOGI(TAG, "Joined %s:%d%s", addr, port, mc->fallback_url[0] != '\0' ? " with unicast fallback" : "");
+    src->ctx = mc;
+    return ESP_OK;
+
+cleanup:
+    if (mc->sock >= 0) {
+        close(mc->sock);
+    }
+    free(mc->packet);
+    free(mc);
+    return err;
+}
+
+static int mcast_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    mcast_source_t *mc = src->ctx;
+    if (mc->block_size != 0 && mc->pos >= src->size) {
+        return 0;
+    }
+
+    uint32_t group = mc->block_size != 0 ? mc->pos / (mc->k * mc->block_size) : 0;
+    esp_err_t err = complete_group(src, mc, group);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Group %" PRIu32 " not received: %s", group, esp_err_to_name(err));
+        return -1;
+    }
+
+    mcast_slot_t *slot = slot_for(mc, group);
+    size_t group_start = group_offset(mc, group);
+    size_t group_end = group_start + (size_t)mc->k * mc->block_size;
+    if (group_end > src->size) {
+        group_end = src->size;
+    }
+    size_t n = group_end - mc->pos < len ? group_end - mc->pos : len;
+    memcpy(buf, slot->blocks + (mc->pos - group_start), n);
+    src->copied += n;
+    mc->pos += n;
+    if (mc->pos == group_end) {
+        slot->group = UINT32_MAX; // Free the slot for a group further ahead
+    }
+    return (int)n;
+}
+
+static esp_err_t mcast_read_range(ota_source_t *src, size_t offset, uint8_t *buf, size_t len) {
+    mcast_source_t *mc = src->ctx;
+    esp_err_t err = open_fallback(mc); // A corrupted chunk cannot be requested from the carousel
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = mc->fallback.ops->read_range(&mc->fallback, offset, buf, len);
+    src->requests = mc->fallback.requests;
+    return err;
+}
+
+static void mcast_close(ota_source_t *src) {
+    mcast_source_t *mc = src->ctx;
+    if (mc->fallback_open) {
+        ota_source_close(&mc->fallback);
+    }
+    close(mc->sock);
+    free(mc->slot_mem);
+    free(mc->packet);
+    free(mc);
+}
+
+const ota_source_ops_t ota_source_mcast = {
+    .name = "multicast",
+    .open = mcast_open,
+    .read = mcast_read,
+    .read_range = mcast_read_range,
+    .close = mcast_close,
+    .needs_manifest = true, // Anyone on the LAN can send datagrams to the group
+};
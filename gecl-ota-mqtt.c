@@ -0,0 +1,396 @@
+/*
+ * MQTT OTA Transport
+ * ==================
+ *
+ * Receives the image over the application's existing MQTT connection instead
+ * of opening a second TLS session. Topics are relative to a device-specific
+ * base, "<CONFIG_GECL_OTA_MQTT_TOPIC_PREFIX>/<mac>" unless the OTA URL names
+ * one explicitly ("mqtt:<base>"):
+ *
+ *   <base>/manifest  server -> device  Manifest JSON with the chunk map inline ("leaves")
+ *   <base>/data      server -> device  16-byte header followed by image bytes
+ *   <base>/ack       device -> server  {"next": <offset>, "window": <messages>}
+ *
+ * The data header holds, little endian: the magic "GOTA", a sequence number,
+ * the byte offset of the payload in the image and the payload length.
+ *
+ * Flow control is a sliding window: the server keeps at most `window` data
+ * messages in flight beyond the last acknowledged offset. The device acks after
+ * every half window it consumes, and re-acks the offset it expects when it sees
+ * a gap or a chunk fails verification, which rewinds the server to that offset.
+ * This makes the transport an image source with a ranged read, so received
+ * data goes through the same verify/write pipeline as HTTPS.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "sdkconfig.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_MQTT";
+
+#define OTA_MQTT_MAGIC 0x41544f47 // "GOTA"
+#define OTA_MQTT_HEADER_LEN 16
+#define OTA_MQTT_TOPIC_LEN 128
+
+typedef struct {
+    uint8_t *message; // Whole message, header included, owned by the receiver
+    uint32_t seq;
+    uint32_t offset;
+    uint32_t len;
+} mqtt_chunk_t;
+
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    char manifest_topic[OTA_MQTT_TOPIC_LEN];
+    char data_topic[OTA_MQTT_TOPIC_LEN];
+    char ack_topic[OTA_MQTT_TOPIC_LEN];
+    QueueHandle_t chunks;
+    SemaphoreHandle_t manifest_ready;
+    char *manifest_json;
+    size_t manifest_len;
+    uint8_t *assembly; // Message being reassembled from MQTT fragments
+    bool assembling_data;
+    bool subscribed;
+    ota_manifest_t manifest;
+    mqtt_chunk_t current; // Message being consumed by read()
+    size_t current_used;
+    size_t expected; // Image offset the next read() returns
+    size_t last_nack;
+    int since_ack;
+} mqtt_transport_t;
+
+// The event handler can still be running in the MQTT task after it is
+// unregistered, so it only touches the transport it was registered with while
+// that is still the active one, checked under a lock that outlives sessions.
+static SemaphoreHandle_t s_handler_lock;
+static mqtt_transport_t *s_active;
+
+static uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool topic_is(const esp_mqtt_event_t *event, const char *topic) {
+    return event->topic_len == (int)strlen(topic) && strncmp(event->topic, topic, event->topic_len) == 0;
+}
+
+/**
+ * Hands a fully reassembled message to the OTA task. Runs in the MQTT task.
+ */
+static void dispatch_message(mqtt_transport_t *mqtt, uint8_t *message, size_t len) {
+    if (!mqtt->assembling_data) {
+        if (mqtt->manifest_json == NULL) {
+            mqtt->manifest_json = (char *)message;
+            mqtt->manifest_len = len;
+            xSemaphoreGive(mqtt->manifest_ready);
+        } else {
+            free(message); // Manifest is fixed for the session
+        }
+        return;
+    }
+
+    if (len < OTA_MQTT_HEADER_LEN || read_le32(message) != OTA_MQTT_MAGIC ||
+        read_le32(&message[12]) != len - OTA_MQTT_HEADER_LEN) {
+        ESP_LOGW(TAG, "Dropping malformed data message");
+        free(message);
+        return;
+    }
+    mqtt_chunk_t chunk = {
+        .message = message,
+        .seq = read_le32(&message[4]),
+        .offset = read_le32(&message[8]),
+        .len = read_le32(&message[12]),
+    };
+    if (xQueueSend(mqtt->chunks, &chunk, 0) != pdTRUE) {
+        free(message); // Window overrun, recovered by the gap ack
+    }
+}
+
+/**
+ * Reassembles fragmented messages on the OTA topics. Runs in the MQTT task.
+ */
+static void handle_data(mqtt_transport_t *mqtt, esp_mqtt_event_handle_t event) {
+    if (event->current_data_offset == 0) {
+        free(mqtt->assembly);
+        mqtt->assembly = NULL;
+        if (topic_is(event, mqtt->data_topic)) {
+            mqtt->assembling_data = true;
+        } else if (topic_is(event, mqtt->manifest_topic)) {
+            mqtt->assembling_data = false;
+        } else {
+            return; // Not ours
+        }
+        if (event->total_data_len > CONFIG_GECL_OTA_MQTT_MAX_MESSAGE) {
+            ESP_LOGW(TAG, "Dropping %d byte message", event->total_data_len);
+            return;
+        }
+        // One spare byte keeps the manifest NUL terminated
+        mqtt->assembly = calloc(1, event->total_data_len + 1);
+    }
+    if (mqtt->assembly == NULL) {
+        return;
+    }
+
+    memcpy(mqtt->assembly + event->current_data_offset, event->data, event->data_len);
+    if (event->current_data_offset + event->data_len == event->total_data_len) {
+        uint8_t *message = mqtt->assembly;
+        mqtt->assembly = NULL;
+        dispatch_message(mqtt, message, event->total_data_len);
+    }
+}
+
+/**
+ * MQTT event handler registered on the application's client for the duration
+ * of the session.
+ */
+static void mqtt_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    xSemaphoreTake(s_handler_lock, portMAX_DELAY);
+    if (s_active == arg) {
+        handle_data(s_active, (esp_mqtt_event_handle_t)event_data);
+    }
+    xSemaphoreGive(s_handler_lock);
+}
+
+static void set_active(mqtt_transport_t *mqtt) {
+    xSemaphoreTake(s_handler_lock, portMAX_DELAY);
+    s_active = mqtt;
+    xSemaphoreGive(s_handler_lock);
+}
+
+static void send_ack(mqtt_transport_t *mqtt, size_t next) {
+    char ack[64];
+    int len = snprintf(ack, sizeof(ack), "{\"next\":%u,\"window\":%d}", (unsigned)next, CONFIG_GECL_OTA_MQTT_WINDOW);
+    esp_mqtt_client_publish(mqtt->client, mqtt->ack_topic, ack, len, 1, 0);
+}
+
+static void drop_current(mqtt_transport_t *mqtt) {
+    free(mqtt->current.message);
+    mqtt->current.message = NULL;
+}
+
+static void drain_chunks(mqtt_transport_t *mqtt) {
+    mqtt_chunk_t chunk;
+    while (xQueueReceive(mqtt->chunks, &chunk, 0) == pdTRUE) {
+        free(chunk.message);
+    }
+}
+
+/**
+ * Asks the sender to resend from offset, discarding everything in flight.
+ */
+static void rewind_to(ota_source_t *src, size_t offset) {
+    mqtt_transport_t *mqtt = src->ctx;
+    drop_current(mqtt);
+    drain_chunks(mqtt);
+    mqtt->expected = offset;
+    mqtt->last_nack = offset;
+    mqtt->since_ack = 0;
+    send_ack(mqtt, offset);
+    src->requests++;
+}
+
+static esp_err_t init_topics(mqtt_transport_t *mqtt, const char *base) {
+    char device_base[OTA_MQTT_TOPIC_LEN - 16];
+    if (base[0] == '\0') {
+        uint8_t mac[6];
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        snprintf(device_base, sizeof(device_base), "%s/%02x%02x%02x%02x%02x%02x", CONFIG_GECL_OTA_MQTT_TOPIC_PREFIX,
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        base = device_base;
+    }
+    if (strlen(base) >= OTA_MQTT_TOPIC_LEN - 16) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    snprintf(mqtt->manifest_topic, sizeof(mqtt->manifest_topic), "%s/manifest", base);
+    snprintf(mqtt->data_topic, sizeof(mqtt->data_topic), "%s/data", base);
+    snprintf(mqtt->ack_topic, sizeof(mqtt->ack_topic), "%s/ack", base);
+    return ESP_OK;
+}
+
+/**
+ * Waits for the next data message covering the expected offset. Gaps are
+ * answered with an ack for the expected offset, which rewinds the sender.
+ */
+static esp_err_t next_message(mqtt_transport_t *mqtt) {
+    int stalls = 0;
+    while (true) {
+        mqtt_chunk_t chunk;
+        if (xQueueReceive(mqtt->chunks, &chunk, pdMS_TO_TICKS(CONFIG_GECL_OTA_MQTT_TIMEOUT_S * 1000)) != pdTRUE) {
+            if (++stalls > CONFIG_GECL_OTA_CHUNK_MAX_RETRIES) {
+                ESP_LOGE(TAG, "No data received at offset %u", (unsigned)mqtt->expected);
+                return ESP_ERR_TIMEOUT;
+            }
+            send_ack(mqtt, mqtt->expected); // Lost ack or lost window, ask again
+            continue;
+        }
+
+        if (chunk.offset <= mqtt->expected && mqtt->expected < chunk.offset + chunk.len) {
+            mqtt->current = chunk;
+            mqtt->current_used = mqtt->expected - chunk.offset;
+            return ESP_OK;
+        }
+        if (chunk.offset > mqtt->expected && mqtt->last_nack != mqtt->expected) {
+            ESP_LOGW(TAG, "Gap at %u (got seq %" PRIu32 " at %" PRIu32 ")", (unsigned)mqtt->expected, chunk.seq,
+                     chunk.offset);
+            send_ack(mqtt, mqtt->expected);
+            mqtt->last_nack = mqtt->expected;
+        }
+        free(chunk.message); // Duplicate or out of order
+    }
+}
+
+static esp_err_t mqtt_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    if (ota == NULL || ota->mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT transport requested without an MQTT client");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    mqtt_transport_t *mqtt = calloc(1, sizeof(*mqtt));
+    if (mqtt == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    mqtt->client = ota->mqtt_client;
+    mqtt->last_nack = SIZE_MAX;
+    src->ctx = mqtt;
+
+    esp_err_t err = init_topics(mqtt, uri + strlen(OTA_MQTT_URL_PREFIX));
+    if (err != ESP_OK) {
+        goto fail;
+    }
+    if (s_handler_lock == NULL) {
+        s_handler_lock = xSemaphoreCreateMutex(); // Kept for the lifetime of the application
+    }
+    mqtt->chunks = xQueueCreate(CONFIG_GECL_OTA_MQTT_WINDOW, sizeof(mqtt_chunk_t));
+    mqtt->manifest_ready = xSemaphoreCreateBinary();
+    if (s_handler_lock == NULL || mqtt->chunks == NULL || mqtt->manifest_ready == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto fail;
+    }
+
+    set_active(mqtt);
+    err = esp_mqtt_client_register_event(mqtt->client, MQTT_EVENT_DATA, mqtt_event_handler, mqtt);
+    if (err != ESP_OK) {
+        goto fail;
+    }
+    mqtt->subscribed = true;
+    esp_mqtt_client_subscribe(mqtt->client, mqtt->manifest_topic, 1);
+    esp_mqtt_client_subscribe(mqtt->client, mqtt->data_topic, 1);
+    ESP_LOGI(TAG, "Waiting for manifest on %s", mqtt->manifest_topic);
+
+    if (xSemaphoreTake(mqtt->manifest_ready, pdMS_TO_TICKS(CONFIG_GECL_OTA_MQTT_TIMEOUT_S * 1000)) != pdTRUE) {
+        ESP_LOGE(TAG, "No manifest received");
+        err = ESP_ERR_TIMEOUT;
+        goto fail;
+    }
+
+    err = ota_manifest_parse(mqtt->manifest_json, mqtt->manifest_len, "", "", &mqtt->manifest);
+    if (err == ESP_OK && (mqtt->manifest.leaves == NULL || mqtt->manifest.artifact_count > 0)) {
+        ESP_LOGE(TAG, "MQTT manifest must carry the chunk map inline and no partition images");
+        err = ESP_ERR_INVALID_RESPONSE;
+    }
+    if (err == ESP_OK) {
+        err = ota_manifest_authenticate(&mqtt->manifest);
+    }
+    if (err != ESP_OK) {
+        goto fail;
+    }
+
+    src->manifest = &mqtt->manifest;
+    src->size = mqtt->manifest.image_size;
+    send_ack(mqtt, 0);
+    src->requests++;
+    return ESP_OK;
+
+fail:
+    src->ops->close(src);
+    src->ctx = NULL;
+    return err;
+}
+
+static int mqtt_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    mqtt_transport_t *mqtt = src->ctx;
+
+    if (mqtt->expected >= src->size) {
+        return 0;
+    }
+    if (mqtt->current.message == NULL && next_message(mqtt) != ESP_OK) {
+        return -1;
+    }
+
+    size_t available = mqtt->current.len - mqtt->current_used;
+    size_t n = len < available ? len : available;
+    memcpy(buf, mqtt->current.message + OTA_MQTT_HEADER_LEN + mqtt->current_used, n);
+    src->copied += n;
+    mqtt->current_used += n;
+    mqtt->expected += n;
+
+    if (mqtt->current_used == mqtt->current.len) {
+        drop_current(mqtt);
+        if (++mqtt->since_ack >= (CONFIG_GECL_OTA_MQTT_WINDOW + 1) / 2) {
+            send_ack(mqtt, mqtt->expected);
+            mqtt->since_ack = 0;
+        }
+    }
+    return (int)n;
+}
+
+/**
+ * Rewinds the sender to offset and reads len bytes. The stream then carries
+ * on from offset + len, which is where the pipeline resumes after a re-fetch.
+ */
+static esp_err_t mqtt_read_range(ota_source_t *src, size_t offset, uint8_t *buf, size_t len) {
+    mqtt_transport_t *mqtt = src->ctx;
+
+    if (offset != mqtt->expected) {
+        rewind_to(src, offset);
+    }
+    size_t total = 0;
+    while (total < len) {
+        int n = mqtt_read(src, buf + total, len - total);
+        if (n <= 0) {
+            return ESP_FAIL;
+        }
+        total += n;
+    }
+    return ESP_OK;
+}
+
+static void mqtt_close(ota_source_t *src) {
+    mqtt_transport_t *mqtt = src->ctx;
+
+    if (mqtt->subscribed) {
+        esp_mqtt_client_unsubscribe(mqtt->client, mqtt->data_topic);
+        esp_mqtt_client_unsubscribe(mqtt->client, mqtt->manifest_topic);
+        esp_mqtt_client_unregister_event(mqtt->client, MQTT_EVENT_DATA, mqtt_event_handler);
+    }
+    if (s_handler_lock != NULL) {
+        set_active(NULL); // Waits for a handler still running in the MQTT task
+    }
+    if (mqtt->chunks != NULL) {
+        drain_chunks(mqtt);
+        vQueueDelete(mqtt->chunks);
+    }
+    if (mqtt->manifest_ready != NULL) {
+        vSemaphoreDelete(mqtt->manifest_ready);
+    }
+    drop_current(mqtt);
+    ota_manifest_free(&mqtt->manifest);
+    free(mqtt->assembly);
+    free(mqtt->manifest_json);
+    free(mqtt);
+}
+
+const ota_source_ops_t ota_source_mqtt = {
+    .name = "MQTT",
+    .open = mqtt_open,
+    .read = mqtt_read,
+    .read_range = mqtt_read_range,
+    .close = mqtt_close,
+};
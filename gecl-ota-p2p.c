@@ -0,0 +1,319 @@
+/*
+ * LAN Peer-to-Peer Distribution
+ * =============================
+ *
+ * Lets one device per LAN download an image from the origin and serve it to
+ * its peers, so the uplink carries the image once per site instead of once
+ * per device.
+ *
+ * Devices that want the same image (identified by the manifest digest)
+ * announce themselves on a UDP broadcast port during an election window. The
+ * device with the lowest MAC address becomes the leader, downloads and
+ * verifies the image from the origin, then serves it from its update partition
+ * over a small HTTP endpoint with Range support. The other devices download
+ * from the leader through the regular HTTP source and verify every chunk
+ * against the manifest they fetched from the origin, so a faulty leader can
+ * only cost time. Peers fall back to the origin if no leader shows up.
+ *
+ * Announcements are single datagrams:
+ *
+ *   GOTA-P2P WANT <image id> <mac>          looking for the image, candidate leader
+ *   GOTA-P2P LEAD <image id> <mac>          elected, downloading from the origin
+ *   GOTA-P2P HAVE <image id> <mac> <port>   serving http://<sender>:<port>/ota/<image id>.bin
+ *
+ * The image id is the first 8 bytes of the manifest SHA-256 in hex.
+ */
+
+#include "gecl-ota-internal.h"
+#include "sdkconfig.h"
+
+#if CONFIG_GECL_OTA_P2P_ENABLED
+
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_P2P";
+
+#define P2P_MAGIC "GOTA-P2P"
+#define P2P_ID_LEN 16
+#define P2P_MAC_LEN 12
+#define P2P_ANNOUNCE_INTERVAL_US (500 * 1000)
+#define P2P_SERVE_BUFFER_SIZE 4096
+
+typedef struct {
+    int sock;
+    esp_timer_handle_t announcer;
+    char announcement[80]; // Message the announcer broadcasts, empty when silent
+    char image_id[P2P_ID_LEN + 1];
+    char mac[P2P_MAC_LEN + 1];
+    const esp_partition_t *partition; // Served image
+    size_t image_size;
+} p2p_state_t;
+
+static p2p_state_t p2p = {.sock = -1};
+
+static void broadcast(const char *message) {
+    struct sockaddr_in dest = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_GECL_OTA_P2P_DISCOVERY_PORT),
+        .sin_addr.s_addr = htonl(INADDR_BROADCAST),
+    };
+    sendto(p2p.sock, message, strlen(message), 0, (struct sockaddr *)&dest, sizeof(dest));
+}
+
+static void announce_cb(void *arg) {
+    if (p2p.announcement[0] != '\0') {
+        broadcast(p2p.announcement);
+    }
+}
+
+static void set_announcement(const char *type) {
+    if (strcmp(type, "HAVE") == 0) {
+        snprintf(p2p.announcement, sizeof(p2p.announcement), "%s HAVE %s %s %d", P2P_MAGIC, p2p.image_id, p2p.mac,
+                 CONFIG_GECL_OTA_P2P_HTTP_PORT);
+    } else {
+        snprintf(p2p.announcement, sizeof(p2p.announcement), "%s %s %s %s", P2P_MAGIC, type, p2p.image_id, p2p.mac);
+    }
+}
+
+static esp_err_t open_socket(const ota_manifest_t *manifest) {
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(p2p.mac, sizeof(p2p.mac), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    for (int i = 0; i < P2P_ID_LEN / 2; i++) {
+        snprintf(&p2p.image_id[i * 2], 3, "%02x", manifest->image_sha256[i]);
+    }
+    p2p.image_size = manifest->image_size;
+
+    p2p.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (p2p.sock < 0) {
+        return ESP_FAIL;
+    }
+    int enable = 1;
+    setsockopt(p2p.sock, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+    setsockopt(p2p.sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = 100 * 1000};
+    setsockopt(p2p.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_GECL_OTA_P2P_DISCOVERY_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(p2p.sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Failed to bind discovery port %d", CONFIG_GECL_OTA_P2P_DISCOVERY_PORT);
+        ota_p2p_stop();
+        return ESP_FAIL;
+    }
+
+    esp_timer_create_args_t timer_args = {.callback = announce_cb, .name = "ota_p2p"};
+    if (esp_timer_create(&timer_args, &p2p.announcer) != ESP_OK) {
+        ota_p2p_stop();
+        return ESP_ERR_NO_MEM;
+    }
+    esp_timer_start_periodic(p2p.announcer, P2P_ANNOUNCE_INTERVAL_US);
+    return ESP_OK;
+}
+
+/**
+ * Receives one announcement for our image. Returns false on timeout or for
+ * announcements about other images.
+ */
+static bool receive_announcement(char *type, char *mac, int *port, struct sockaddr_in *from) {
+    char message[96];
+    socklen_t from_len = sizeof(*from);
+    int n = recvfrom(p2p.sock, message, sizeof(message) - 1, 0, (struct sockaddr *)from, &from_len);
+    if (n <= 0) {
+        return false;
+    }
+    message[n] = '\0';
+
+    char magic[12], id[P2P_ID_LEN + 1];
+    *port = 0;
+    if (sscanf(message, "%11s %4s %16s %12s %d", magic, type, id, mac, port) < 4 || strcmp(magic, P2P_MAGIC) != 0 ||
+        strcmp(id, p2p.image_id) != 0 || strcmp(mac, p2p.mac) == 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Takes part in the leader election for the manifest's image.
+ *
+ * Returns OTA_P2P_LEADER when this device must download from the origin and
+ * serve afterwards, OTA_P2P_PEER with the leader's image URL in peer_url, or
+ * OTA_P2P_ORIGIN when no leader could be found and the device should download
+ * from the origin on its own.
+ */
+ota_p2p_role_t ota_p2p_elect(const ota_manifest_t *manifest, char *peer_url, size_t peer_url_len) {
+    if (open_socket(manifest) != ESP_OK) {
+        return OTA_P2P_ORIGIN;
+    }
+
+    char lowest[P2P_MAC_LEN + 1];
+    strcpy(lowest, p2p.mac);
+    bool leader_seen = false;
+    set_announcement("WANT");
+    ESP_LOGI(TAG, "Electing a leader for image %s", p2p.image_id);
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)CONFIG_GECL_OTA_P2P_ELECTION_MS * 1000;
+    while (esp_timer_get_time() < deadline && !leader_seen) {
+        char type[5], mac[P2P_MAC_LEN + 1];
+        int port;
+        struct sockaddr_in from;
+        if (!receive_announcement(type, mac, &port, &from)) {
+            continue;
+        }
+        if (strcmp(type, "LEAD") == 0 || strcmp(type, "HAVE") == 0) {
+            leader_seen = true; // Joined late, an elected leader already exists
+        } else if (strcmp(type, "WANT") == 0 && strcmp(mac, lowest) < 0) {
+            strcpy(lowest, mac);
+        }
+    }
+
+    if (!leader_seen && strcmp(lowest, p2p.mac) == 0) {
+        ESP_LOGI(TAG, "Elected as leader, downloading from origin");
+        set_announcement("LEAD");
+        return OTA_P2P_LEADER;
+    }
+
+    p2p.announcement[0] = '\0'; // Peers stay silent while waiting
+    deadline = esp_timer_get_time() + (int64_t)CONFIG_GECL_OTA_P2P_WAIT_S * 1000 * 1000;
+    while (esp_timer_get_time() < deadline) {
+        char type[5], mac[P2P_MAC_LEN + 1];
+        int port;
+        struct sockaddr_in from;
+        if (receive_announcement(type, mac, &port, &from) && strcmp(type, "HAVE") == 0 && port > 0) {
+            char addr[16];
+            inet_ntop(AF_INET, &from.sin_addr, addr, sizeof(addr));
+            snprintf(peer_url, peer_url_len, "http://%s:%d/ota/%s.bin", addr, port, p2p.image_id);
+            ESP_LOGI(TAG, "Downloading from leader %s at %s", mac, peer_url);
+            ota_p2p_stop();
+            return OTA_P2P_PEER;
+        }
+    }
+
+    ESP_LOGW(TAG, "No leader served the image, falling back to origin");
+    ota_p2p_stop();
+    return OTA_P2P_ORIGIN;
+}
+
+static esp_err_t send_all(httpd_req_t *req, const char *data, size_t len) {
+    while (len > 0) {
+        int n = httpd_send(req, data, len);
+        if (n < 0) {
+            return ESP_FAIL;
+        }
+        data += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Serves the image, or the requested byte range of it, from the partition it
+ * was written to. The response is written raw with a Content-Length, which
+ * httpd_resp_send_chunk() cannot do, so peers can use the direct HTTP source.
+ */
+static esp_err_t image_get_handler(httpd_req_t *req) {
+    size_t from = 0;
+    size_t to = p2p.image_size - 1;
+    char range[48];
+    char content_range[80] = "";
+
+    if (httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) == ESP_OK) {
+        unsigned first = 0, last = 0;
+        int fields = sscanf(range, "bytes=%u-%u", &first, &last);
+        if (fields < 1 || first >= p2p.image_size) {
+            httpd_resp_set_status(req, "416 Range Not Satisfiable");
+            return httpd_resp_send(req, NULL, 0);
+        }
+        from = first;
+        if (fields == 2 && last < to) {
+            to = last;
+        }
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes %u-%u/%u\r\n", (unsigned)from,
+                 (unsigned)to, (unsigned)p2p.image_size);
+    }
+
+    char *buf = malloc(P2P_SERVE_BUFFER_SIZE);
+    if (buf == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+    int len = snprintf(buf, P2P_SERVE_BUFFER_SIZE,
+                       "HTTP/1.1 %s\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\n%s\r\n",
+                       content_range[0] != '\0' ? "206 Partial Content" : "200 OK", (unsigned)(to - from + 1),
+                       content_range);
+    esp_err_t err = send_all(req, buf, len);
+    for (size_t offset = from; offset <= to && err == ESP_OK;) {
+        size_t n = to - offset + 1 < P2P_SERVE_BUFFER_SIZE ? to - offset + 1 : P2P_SERVE_BUFFER_SIZE;
+        err = esp_partition_read(p2p.partition, offset, buf, n);
+        if (err == ESP_OK) {
+            err = send_all(req, buf, n);
+        }
+        offset += n;
+    }
+    free(buf);
+    return err;
+}
+
+/**
+ * Serves the verified image from the new boot partition to peers for the
+ * configured serving window, then stops all peer-to-peer activity.
+ */
+void ota_p2p_serve(void) {
+    p2p.partition = esp_ota_get_boot_partition();
+
+    char uri[32];
+    snprintf(uri, sizeof(uri), "/ota/%s.bin", p2p.image_id);
+    httpd_uri_t image_uri = {
+        .uri = uri,
+        .method = HTTP_GET,
+        .handler = image_get_handler,
+    };
+
+    httpd_handle_t server = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = CONFIG_GECL_OTA_P2P_HTTP_PORT;
+    config.ctrl_port = CONFIG_GECL_OTA_P2P_HTTP_PORT + 1;
+    if (httpd_start(&server, &config) != ESP_OK || httpd_register_uri_handler(server, &image_uri) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start image server");
+        if (server != NULL) {
+            httpd_stop(server);
+        }
+        ota_p2p_stop();
+        return;
+    }
+
+    set_announcement("HAVE");
+    ESP_LOGI(TAG, "Serving %s on port %d for %d s", uri, CONFIG_GECL_OTA_P2P_HTTP_PORT, CONFIG_GECL_OTA_P2P_SERVE_S);
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_GECL_OTA_P2P_SERVE_S * 1000));
+
+    p2p.announcement[0] = '\0';
+    httpd_stop(server);
+    ota_p2p_stop();
+}
+
+/**
+ * Stops announcements and closes the discovery socket.
+ */
+void ota_p2p_stop(void) {
+    if (p2p.announcer != NULL) {
+        esp_timer_stop(p2p.announcer);
+        esp_timer_delete(p2p.announcer);
+        p2p.announcer = NULL;
+    }
+    if (p2p.sock >= 0) {
+        close(p2p.sock);
+        p2p.sock = -1;
+    }
+    p2p.announcement[0] = '\0';
+}
+
+#endif // CONFIG_GECL_OTA_P2P_ENABLED
@@ -0,0 +1,757 @@
+/*
+ * OTA Verify/Write Pipeline
+ * =========================
+ *
+ * Assembles incoming data into manifest chunks, verifies every chunk against
+ * its Merkle leaf before it reaches flash, and writes verified chunks to the
+ * passive OTA partition, or to a data partition for images updated alongside
+ * the app. Data is pulled from an image source (see
+ * gecl-ota-source.c); a chunk that fails verification is re-fetched through the
+ * source's ranged read instead of restarting the whole update.
+ *
+ * Sources receive straight into the pipeline's landing buffer. A plain image
+ * lands at its final place, behind the staged part of the flash sector it
+ * continues, or in the target buffer; chunks are verified and complete sectors
+ * written from there, so the pipeline copies no data unless a chunk ends
+ * inside a sector and the chunk size does not divide the sector size. The
+ * bytes copied and the buffers held are reported in the metrics.
+ *
+ * Pre-encrypted app images are decrypted between verification and the write
+ * (see gecl-ota-decrypt.c); the decryption time is counted separately in the
+ * metrics so it can be compared with the download and flash time.
+ *
+ * Optionally the written image is read back through the flash cache and hashed
+ * again before the boot partition is switched, catching flash write faults that
+ * the streaming hash of the received bytes cannot see.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_PIPELINE";
+
+// Chunk size used when no manifest describes the image
+#define OTA_UNVERIFIED_CHUNK_SIZE 4096
+
+static ota_pacing_t pacing = {
+    .delay_ms = CONFIG_GECL_OTA_PACING_DELAY_MS,
+    .max_stall_us = CONFIG_GECL_OTA_MAX_STALL_US,
+};
+
+#if CONFIG_GECL_OTA_METRICS
+// Metrics of the most recently finished or aborted session
+static ota_metrics_t last_metrics;
+static bool last_metrics_valid = false;
+
+static void record_metrics(ota_pipeline_t *pipe) {
+    pipe->metrics.duration_us = esp_timer_get_time() - pipe->metrics.start_us;
+    last_metrics = pipe->metrics;
+    last_metrics_valid = true;
+}
+
+static void sample_heap(ota_pipeline_t *pipe) {
+    size_t free_heap = esp_get_free_heap_size();
+    if (free_heap < pipe->metrics.heap_min_free) {
+        pipe->metrics.heap_min_free = free_heap;
+    }
+}
+#else
+static void record_metrics(ota_pipeline_t *pipe) {}
+static void sample_heap(ota_pipeline_t *pipe) {}
+#endif
+
+#if CONFIG_GECL_OTA_CYCLE_PROFILE
+static void cycles_begin(ota_pipeline_t *pipe) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    pipe->cpu_start = ulTaskGetRunTimeCounter(NULL);
+#endif
+}
+
+/**
+ * Logs the CPU cycles each section of the download loop spent per KB of
+ * image. Reads block on the network, so their CPU time cannot be taken from
+ * the cycle counter; with FREERTOS_GENERATE_RUN_TIME_STATS it is reported
+ * together with the rest of the loop, as the run time of the task since begin
+ * less the counted sections.
+ */
+static void log_cycles(const ota_pipeline_t *pipe) {
+    uint64_t kb = pipe->written / 1024;
+    if (kb == 0) {
+        return;
+    }
+    ESP_LOGI(TAG,
+             "Cycles per KB: hash %" PRIu64 ", decrypt %" PRIu64 ", flash %" PRIu64 " over %" PRIu64
+             " KB, %" PRIu32 " samples dropped",
+             pipe->cycles[OTA_CYCLES_HASH] / kb, pipe->cycles[OTA_CYCLES_DECRYPT] / kb,
+             pipe->cycles[OTA_CYCLES_FLASH] / kb, kb, pipe->cycles_dropped);
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    uint64_t task = (configRUN_TIME_COUNTER_TYPE)(ulTaskGetRunTimeCounter(NULL) - pipe->cpu_start);
+#if !CONFIG_FREERTOS_RUN_TIME_STATS_USING_CPU_CLK
+    task *= esp_rom_get_cpu_ticks_per_us(); // The counter runs in microseconds of esp_timer
+#endif
+    uint64_t counted = 0;
+    for (int i = 0; i < OTA_CYCLES_STAGES; i++) {
+        counted += pipe->cycles[i];
+    }
+    ESP_LOGI(TAG, "Cycles per KB: reads and the rest of the loop %" PRIu64,
+             task > counted ? (task - counted) / kb : 0);
+#endif
+}
+#else
+static void cycles_begin(ota_pipeline_t *pipe) {}
+static void log_cycles(const ota_pipeline_t *pipe) {}
+#endif
+
+/**
+ * Overrides the Kconfig pacing for the sessions started afterwards. NULL
+ * restores the Kconfig defaults.
+ */
+void ota_set_pacing(const ota_pacing_t *new_pacing) {
+    if (new_pacing != NULL) {
+        pacing = *new_pacing;
+    } else {
+        pacing.delay_ms = CONFIG_GECL_OTA_PACING_DELAY_MS;
+        pacing.max_stall_us = CONFIG_GECL_OTA_MAX_STALL_US;
+    }
+}
+
+/**
+ * Returns the pacing sessions started now run with.
+ */
+void ota_pipeline_get_pacing(ota_pacing_t *out_pacing) {
+    *out_pacing = pacing;
+}
+
+/**
+ * Returns the metrics of the last OTA session, managed or push-style.
+ */
+esp_err_t ota_get_last_metrics(ota_metrics_t *out_metrics) {
+#if CONFIG_GECL_OTA_METRICS
+    if (!last_metrics_valid) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *out_metrics = last_metrics;
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static size_t current_chunk_len(const ota_pipeline_t *pipe) {
+    if (pipe->manifest == NULL) {
+        return OTA_UNVERIFIED_CHUNK_SIZE;
+    }
+    return ota_manifest_chunk_len(pipe->manifest, pipe->chunk_index);
+}
+
+/**
+ * Size of the landing buffer of a plain flash target: a chunk behind the
+ * partly received sector it continues. Chunks of whole sectors, or dividing a
+ * sector, always fit the rounded-up chunk size.
+ */
+static size_t landing_len(size_t chunk_size) {
+    size_t len = (chunk_size + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+    if (chunk_size % OTA_SECTOR_SIZE != 0 && OTA_SECTOR_SIZE % chunk_size != 0) {
+        len += OTA_SECTOR_SIZE;
+    }
+    return len;
+}
+
+/**
+ * Buffer holding the partly received flash sector, starting at its first byte.
+ */
+static uint8_t *sector_stage(const ota_pipeline_t *pipe) {
+    return pipe->sector_buf != NULL ? pipe->sector_buf : pipe->chunk_buf;
+}
+
+/**
+ * Where the current chunk is assembled.
+ */
+static uint8_t *chunk_start(const ota_pipeline_t *pipe) {
+    if (pipe->decrypt != NULL) {
+        return pipe->chunk_buf;
+    }
+    if (pipe->target == OTA_TARGET_BUFFER) {
+        return pipe->buffer + pipe->stored;
+    }
+    return pipe->chunk_buf + pipe->stored % OTA_SECTOR_SIZE;
+}
+
+/**
+ * Writes image data to the pipeline's target. Flash writes are coalesced into
+ * whole, aligned sectors whatever the slicing of the incoming data, so every
+ * sector is erased once and programmed once. This also spares flash
+ * encryption the read-modify-write of unaligned writes. Data that landed
+ * behind the partly received sector is written in place; otherwise runs of
+ * whole sectors are written straight from data and only the data of a partly
+ * received sector is staged.
+ */
+static esp_err_t store(ota_pipeline_t *pipe, const uint8_t *data, size_t len) {
+    if (pipe->target == OTA_TARGET_BUFFER) {
+        if (data != pipe->buffer + pipe->stored) {
+            memcpy(pipe->buffer + pipe->stored, data, len);
+            pipe->metrics.bytes_copied += len;
+        }
+        pipe->stored += len;
+        pipe->metrics.bytes_written += len;
+        return ESP_OK;
+    }
+
+    uint8_t *stage = sector_stage(pipe);
+    size_t fill = pipe->stored % OTA_SECTOR_SIZE;
+    if (data == stage + fill) {
+        size_t whole = (fill + len) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+        for (size_t done = 0; done < whole; done += OTA_SECTOR_SIZE) {
+            esp_err_t err = ota_flash_write_sector(pipe, pipe->stored - fill + done, stage + done, OTA_SECTOR_SIZE);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        pipe->stored += len;
+        if (whole > 0 && fill + len > whole) {
+            memmove(stage, stage + whole, fill + len - whole); // The new partly received sector to the front
+            pipe->metrics.bytes_copied += fill + len - whole;
+        }
+        return ESP_OK;
+    }
+
+    while (len > 0) {
+        fill = pipe->stored % OTA_SECTOR_SIZE;
+        size_t used;
+        esp_err_t err = ESP_OK;
+        if (fill == 0 && len >= OTA_SECTOR_SIZE) {
+            used = OTA_SECTOR_SIZE;
+            err = ota_flash_write_sector(pipe, pipe->stored, data, used);
+        } else {
+            used = len < OTA_SECTOR_SIZE - fill ? len : OTA_SECTOR_SIZE - fill;
+            memcpy(stage + fill, data, used);
+            pipe->metrics.bytes_copied += used;
+            if (fill + used == OTA_SECTOR_SIZE) {
+                err = ota_flash_write_sector(pipe, pipe->stored - fill, stage, OTA_SECTOR_SIZE);
+            }
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        pipe->stored += used;
+        data += used;
+        len -= used;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Writes the staged part of the last sector.
+ */
+static esp_err_t flush_sector(ota_pipeline_t *pipe) {
+    size_t fill = pipe->stored % OTA_SECTOR_SIZE;
+    if (pipe->target == OTA_TARGET_BUFFER || fill == 0) {
+        return ESP_OK;
+    }
+    return ota_flash_write_sector(pipe, pipe->stored - fill, sector_stage(pipe), fill);
+}
+
+/**
+ * Releases the staging buffers and the decryption stage.
+ */
+static void free_buffers(ota_pipeline_t *pipe) {
+    free(pipe->chunk_buf);
+    pipe->chunk_buf = NULL;
+    free(pipe->sector_buf);
+    pipe->sector_buf = NULL;
+    ota_decrypt_free(pipe->decrypt);
+    pipe->decrypt = NULL;
+    free(pipe->plain_buf);
+    pipe->plain_buf = NULL;
+}
+
+/**
+ * Verifies a complete chunk and writes it to flash.
+ */
+static esp_err_t commit_chunk(ota_pipeline_t *pipe, const uint8_t *data, size_t len) {
+    int64_t trace_us = ota_trace_now();
+    if (pipe->manifest != NULL) {
+        ota_cycles_t cycles = ota_cycles_now();
+        bool ok = ota_manifest_chunk_ok(pipe->manifest, pipe->chunk_index, data, len);
+        ota_cycles_add(pipe, OTA_CYCLES_HASH, cycles);
+        ota_trace_event(OTA_TRACE_HASH, trace_us, (int32_t)pipe->chunk_index);
+        if (!ok) {
+            pipe->metrics.chunks_failed++;
+            ESP_LOGW(TAG, "Chunk %" PRIu32 " failed verification", pipe->chunk_index);
+            ota_trace_event(OTA_TRACE_ERROR, 0, ESP_ERR_INVALID_CRC);
+            return ESP_ERR_INVALID_CRC;
+        }
+        pipe->metrics.chunks_verified++;
+    }
+
+    const uint8_t *out = data;
+    size_t out_len = len;
+    esp_err_t err = ESP_OK;
+    if (pipe->decrypt != NULL) {
+        int64_t start_us = esp_timer_get_time();
+        ota_cycles_t cycles = ota_cycles_now();
+        err = ota_decrypt_update(pipe->decrypt, data, len, pipe->plain_buf, &out_len);
+        ota_cycles_add(pipe, OTA_CYCLES_DECRYPT, cycles);
+        pipe->metrics.decrypt_us += esp_timer_get_time() - start_us;
+        ota_trace_event(OTA_TRACE_DECRYPT, start_us, (int32_t)pipe->chunk_index);
+        out = pipe->plain_buf;
+    }
+    if (err == ESP_OK && out_len > 0) {
+        err = store(pipe, out, out_len);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    ota_cycles_t cycles = ota_cycles_now();
+    mbedtls_sha256_update(&pipe->image_ctx, data, len);
+    ota_cycles_add(pipe, OTA_CYCLES_HASH, cycles);
+    pipe->written += len;
+    ota_trace_event(OTA_TRACE_CHUNK, trace_us, (int32_t)pipe->chunk_index++);
+
+    sample_heap(pipe);
+    vTaskDelay(pdMS_TO_TICKS(pipe->pacing.delay_ms)); // Allow other tasks to run
+    return ESP_OK;
+}
+
+esp_err_t ota_pipeline_begin(ota_pipeline_t *pipe, const ota_manifest_t *manifest) {
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->manifest = manifest;
+    pipe->pacing = pacing;
+    pipe->metrics.start_us = esp_timer_get_time();
+    cycles_begin(pipe);
+    ota_trace_event(OTA_TRACE_IMAGE, 0, manifest != NULL ? (int32_t)manifest->image_size : 0);
+
+    pipe->partition = esp_ota_get_next_update_partition(NULL);
+    if (pipe->partition == NULL) {
+        ESP_LOGE(TAG, "No OTA update partition available");
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (manifest != NULL && manifest->image_size > pipe->partition->size) {
+        ESP_LOGE(TAG, "Image of %u bytes does not fit partition %s", (unsigned)manifest->image_size,
+                 pipe->partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    size_t chunk_size = manifest != NULL ? manifest->chunk_size : OTA_UNVERIFIED_CHUNK_SIZE;
+    esp_err_t err = ESP_OK;
+#if CONFIG_GECL_OTA_PRE_ENCRYPTED
+    // Ciphertext offsets are not flash offsets: assemble chunks apart and stage the plaintext
+    pipe->chunk_buf = malloc(chunk_size);
+    pipe->sector_buf = malloc(OTA_SECTOR_SIZE);
+    pipe->plain_buf = malloc(chunk_size);
+    pipe->metrics.buffer_bytes = 2 * chunk_size + OTA_SECTOR_SIZE;
+    if (pipe->chunk_buf == NULL || pipe->sector_buf == NULL || pipe->plain_buf == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else {
+        err = ota_decrypt_begin(&pipe->decrypt);
+    }
+#else
+    pipe->metrics.buffer_bytes = landing_len(chunk_size);
+    pipe->chunk_buf = malloc(pipe->metrics.buffer_bytes);
+    err = pipe->chunk_buf != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+#endif
+    if (err == ESP_OK) {
+        // Sequential writes: esp_ota_write() erases each sector as it is reached, instead of the whole image up front
+        err = esp_ota_begin(pipe->partition, OTA_WITH_SEQUENTIAL_WRITES, &pipe->ota_handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        }
+    }
+    if (err != ESP_OK) {
+        free_buffers(pipe);
+        return err;
+    }
+
+    mbedtls_sha256_init(&pipe->image_ctx);
+    mbedtls_sha256_starts(&pipe->image_ctx, 0);
+    pipe->metrics.heap_min_free = esp_get_free_heap_size();
+    pipe->open = true;
+    ESP_LOGI(TAG, "Writing to partition %s at 0x%" PRIx32, pipe->partition->label, pipe->partition->address);
+    return ESP_OK;
+}
+
+/**
+ * Starts a pipeline for a manifest-described image outside the app partition.
+ */
+static esp_err_t begin_verified(ota_pipeline_t *pipe, const ota_manifest_t *manifest, ota_target_t target) {
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->manifest = manifest;
+    pipe->pacing = pacing;
+    pipe->target = target;
+    pipe->metrics.start_us = esp_timer_get_time();
+    cycles_begin(pipe);
+    ota_trace_event(OTA_TRACE_IMAGE, 0, (int32_t)manifest->image_size);
+    if (target != OTA_TARGET_BUFFER) {
+        pipe->metrics.buffer_bytes = landing_len(manifest->chunk_size);
+        pipe->chunk_buf = malloc(pipe->metrics.buffer_bytes);
+        if (pipe->chunk_buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    mbedtls_sha256_init(&pipe->image_ctx);
+    mbedtls_sha256_starts(&pipe->image_ctx, 0);
+    pipe->metrics.heap_min_free = esp_get_free_heap_size();
+    pipe->open = true;
+    return ESP_OK;
+}
+
+/**
+ * Starts writing a manifest-described image to a data partition. The
+ * partition is overwritten in place, sector by sector.
+ */
+esp_err_t ota_pipeline_begin_partition(ota_pipeline_t *pipe, const ota_manifest_t *manifest,
+                                       const esp_partition_t *partition) {
+    if (manifest->image_size > partition->size) {
+        ESP_LOGE(TAG, "Image of %u bytes does not fit partition %s", (unsigned)manifest->image_size,
+                 partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = begin_verified(pipe, manifest, OTA_TARGET_PARTITION);
+    if (err == ESP_OK) {
+        pipe->partition = partition;
+        ESP_LOGI(TAG, "Writing to data partition %s at 0x%" PRIx32, partition->label, partition->address);
+    }
+    return err;
+}
+
+/**
+ * Starts receiving a manifest-described image into a caller-owned buffer of
+ * at least manifest->image_size bytes. The image lands in the buffer directly.
+ */
+esp_err_t ota_pipeline_begin_buffer(ota_pipeline_t *pipe, const ota_manifest_t *manifest, uint8_t *buffer) {
+    esp_err_t err = begin_verified(pipe, manifest, OTA_TARGET_BUFFER);
+    if (err == ESP_OK) {
+        pipe->buffer = buffer;
+    }
+    return err;
+}
+
+/**
+ * Feeds received data into the pipeline.
+ *
+ * Returns ESP_ERR_INVALID_CRC when a chunk fails verification. The partial
+ * chunk is dropped and feeding must restart at ota_pipeline_resume_offset().
+ */
+esp_err_t ota_pipeline_feed(ota_pipeline_t *pipe, const uint8_t *data, size_t len) {
+    pipe->metrics.bytes_received += len;
+    ota_trace_event(OTA_TRACE_RECV, 0, (int32_t)len);
+
+    while (len > 0) {
+        size_t want;
+        uint8_t *dst = ota_pipeline_recv_buf(pipe, &want);
+        if (want == 0) {
+            ESP_LOGE(TAG, "Received data beyond the end of the image");
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        esp_err_t err = ESP_OK;
+        size_t used;
+        if (pipe->chunk_fill == 0 && len >= want) {
+            // Whole chunk available in the caller's buffer, verify it in place
+            used = want;
+            err = commit_chunk(pipe, data, used);
+        } else {
+            used = len < want ? len : want;
+            memcpy(dst, data, used);
+            pipe->metrics.bytes_copied += used;
+            pipe->chunk_fill += used;
+            if (used == want) {
+                err = commit_chunk(pipe, chunk_start(pipe), pipe->chunk_fill);
+                pipe->chunk_fill = 0;
+            }
+        }
+        if (err != ESP_OK) {
+            pipe->chunk_fill = 0;
+            return err;
+        }
+        data += used;
+        len -= used;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Returns where the next received bytes belong and sets *room to how many fit
+ * there, the rest of the current chunk. Sources read into it directly and
+ * report the bytes with ota_pipeline_received().
+ */
+uint8_t *ota_pipeline_recv_buf(ota_pipeline_t *pipe, size_t *room) {
+    *room = current_chunk_len(pipe) - pipe->chunk_fill;
+    return chunk_start(pipe) + pipe->chunk_fill;
+}
+
+/**
+ * Accounts len bytes placed at ota_pipeline_recv_buf() and commits the chunk
+ * once it is complete. Errors are those of ota_pipeline_feed().
+ */
+esp_err_t ota_pipeline_received(ota_pipeline_t *pipe, size_t len) {
+    pipe->metrics.bytes_received += len;
+    pipe->chunk_fill += len;
+    if (pipe->chunk_fill < current_chunk_len(pipe)) {
+        return ESP_OK;
+    }
+    esp_err_t err = commit_chunk(pipe, chunk_start(pipe), pipe->chunk_fill);
+    pipe->chunk_fill = 0;
+    return err;
+}
+
+/**
+ * Offset from which data must be fed after a rejected chunk.
+ */
+size_t ota_pipeline_resume_offset(const ota_pipeline_t *pipe) { return pipe->written; }
+
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+/**
+ * Hashes the written image through memory-mapped flash and compares it with
+ * the manifest digest. The partition is mapped one window at a time so only a
+ * few MMU pages are used, and the task yields between windows.
+ */
+static esp_err_t readback_verify(ota_pipeline_t *pipe, const uint8_t expected[OTA_SHA256_LEN]) {
+    const size_t window = CONFIG_GECL_OTA_READBACK_WINDOW_KB * 1024;
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+
+    for (size_t offset = 0; offset < pipe->stored; offset += window) {
+        size_t len = pipe->stored - offset < window ? pipe->stored - offset : window;
+        const void *mapped = NULL;
+        esp_partition_mmap_handle_t handle;
+        err = esp_partition_mmap(pipe->partition, offset, len, ESP_PARTITION_MMAP_DATA, &mapped, &handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to map 0x%x bytes at 0x%x: %s", (unsigned)len, (unsigned)offset,
+                     esp_err_to_name(err));
+            break;
+        }
+        mbedtls_sha256_update(&ctx, mapped, len);
+        esp_partition_munmap(handle);
+        taskYIELD();
+    }
+
+    uint8_t digest[OTA_SHA256_LEN];
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+    pipe->metrics.readback_us = esp_timer_get_time() - start_us;
+
+    if (err == ESP_OK && memcmp(digest, expected, OTA_SHA256_LEN) != 0) {
+        ESP_LOGE(TAG, "Readback digest of partition %s does not match the manifest", pipe->partition->label);
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Readback verified %u bytes in %" PRIi64 " ms", (unsigned)pipe->stored,
+                 pipe->metrics.readback_us / 1000);
+    }
+    return err;
+}
+#endif
+
+/**
+ * Flushes any trailing data, checks the whole-image digest and, for app images
+ * without defer_boot, switches the boot partition to the new image.
+ */
+esp_err_t ota_pipeline_finish(ota_pipeline_t *pipe) {
+    esp_err_t err = ESP_OK;
+    uint8_t stored_sha256[OTA_SHA256_LEN]; // Expected digest of the target contents
+
+    if (pipe->manifest == NULL && pipe->chunk_fill > 0) {
+        err = commit_chunk(pipe, chunk_start(pipe), pipe->chunk_fill);
+        pipe->chunk_fill = 0;
+    }
+    if (err == ESP_OK && pipe->manifest != NULL) {
+        uint8_t digest[OTA_SHA256_LEN];
+        mbedtls_sha256_finish(&pipe->image_ctx, digest);
+        if (pipe->written != pipe->manifest->image_size) {
+            ESP_LOGE(TAG, "Wrote %u of %u bytes", (unsigned)pipe->written, (unsigned)pipe->manifest->image_size);
+            err = ESP_ERR_INVALID_SIZE;
+        } else if (memcmp(digest, pipe->manifest->image_sha256, OTA_SHA256_LEN) != 0) {
+            ESP_LOGE(TAG, "Image digest does not match the manifest");
+            err = ESP_ERR_INVALID_CRC;
+        }
+        memcpy(stored_sha256, digest, OTA_SHA256_LEN);
+    }
+    if (err == ESP_OK && pipe->decrypt != NULL) {
+        err = ota_decrypt_finish(pipe->decrypt, stored_sha256);
+    }
+    if (err == ESP_OK) {
+        err = flush_sector(pipe);
+    }
+    if (err != ESP_OK) {
+        ota_pipeline_abort(pipe);
+        return err;
+    }
+
+    mbedtls_sha256_free(&pipe->image_ctx);
+    free_buffers(pipe);
+    pipe->open = false;
+
+    if (pipe->target == OTA_TARGET_APP) {
+        err = esp_ota_end(pipe->ota_handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(err));
+            return err;
+        }
+    }
+#if CONFIG_GECL_OTA_READBACK_VERIFY
+    if (pipe->manifest != NULL && pipe->target != OTA_TARGET_BUFFER) {
+        err = readback_verify(pipe, stored_sha256);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+#endif
+    if (pipe->target == OTA_TARGET_APP && !pipe->defer_boot) {
+        err = esp_ota_set_boot_partition(pipe->partition);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(err));
+            return err;
+        }
+    }
+
+    record_metrics(pipe);
+    log_cycles(pipe);
+#if CONFIG_GECL_OTA_METRICS
+    int64_t elapsed_ms = pipe->metrics.duration_us / 1000;
+    ESP_LOGI(TAG,
+             "Image written: %u bytes in %" PRIi64 " ms, %u received, %" PRIu32 " chunks verified, %" PRIu32
+             " rejected, %" PRIu32 " requests, %" PRIi64 " ms decrypting",
+             (unsigned)pipe->metrics.bytes_written, elapsed_ms, (unsigned)pipe->metrics.bytes_received,
+             pipe->metrics.chunks_verified, pipe->metrics.chunks_failed, pipe->metrics.requests,
+             pipe->metrics.decrypt_us / 1000);
+    if (pipe->target != OTA_TARGET_BUFFER && pipe->metrics.bytes_written > 0) {
+        uint64_t bytes = pipe->metrics.bytes_written;
+        ESP_LOGI(TAG,
+                 "Flash: %" PRIu32 " sector erases, %" PRIu32 " programs, %" PRIu64 " and %" PRIu64
+                 " per MB, longest stall %" PRIi64 " us, %" PRIi64 " ms deferred",
+                 pipe->metrics.sector_erases, pipe->metrics.sector_programs,
+                 ((uint64_t)pipe->metrics.sector_erases << 20) / bytes,
+                 ((uint64_t)pipe->metrics.sector_programs << 20) / bytes, pipe->metrics.max_stall_us,
+                 pipe->metrics.deferred_us / 1000);
+    }
+    if (pipe->metrics.bytes_received > 0) {
+        ESP_LOGI(TAG, "Receive: %u bytes copied, %u.%02u per byte received, %u bytes of buffers, %u bytes heap low",
+                 (unsigned)pipe->metrics.bytes_copied,
+                 (unsigned)(pipe->metrics.bytes_copied / pipe->metrics.bytes_received),
+                 (unsigned)((uint64_t)pipe->metrics.bytes_copied * 100 / pipe->metrics.bytes_received % 100),
+                 (unsigned)pipe->metrics.buffer_bytes, (unsigned)pipe->metrics.heap_min_free);
+    }
+#endif
+    return ESP_OK;
+}
+
+void ota_pipeline_abort(ota_pipeline_t *pipe) {
+    if (!pipe->open) {
+        return; // Not started or already finished
+    }
+    pipe->open = false;
+    record_metrics(pipe);
+    log_cycles(pipe);
+    mbedtls_sha256_free(&pipe->image_ctx);
+    if (pipe->target == OTA_TARGET_APP) {
+        esp_ota_abort(pipe->ota_handle);
+    }
+    free_buffers(pipe);
+}
+
+#if CONFIG_GECL_OTA_CHUNK_MAX_RETRIES > 0
+/**
+ * Re-reads everything from the resume offset up to the sequential stream
+ * position after a chunk was rejected, so the stream can continue where it was.
+ */
+static esp_err_t refetch(ota_pipeline_t *pipe, ota_source_t *src, size_t stream_pos) {
+    size_t offset = ota_pipeline_resume_offset(pipe);
+    ota_trace_event(OTA_TRACE_REFETCH, 0, (int32_t)offset);
+    ESP_LOGW(TAG, "Re-fetching %u bytes at offset %u", (unsigned)(stream_pos - offset), (unsigned)offset);
+
+    while (offset < stream_pos) {
+        size_t room;
+        uint8_t *buf = ota_pipeline_recv_buf(pipe, &room);
+        size_t len = stream_pos - offset < room ? stream_pos - offset : room;
+        esp_err_t err = src->ops->read_range(src, offset, buf, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+        err = ota_pipeline_received(pipe, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+        offset += len;
+    }
+    return ESP_OK;
+}
+#endif
+
+/**
+ * Pulls one read from the source into the pipeline; the source reads into the
+ * landing buffer directly. *done is set once the image is complete or the
+ * source reports its end. Transient read errors are retried on the next call,
+ * and chunks that fail verification are re-fetched through the source's
+ * ranged read, up to GECL_OTA_CHUNK_MAX_RETRIES times.
+ */
+esp_err_t ota_pipeline_pull(ota_pipeline_t *pipe, ota_source_t *src, bool *done) {
+    *done = pipe->manifest != NULL && pipe->written >= pipe->manifest->image_size;
+    if (*done) {
+        return ESP_OK;
+    }
+
+    size_t copied = src->copied;
+    size_t room;
+    uint8_t *buf = ota_pipeline_recv_buf(pipe, &room);
+    int64_t trace_us = ota_trace_now();
+    int n = src->ops->read(src, buf, room);
+    ota_trace_event(OTA_TRACE_RECV, trace_us, n);
+    esp_err_t err = ESP_OK;
+    if (n == 0) {
+        *done = true; // End of image
+    } else if (n < 0) {
+        if (++pipe->retries > CONFIG_GECL_OTA_CHUNK_MAX_RETRIES) {
+            ESP_LOGE(TAG, "%s source failed at offset %u", src->ops->name, (unsigned)pipe->stream_pos);
+            err = ESP_FAIL;
+        } // Otherwise the source resumes at the same position
+    } else {
+        pipe->stream_pos += n;
+        err = ota_pipeline_received(pipe, n);
+#if CONFIG_GECL_OTA_CHUNK_MAX_RETRIES > 0
+        while (err == ESP_ERR_INVALID_CRC && src->ops->read_range != NULL &&
+               ++pipe->retries <= CONFIG_GECL_OTA_CHUNK_MAX_RETRIES) {
+            err = refetch(pipe, src, pipe->stream_pos);
+        }
+#endif
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Chunk %" PRIu32 " could not be recovered: %s", pipe->chunk_index, esp_err_to_name(err));
+            ota_trace_event(OTA_TRACE_ERROR, 0, err);
+        } else if (pipe->chunk_index != pipe->retry_chunk) {
+            pipe->retry_chunk = pipe->chunk_index;
+            pipe->retries = 0;
+        }
+    }
+
+    pipe->metrics.requests = src->requests;
+    pipe->metrics.bytes_copied += src->copied - copied;
+    return err;
+}
+
+/**
+ * Pulls the image from a source into the pipeline until the source reports the
+ * end of the image.
+ */
+esp_err_t ota_pipeline_run(ota_pipeline_t *pipe, ota_source_t *src) {
+    pipe->metrics.buffer_bytes += src->buffer_bytes;
+    bool done = false;
+    esp_err_t err = ESP_OK;
+    while (err == ESP_OK && !done) {
+        err = ota_pipeline_pull(pipe, src, &done);
+    }
+    return err;
+}
@@ -0,0 +1,133 @@
+/*
+ * Push-Style OTA Sessions
+ * =======================
+ *
+ * For applications that receive firmware bytes themselves (a custom protocol,
+ * a local web UI) and cannot point ota_task at a URL. The caller feeds its own
+ * buffers into the same verify/write pipeline, with the same chunk
+ * verification, pacing and metrics as the managed path:
+ *
+ *   ota_session_begin() -> ota_session_feed() ... -> ota_session_finish()
+ *
+ * Whenever a fed buffer covers a whole chunk on a chunk boundary, the chunk is
+ * verified and written straight from the caller's buffer without a copy. Only
+ * data straddling chunk boundaries is staged in the session's chunk buffer.
+ *
+ * If a chunk fails verification, ota_session_feed() returns ESP_ERR_INVALID_CRC
+ * and the caller re-sends the image from ota_session_resume_offset().
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_SESSION";
+
+struct ota_session {
+    ota_pipeline_t pipe;
+    ota_manifest_t manifest;
+    bool has_manifest;
+};
+
+static void end_session(ota_session_handle_t session, esp_err_t err) {
+    if (session->has_manifest) {
+        ota_manifest_free(&session->manifest);
+    }
+    free(session);
+    ota_trace_stop(err);
+    ota_release_session();
+    esp_event_post(GECL_OTA_EVENT, err == ESP_OK ? GECL_OTA_EVENT_FINISH : GECL_OTA_EVENT_ABORT, NULL, 0,
+                   portMAX_DELAY);
+}
+
+/**
+ * Starts a push-style session. Fails with ESP_ERR_INVALID_STATE while another
+ * OTA session, managed or push-style, is running.
+ */
+esp_err_t ota_session_begin(const ota_session_config_t *config, ota_session_handle_t *out_session) {
+    if (config == NULL || out_session == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!ota_claim_session()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_event_post(GECL_OTA_EVENT, GECL_OTA_EVENT_START, NULL, 0, portMAX_DELAY);
+
+    ota_session_handle_t session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        ota_trace_stop(ESP_ERR_NO_MEM);
+        ota_release_session();
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (config->manifest_json != NULL) {
+        ota_source_t source = {0}; // For chunk maps referenced by absolute URL
+        err = ota_manifest_load(config->manifest_json, config->manifest_len, "", "", NULL, &source, &session->manifest);
+        ota_source_close(&source);
+        session->has_manifest = err == ESP_OK;
+        if (err == ESP_OK && session->manifest.artifact_count > 0) {
+            ESP_LOGE(TAG, "Sessions carry the app image only, not partition images");
+            err = ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+    if (err == ESP_OK) {
+        err = ota_pipeline_begin(&session->pipe, session->has_manifest ? &session->manifest : NULL);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to begin session: %s", esp_err_to_name(err));
+        end_session(session, err);
+        return err;
+    }
+
+    *out_session = session;
+    return ESP_OK;
+}
+
+/**
+ * Feeds the next bytes of the image. On ESP_ERR_INVALID_CRC the session stays
+ * open and feeding must restart at ota_session_resume_offset(); any other
+ * error leaves the session to be aborted.
+ */
+esp_err_t ota_session_feed(ota_session_handle_t session, const void *data, size_t len) {
+    if (session == NULL || (data == NULL && len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ota_pipeline_feed(&session->pipe, data, len);
+}
+
+/**
+ * Offset of the first byte not yet verified and written.
+ */
+size_t ota_session_resume_offset(ota_session_handle_t session) {
+    return ota_pipeline_resume_offset(&session->pipe);
+}
+
+/**
+ * Verifies the complete image and sets it as the boot partition. The caller
+ * decides when to reboot. The session is released whatever the outcome.
+ */
+esp_err_t ota_session_finish(ota_session_handle_t session) {
+    if (session == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = ota_pipeline_finish(&session->pipe);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Session failed: %s", esp_err_to_name(err));
+    }
+    end_session(session, err);
+    return err;
+}
+
+/**
+ * Discards everything written so far and releases the session.
+ */
+void ota_session_abort(ota_session_handle_t session) {
+    if (session == NULL) {
+        return;
+    }
+    ota_pipeline_abort(&session->pipe);
+    end_session(session, ESP_FAIL);
+}
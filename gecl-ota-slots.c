@@ -0,0 +1,200 @@
+/*
+ * Data Partition Slots
+ * ====================
+ *
+ * Keeps data partitions consistent with the app that uses them. A data
+ * partition updated together with the app must be an A/B pair named
+ * "<label>_a" and "<label>_b"; a single partition could only be rewritten in
+ * place under the running app, so manifests naming one are rejected.
+ *
+ * The new image goes to the slot the running app does not use, and the slot
+ * each app uses is recorded in NVS under the app's ELF SHA-256. The
+ * records for the running app and the new app are one NVS blob, written after
+ * every image is verified and before the boot partition is switched. Whatever
+ * the point of failure, each app finds the data written for it, and a rollback
+ * to the previous app finds its data untouched.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "esp_log.h"
+#include "nvs.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "OTA_SLOTS";
+
+#define SLOTS_NVS_NAMESPACE "gecl_ota"
+#define SLOTS_NVS_KEY "slots"
+
+typedef struct {
+    char label[17];
+    uint8_t slot; // 0 for "<label>_a", 1 for "<label>_b"
+} ota_slot_entry_t;
+
+typedef struct {
+    uint8_t app_sha256[OTA_SHA256_LEN];
+    uint8_t count;
+    ota_slot_entry_t entries[OTA_MAX_PARTITION_IMAGES];
+} ota_slot_record_t;
+
+static esp_err_t load_records(ota_slot_record_t records[2]) {
+    memset(records, 0, 2 * sizeof(ota_slot_record_t));
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(SLOTS_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK; // Nothing recorded yet
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    size_t len = 2 * sizeof(ota_slot_record_t);
+    err = nvs_get_blob(nvs, SLOTS_NVS_KEY, records, &len);
+    nvs_close(nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && len != 2 * sizeof(ota_slot_record_t))) {
+        memset(records, 0, 2 * sizeof(ota_slot_record_t));
+        return ESP_OK;
+    }
+    return err;
+}
+
+static const ota_slot_record_t *find_record(const ota_slot_record_t records[2], const uint8_t *app_sha256) {
+    for (int i = 0; i < 2; i++) {
+        if (memcmp(records[i].app_sha256, app_sha256, OTA_SHA256_LEN) == 0) {
+            return &records[i];
+        }
+    }
+    return NULL;
+}
+
+static int lookup_slot(const ota_slot_record_t *record, const char *label) {
+    for (uint8_t i = 0; record != NULL && i < record->count && i < OTA_MAX_PARTITION_IMAGES; i++) {
+        if (strcmp(record->entries[i].label, label) == 0) {
+            return record->entries[i].slot;
+        }
+    }
+    return 0; // Pairs start out on slot a
+}
+
+/**
+ * Looks up the A/B pair "<label>_a", "<label>_b".
+ */
+bool ota_slots_find_pair(const char *label, const esp_partition_t *pair[2]) {
+    char name[20];
+    for (int i = 0; i < 2; i++) {
+        snprintf(name, sizeof(name), "%s_%c", label, 'a' + i);
+        pair[i] = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    }
+    return pair[0] != NULL && pair[1] != NULL;
+}
+
+/**
+ * Slot of an A/B pair used by the running app, 0 when none is recorded.
+ */
+static int running_slot(const char *label) {
+    ota_slot_record_t records[2];
+    if (load_records(records) != ESP_OK) {
+        return 0;
+    }
+    return lookup_slot(find_record(records, esp_app_get_description()->app_elf_sha256), label);
+}
+
+/**
+ * Picks the partition a new image for label is written to: the slot (0 or 1)
+ * of the A/B pair the running app does not use. A single partition of that
+ * name is rejected with ESP_ERR_NOT_SUPPORTED.
+ */
+esp_err_t ota_slots_target(const char *label, const esp_partition_t **target, int8_t *slot) {
+    const esp_partition_t *pair[2];
+    if (ota_slots_find_pair(label, pair)) {
+        *slot = 1 - running_slot(label);
+        *target = pair[*slot];
+        return ESP_OK;
+    }
+    if (esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label) != NULL) {
+        ESP_LOGE(TAG, "Data partition %s has no %s_a/%s_b pair and cannot be updated with the app", label, label,
+                 label);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    ESP_LOGE(TAG, "No data partitions %s_a/%s_b", label, label);
+    return ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * Records the slots written for the new app in app, keeping the running app's
+ * record. slots holds the slot written for each manifest partition image.
+ */
+esp_err_t ota_slots_commit(const esp_partition_t *app, const ota_manifest_t *manifest, const int8_t *slots) {
+    esp_app_desc_t new_desc;
+    esp_err_t err = esp_ota_get_partition_description(app, &new_desc);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ota_slot_record_t records[2];
+    err = load_records(records);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ota_slot_record_t current = {0};
+    const uint8_t *running_sha256 = esp_app_get_description()->app_elf_sha256;
+    const ota_slot_record_t *found = find_record(records, running_sha256);
+    if (found != NULL) {
+        current = *found;
+    } else {
+        memcpy(current.app_sha256, running_sha256, OTA_SHA256_LEN);
+    }
+
+    // The new app inherits the running app's slots for pairs this update leaves alone
+    ota_slot_record_t next = current;
+    memcpy(next.app_sha256, new_desc.app_elf_sha256, OTA_SHA256_LEN);
+    for (uint8_t i = 0; i < manifest->artifact_count; i++) {
+        uint8_t e = 0;
+        while (e < next.count && strcmp(next.entries[e].label, manifest->artifacts[i].label) != 0) {
+            e++;
+        }
+        if (e == OTA_MAX_PARTITION_IMAGES) {
+            return ESP_ERR_NO_MEM;
+        }
+        if (e == next.count) {
+            strcpy(next.entries[e].label, manifest->artifacts[i].label);
+            next.count++;
+        }
+        next.entries[e].slot = slots[i];
+    }
+
+    bool same_app = memcmp(next.app_sha256, current.app_sha256, OTA_SHA256_LEN) == 0;
+    records[0] = next;
+    if (same_app) {
+        memset(&records[1], 0, sizeof(records[1])); // Reinstalling the running app, its record is replaced
+    } else {
+        records[1] = current;
+    }
+    nvs_handle_t nvs;
+    err = nvs_open(SLOTS_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, SLOTS_NVS_KEY, records, sizeof(records)); // One blob, written atomically
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to record data partition slots: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+/**
+ * Returns the data partition the running app should use for label: its slot
+ * of an A/B pair, or the single partition of that name.
+ */
+const esp_partition_t *ota_get_data_partition(const char *label) {
+    const esp_partition_t *pair[2];
+    if (ota_slots_find_pair(label, pair)) {
+        return pair[running_slot(label)];
+    }
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+}
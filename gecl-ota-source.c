@@ -0,0 +1,317 @@
+/*
+ * OTA Image Sources
+ * =================
+ *
+ * Selects the image source from the URI scheme and implements the local
+ * sources. Every source feeds the same verify/write pipeline:
+ *
+ *   https://, http://      gecl-ota-http-direct.c, gecl-ota-http.c for chunked responses
+ *   mqtt:[<base>]          gecl-ota-mqtt.c
+ *   mcast://<group>:<port> gecl-ota-mcast.c
+ *   coap://, coaps://      gecl-ota-coap.c
+ *   file://<path>          a file on any mounted VFS (SPIFFS, FAT, SD card)
+ *   uart://<port>          raw image bytes on a UART, ends after an idle timeout
+ *   tcp://<host>:<port>    raw image bytes on a TCP socket, ends when the peer closes
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "OTA_SOURCE";
+
+static const struct {
+    const char *scheme;
+    const ota_source_ops_t *ops;
+} source_schemes[] = {
+#if CONFIG_GECL_OTA_HTTP_DIRECT
+    {"https://", &ota_source_http_direct},
+    {"http://", &ota_source_http_direct},
+#endif
+    {"https://", &ota_source_http},
+    {"http://", &ota_source_http},
+#if CONFIG_GECL_OTA_MQTT_TRANSPORT
+    {OTA_MQTT_URL_PREFIX, &ota_source_mqtt},
+#endif
+#if CONFIG_GECL_OTA_MCAST_TRANSPORT
+    {"mcast://", &ota_source_mcast},
+#endif
+#if CONFIG_GECL_OTA_COAP_TRANSPORT
+    {"coap://", &ota_source_coap},
+    {"coaps://", &ota_source_coap},
+#endif
+    {"file://", &ota_source_file},
+    {"uart://", &ota_source_uart},
+    {"tcp://", &ota_source_tcp},
+};
+
+/**
+ * Refuses images from a source without transport authentication when no
+ * manifest verifies them.
+ */
+esp_err_t ota_source_check_verified(const char *uri, const ota_manifest_t *verify) {
+    for (size_t i = 0; verify == NULL && i < sizeof(source_schemes) / sizeof(source_schemes[0]); i++) {
+        if (strncmp(uri, source_schemes[i].scheme, strlen(source_schemes[i].scheme)) == 0) {
+            if (source_schemes[i].ops->needs_manifest) {
+                ESP_LOGE(TAG, "%s images need a manifest, set manifest_url", source_schemes[i].ops->name);
+                return ESP_ERR_NOT_ALLOWED;
+            }
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Opens the source matching the URI scheme. A source returning
+ * ESP_ERR_NOT_SUPPORTED declines the image and the next one for the scheme is
+ * tried.
+ */
+esp_err_t ota_source_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    memset(src, 0, sizeof(*src));
+    for (size_t i = 0; i < sizeof(source_schemes) / sizeof(source_schemes[0]); i++) {
+        if (strncmp(uri, source_schemes[i].scheme, strlen(source_schemes[i].scheme)) == 0) {
+            src->ops = source_schemes[i].ops;
+            esp_err_t err = src->ops->open(src, uri, ota);
+            if (err == ESP_ERR_NOT_SUPPORTED) {
+                continue;
+            }
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to open %s source: %s", src->ops->name, esp_err_to_name(err));
+            }
+            return err;
+        }
+    }
+    ESP_LOGE(TAG, "No image source for %s", uri);
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+/**
+ * Points an open source at another image. Sources that can reuse their
+ * connection do so, others are closed and opened again.
+ */
+esp_err_t ota_source_reopen(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    if (src->ops != NULL && src->ops->reopen != NULL && src->ctx != NULL) {
+        for (size_t i = 0; i < sizeof(source_schemes) / sizeof(source_schemes[0]); i++) {
+            const char *scheme = source_schemes[i].scheme;
+            if (source_schemes[i].ops == src->ops && strncmp(uri, scheme, strlen(scheme)) == 0) {
+                src->size = 0;
+                src->manifest = NULL;
+                esp_err_t err = src->ops->reopen(src, uri);
+                if (err != ESP_ERR_NOT_SUPPORTED) {
+                    return err;
+                }
+                break; // Declined, open a source that serves it
+            }
+        }
+    }
+    uint32_t requests = src->requests;
+    ota_source_close(src);
+    esp_err_t err = ota_source_open(src, uri, ota);
+    src->requests += requests;
+    return err;
+}
+
+/**
+ * Reads a whole document of at most max_len bytes, such as a manifest or a
+ * chunk map, through src, which is opened or pointed at url like
+ * ota_source_reopen() does. The source stays open, so the requests that follow
+ * reuse its connection and TLS session.
+ */
+esp_err_t ota_source_get(ota_source_t *src, const char *url, const ota_config_t *ota, uint8_t *buf, size_t max_len,
+                         size_t *out_len) {
+    esp_err_t err = ota_source_reopen(src, url, ota);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (src->size > max_len) {
+        ESP_LOGE(TAG, "Body of %s too large: %u bytes", url, (unsigned)src->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    size_t total = 0;
+    for (;;) {
+        uint8_t extra;
+        int n = total < max_len ? src->ops->read(src, buf + total, max_len - total) : src->ops->read(src, &extra, 1);
+        if (n < 0) {
+            ESP_LOGE(TAG, "Failed to read %s", url);
+            return ESP_FAIL;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (total == max_len) {
+            ESP_LOGE(TAG, "Body of %s exceeds %u bytes", url, (unsigned)max_len);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        total += n;
+    }
+    if (src->size != 0 && total != src->size) {
+        ESP_LOGE(TAG, "Incomplete body received from %s", url);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *out_len = total;
+    return ESP_OK;
+}
+
+void ota_source_close(ota_source_t *src) {
+    if (src->ops != NULL && src->ctx != NULL) {
+        src->ops->close(src);
+    }
+    src->ctx = NULL;
+}
+
+/* File source */
+
+static esp_err_t file_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    FILE *file = fopen(uri + strlen("file://"), "rb");
+    if (file == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    src->size = size > 0 ? (size_t)size : 0;
+    src->ctx = file;
+    return ESP_OK;
+}
+
+static int file_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    FILE *file = src->ctx;
+    size_t n = fread(buf, 1, len, file);
+    if (n == 0 && ferror(file)) {
+        clearerr(file);
+        return -1;
+    }
+    return (int)n;
+}
+
+static esp_err_t file_read_range(ota_source_t *src, size_t offset, uint8_t *buf, size_t len) {
+    FILE *file = src->ctx;
+    long pos = ftell(file);
+    esp_err_t err = ESP_OK;
+    if (fseek(file, (long)offset, SEEK_SET) != 0 || fread(buf, 1, len, file) != len) {
+        err = ESP_FAIL;
+    }
+    fseek(file, pos, SEEK_SET);
+    return err;
+}
+
+static void file_close(ota_source_t *src) { fclose((FILE *)src->ctx); }
+
+const ota_source_ops_t ota_source_file = {
+    .name = "file",
+    .open = file_open,
+    .read = file_read,
+    .read_range = file_read_range,
+    .close = file_close,
+};
+
+// uart:// and tcp:// do not authenticate the sender
+#if CONFIG_GECL_OTA_STREAM_UNVERIFIED
+#define STREAM_NEEDS_MANIFEST false
+#else
+#define STREAM_NEEDS_MANIFEST true
+#endif
+
+/* UART stream source */
+
+// ctx holds the port + 1, to keep NULL meaning "not open", and this flag when
+// open installed the driver, which close then removes again
+#define UART_CTX_INSTALLED 0x100
+
+static esp_err_t uart_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    int port = atoi(uri + strlen("uart://"));
+    if (port < 0 || port >= UART_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    intptr_t ctx = port + 1;
+    if (!uart_is_driver_installed(port)) {
+        esp_err_t err = uart_driver_install(port, CONFIG_GECL_OTA_STREAM_BUFFER_SIZE, 0, 0, NULL, 0);
+        if (err != ESP_OK) {
+            return err;
+        }
+        ctx |= UART_CTX_INSTALLED;
+    }
+    src->ctx = (void *)ctx;
+    return ESP_OK;
+}
+
+static int uart_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    uart_port_t port = (uart_port_t)(((intptr_t)src->ctx & ~UART_CTX_INSTALLED) - 1);
+    int n = uart_read_bytes(port, buf, len, pdMS_TO_TICKS(CONFIG_GECL_OTA_STREAM_IDLE_TIMEOUT_MS));
+    return n; // 0 after the idle timeout marks the end of the image
+}
+
+static void uart_close(ota_source_t *src) {
+    intptr_t ctx = (intptr_t)src->ctx;
+    if (ctx & UART_CTX_INSTALLED) {
+        uart_driver_delete((uart_port_t)((ctx & ~UART_CTX_INSTALLED) - 1));
+    }
+}
+
+const ota_source_ops_t ota_source_uart = {
+    .name = "UART",
+    .open = uart_open,
+    .read = uart_read,
+    .close = uart_close,
+    .needs_manifest = STREAM_NEEDS_MANIFEST,
+};
+
+/* TCP stream source */
+
+static esp_err_t tcp_open(ota_source_t *src, const char *uri, const ota_config_t *ota) {
+    char host[64];
+    const char *hostport = uri + strlen("tcp://");
+    const char *colon = strrchr(hostport, ':');
+    if (colon == NULL || (size_t)(colon - hostport) >= sizeof(host)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(host, hostport, colon - hostport);
+    host[colon - hostport] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0 || res == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    int sock = socket(res->ai_family, res->ai_socktype, 0);
+    if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) != 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        freeaddrinfo(res);
+        return ESP_FAIL;
+    }
+    freeaddrinfo(res);
+
+    struct timeval timeout = {.tv_sec = CONFIG_GECL_OTA_STREAM_IDLE_TIMEOUT_MS / 1000,
+                              .tv_usec = (CONFIG_GECL_OTA_STREAM_IDLE_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    src->ctx = (void *)(intptr_t)(sock + 1);
+    return ESP_OK;
+}
+
+static int tcp_read(ota_source_t *src, uint8_t *buf, size_t len) {
+    int sock = (int)(intptr_t)src->ctx - 1;
+    int n = recv(sock, buf, len, 0);
+    return n < 0 ? -1 : n; // 0 when the peer closes the connection
+}
+
+static void tcp_close(ota_source_t *src) { close((int)(intptr_t)src->ctx - 1); }
+
+const ota_source_ops_t ota_source_tcp = {
+    .name = "TCP",
+    .open = tcp_open,
+    .read = tcp_read,
+    .close = tcp_close,
+    .needs_manifest = STREAM_NEEDS_MANIFEST,
+};
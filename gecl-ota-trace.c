@@ -0,0 +1,288 @@
+/*
+ * OTA Trace Recorder
+ * ==================
+ *
+ * Records what happened during an update session in a RAM ring, so a slow
+ * update in the field can be uploaded and its network timing replayed on the
+ * bench with tools/ota_trace_replay.py. Each event is one 16-byte record with
+ * its start time, duration and one value:
+ *
+ *   IMAGE    an image started, value is its size or 0 when unknown
+ *   CONNECT  a connection set up, TCP connect and TLS handshake, value is 1
+ *            with TLS
+ *   REQUEST  a request sent and its response headers received, value is the
+ *            first byte requested; includes the connection for esp_http_client
+ *   RECV     a source read or a pushed slice, value is the byte count or a
+ *            negative read error, duration the time spent waiting in the read
+ *   HASH     a chunk checked against its leaf hash, value is its index
+ *   DECRYPT  a chunk decrypted, value is its index
+ *   CHUNK    a chunk verified and written, value is its index
+ *   ERASE    a data partition sector erased, value is its offset
+ *   WRITE    one sector programmed, value is its offset; esp_ota_write()
+ *            erases app sectors as part of it
+ *   DEFER    a flash operation held back by a critical period
+ *   REFETCH  a rejected chunk re-fetched, value is the resume offset
+ *   ERROR    value is the esp_err_t
+ *   END      the session ended, value is its result
+ *
+ * Spans nest: HASH, DECRYPT and the flash events happen within CHUNK, and
+ * CONNECT within REQUEST. When the ring is full the oldest records are
+ * overwritten and counted as dropped. When GECL_OTA_TRACE_PARTITION names a
+ * data partition, the trace is also written there at the end of the session,
+ * so it survives the reboot into the new image. GECL_OTA_TRACE_LOG prints it
+ * to the console as well.
+ */
+
+#include "gecl-ota-internal.h"
+
+#include "sdkconfig.h"
+
+#if CONFIG_GECL_OTA_TRACE
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "mbedtls/base64.h"
+#include <freertos/FreeRTOS.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const char *TAG = "OTA_TRACE";
+
+#define TRACE_MAGIC "GOTR"
+#define TRACE_VERSION 1
+
+// Clock values before 2020 mean the time was never set
+#define TRACE_MIN_VALID_TIME 1577836800
+
+// Trace bytes per console line, 64 base64 characters
+#define TRACE_LOG_LINE 48
+
+typedef struct {
+    uint32_t start_us;    // Since the session started
+    uint32_t duration_us; // 0 for instant events
+    int32_t value;        // See the event list above
+    uint8_t type;         // ota_trace_type_t
+    uint8_t reserved[3];
+} trace_record_t;
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t record_size;
+    uint16_t count;      // Records that follow, oldest first
+    uint32_t dropped;    // Records overwritten before the session ended
+    int32_t result;      // esp_err_t of the session
+    uint32_t start_time; // Session start in seconds since the epoch, 0 when the clock was not set
+} trace_header_t;
+
+static trace_record_t ring[CONFIG_GECL_OTA_TRACE_ENTRIES];
+static trace_header_t header;
+static uint32_t recorded; // Records written since the session started
+static int64_t start_us;
+static bool active = false;
+static bool valid = false; // A session was traced since boot
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+void ota_trace_start(void) {
+    time_t now = time(NULL);
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.count = 0;
+    header.dropped = 0;
+    header.result = ESP_OK;
+    header.start_time = now >= TRACE_MIN_VALID_TIME ? (uint32_t)now : 0;
+
+    portENTER_CRITICAL(&lock);
+    recorded = 0;
+    start_us = esp_timer_get_time();
+    active = true;
+    valid = true;
+    portEXIT_CRITICAL(&lock);
+}
+
+/**
+ * Records an event that started at since_us (an esp_timer timestamp) and ends
+ * now; since_us 0 records an instant event.
+ */
+void ota_trace_event(ota_trace_type_t type, int64_t since_us, int32_t value) {
+    if (!active) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    int64_t begin_us = since_us != 0 ? since_us : now_us;
+    trace_record_t record = {
+        .start_us = (uint32_t)(begin_us - start_us),
+        .duration_us = (uint32_t)(now_us - begin_us),
+        .value = value,
+        .type = type,
+    };
+    portENTER_CRITICAL(&lock);
+    ring[recorded++ % CONFIG_GECL_OTA_TRACE_ENTRIES] = record;
+    portEXIT_CRITICAL(&lock);
+}
+
+/**
+ * Finds the last count records in the ring: *first is the position of the
+ * oldest, the return value how many of them precede the wrap.
+ */
+static size_t newest(size_t count, size_t *first) {
+    *first = (recorded - count) % CONFIG_GECL_OTA_TRACE_ENTRIES;
+    size_t to_end = CONFIG_GECL_OTA_TRACE_ENTRIES - *first;
+    return to_end < count ? to_end : count;
+}
+
+/**
+ * Copies len bytes from offset of the trace as ota_trace_read() returns it:
+ * the header followed by the records, oldest first.
+ */
+static void copy_out(size_t offset, uint8_t *out, size_t len) {
+    size_t first;
+    newest(header.count, &first);
+    while (len > 0) {
+        size_t n;
+        if (offset < sizeof(header)) {
+            n = sizeof(header) - offset < len ? sizeof(header) - offset : len;
+            memcpy(out, (const uint8_t *)&header + offset, n);
+        } else {
+            size_t index = (offset - sizeof(header)) / sizeof(trace_record_t);
+            size_t within = (offset - sizeof(header)) % sizeof(trace_record_t);
+            n = sizeof(trace_record_t) - within < len ? sizeof(trace_record_t) - within : len;
+            memcpy(out, (const uint8_t *)&ring[(first + index) % CONFIG_GECL_OTA_TRACE_ENTRIES] + within, n);
+        }
+        offset += n;
+        out += n;
+        len -= n;
+    }
+}
+
+#if CONFIG_GECL_OTA_TRACE_LOG
+/**
+ * Prints the trace as "GOTR <line> <lines> <base64>" lines.
+ */
+static void print_trace(void) {
+    size_t len = sizeof(header) + header.count * sizeof(trace_record_t);
+    unsigned lines = (len + TRACE_LOG_LINE - 1) / TRACE_LOG_LINE;
+    for (unsigned line = 0; line < lines; line++) {
+        uint8_t raw[TRACE_LOG_LINE];
+        unsigned char text[TRACE_LOG_LINE / 3 * 4 + 1];
+        size_t n = len - line * TRACE_LOG_LINE < TRACE_LOG_LINE ? len - line * TRACE_LOG_LINE : TRACE_LOG_LINE;
+        size_t text_len;
+        copy_out(line * TRACE_LOG_LINE, raw, n);
+        mbedtls_base64_encode(text, sizeof(text), &text_len, raw, n);
+        printf("GOTR %u %u %s\n", line, lines, text);
+    }
+}
+#endif
+
+/**
+ * Writes the newest records that fit, oldest first, after the header at the
+ * start of the trace partition.
+ */
+static void persist(void) {
+    if (CONFIG_GECL_OTA_TRACE_PARTITION[0] == '\0') {
+        return;
+    }
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_GECL_OTA_TRACE_PARTITION);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "Trace partition %s not found", CONFIG_GECL_OTA_TRACE_PARTITION);
+        return;
+    }
+
+    trace_header_t stored = header;
+    size_t fit = (partition->size - sizeof(stored)) / sizeof(trace_record_t);
+    if (stored.count > fit) {
+        stored.dropped += stored.count - fit;
+        stored.count = fit;
+    }
+    size_t len = sizeof(stored) + stored.count * sizeof(trace_record_t);
+    size_t first;
+    size_t run = newest(stored.count, &first);
+
+    esp_err_t err = esp_partition_erase_range(partition, 0,
+                                              (len + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE);
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, 0, &stored, sizeof(stored));
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, sizeof(stored), &ring[first], run * sizeof(trace_record_t));
+    }
+    if (err == ESP_OK && run < stored.count) {
+        err = esp_partition_write(partition, sizeof(stored) + run * sizeof(trace_record_t), ring,
+                                  (stored.count - run) * sizeof(trace_record_t));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to store trace: %s", esp_err_to_name(err));
+    }
+}
+
+void ota_trace_stop(esp_err_t result) {
+    if (!active) {
+        return;
+    }
+    ota_trace_event(OTA_TRACE_END, 0, result);
+    active = false;
+    header.result = result;
+    header.count = recorded < CONFIG_GECL_OTA_TRACE_ENTRIES ? recorded : CONFIG_GECL_OTA_TRACE_ENTRIES;
+    header.dropped = recorded - header.count;
+    ESP_LOGI(TAG, "Trace: %u records, %u dropped", (unsigned)header.count, (unsigned)header.dropped);
+    persist();
+#if CONFIG_GECL_OTA_TRACE_LOG
+    print_trace();
+#endif
+}
+
+/**
+ * Copies the trace of the last session: a 20-byte header followed by the
+ * records, oldest first. Without a session since boot, the trace stored in
+ * GECL_OTA_TRACE_PARTITION is returned. *out_len receives the trace size; a
+ * NULL buf or a buffer smaller than that only reports the size.
+ */
+esp_err_t ota_trace_read(void *buf, size_t len, size_t *out_len) {
+    if (out_len == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (valid) {
+        *out_len = sizeof(header) + header.count * sizeof(trace_record_t);
+        if (buf == NULL || len < *out_len) {
+            return buf == NULL ? ESP_OK : ESP_ERR_INVALID_SIZE;
+        }
+        copy_out(0, buf, *out_len);
+        return ESP_OK;
+    }
+
+    const esp_partition_t *partition =
+        CONFIG_GECL_OTA_TRACE_PARTITION[0] == '\0'
+            ? NULL
+            : esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                       CONFIG_GECL_OTA_TRACE_PARTITION);
+    trace_header_t stored;
+    if (partition == NULL || esp_partition_read(partition, 0, &stored, sizeof(stored)) != ESP_OK ||
+        memcmp(stored.magic, TRACE_MAGIC, sizeof(stored.magic)) != 0 || stored.version != TRACE_VERSION ||
+        stored.record_size != sizeof(trace_record_t)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *out_len = sizeof(stored) + stored.count * sizeof(trace_record_t);
+    if (*out_len > partition->size) {
+        return ESP_ERR_INVALID_CRC; // Not a complete trace
+    }
+    if (buf == NULL || len < *out_len) {
+        return buf == NULL ? ESP_OK : ESP_ERR_INVALID_SIZE;
+    }
+    return esp_partition_read(partition, 0, buf, *out_len);
+}
+
+#else
+
+esp_err_t ota_trace_read(void *buf, size_t len, size_t *out_len) {
+    return ESP_ERR_NOT_SUPPORTED; // Enable GECL_OTA_TRACE
+}
+
+#endif // CONFIG_GECL_OTA_TRACE
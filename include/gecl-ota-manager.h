@@ -5,22 +5,181 @@
 
 #include "esp_event.h"
 #include "esp_http_client.h"
-#include "esp_https_ota.h"
 #include "esp_log.h"
-#include "esp_netif.h"
 #include "esp_ota_ops.h"
 #include "esp_system.h"
-#include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "mqtt_client.h"
 #include "nvs_flash.h"
+#include "sdkconfig.h"
+
+#if CONFIG_GECL_OTA_MQTT_TRANSPORT
+#include "mqtt_client.h"
+#else
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct {
-    esp_mqtt_client_handle_t mqtt_client; // MQTT client handle
+    esp_mqtt_client_handle_t mqtt_client; // MQTT client handle, used by the MQTT transport
     char url[512];                        // URL string (512 bytes)
+    char manifest_url[512];               // Optional manifest URL, enables chunk verification when set
 } ota_config_t;
 
+/**
+ * Counters collected over a single OTA session, managed or push-style.
+ */
+typedef struct {
+    int64_t start_us;         // esp_timer timestamp at session start
+    size_t bytes_received;    // Bytes handed to the pipeline, including re-fetched data
+    size_t bytes_written;     // Bytes committed to the update partition
+    uint32_t chunks_verified; // Chunks whose leaf hash matched
+    uint32_t chunks_failed;   // Chunks rejected by leaf hash verification
+    uint32_t requests;        // Requests issued by the image source (HTTP requests, MQTT rewinds)
+    int64_t readback_us;      // Time spent re-hashing the written partition
+    int64_t decrypt_us;       // Time spent decrypting a pre-encrypted image, key unwrap included
+    uint32_t sector_erases;   // Flash sectors erased
+    uint32_t sector_programs; // Flash program operations, one per sector unless GECL_OTA_MAX_STALL_US slices them
+    int64_t max_stall_us;     // Longest single flash erase or program, the worst cache-disabled stall
+    int64_t deferred_us;      // Time flash operations waited for critical periods
+    size_t bytes_copied;      // Image bytes copied between buffers after the transport delivered them
+    size_t buffer_bytes;      // Receive and staging buffers held by the pipeline and the image source
+    size_t heap_min_free;     // Lowest free heap seen between chunks
+    int64_t duration_us;      // Session duration up to finish or abort
+} ota_metrics_t;
+
+/**
+ * How an update shares the CPU and the flash with the application. Applies to
+ * sessions started after ota_set_pacing().
+ */
+typedef struct {
+    uint32_t delay_ms;     // Delay after each chunk, GECL_OTA_PACING_DELAY_MS by default
+    uint32_t max_stall_us; // Flash program stall budget, GECL_OTA_MAX_STALL_US by default, 0 for whole sectors
+} ota_pacing_t;
+
+/**
+ * Resources ota_task used in one session, kept in the update history.
+ */
+typedef struct {
+    uint32_t time;         // Session end in seconds since the epoch, 0 when the clock was not set
+    int32_t result;        // esp_err_t of the session
+    uint32_t duration_ms;  // Session duration
+    uint32_t stack_free;   // Least stack ota_task left unused up to its NVS writes, in bytes; excludes the reboot
+    uint16_t cpu_permille; // ota_task's share of one core, OTA_CPU_UNKNOWN without FreeRTOS run-time stats
+    uint16_t reserved;
+    ota_pacing_t pacing;   // Pacing the session ran with
+} ota_task_stats_t;
+
+#define OTA_CPU_UNKNOWN 0xFFFF
+
+// Sessions kept by the update history, newest first
+#define OTA_TASK_HISTORY_LEN 8
+
+/**
+ * One configuration of the co-tenant interference benchmark.
+ */
+typedef struct {
+    ota_pacing_t pacing;
+    bool critical_periods; // The application task wraps its work in ota_critical_enter/exit
+    bool idle;             // Baseline: measure the workload alone for GECL_OTA_BENCH_IDLE_MS
+} ota_bench_mode_t;
+
+/**
+ * What an update in one benchmark mode cost the application workload.
+ */
+typedef struct {
+    ota_bench_mode_t mode;
+    esp_err_t ota_result;
+    int64_t ota_duration_us;
+    uint32_t activations;        // Application task activations
+    uint32_t missed;             // Activations skipped or finished after the deadline
+    uint32_t latency_p50_us;     // Timer alarm to application task running, 10 us resolution
+    uint32_t latency_p99_us;
+    uint32_t latency_p999_us;
+    uint32_t latency_max_us;
+    uint32_t isr_latency_max_us; // Timer alarm to ISR entry
+    uint32_t mqtt_published;
+    uint32_t mqtt_max_us;        // Longest esp_mqtt_client_publish() call
+    int64_t max_stall_us;        // Longest flash operation of the update
+} ota_bench_result_t;
+
+#define OTA_BENCH_DEFAULT_MODES 5
+
+/**
+ * Configuration of a push-style update session.
+ */
+typedef struct {
+    const char *manifest_json; // Optional manifest, enables chunk verification. The chunk map must be inline
+                               // ("leaves") or an absolute chunk_map URL.
+    size_t manifest_len;
+} ota_session_config_t;
+
+typedef struct ota_session *ota_session_handle_t;
+
+/**
+ * Limits of one ota_engine_step() call, checked after each source read. Zero
+ * leaves a limit unset.
+ */
+typedef struct {
+    uint32_t max_us;  // Time one step may spend transferring
+    size_t max_bytes; // Image bytes one step may transfer
+} ota_step_budget_t;
+
+typedef struct ota_engine *ota_engine_handle_t;
+
+/**
+ * Installed copy of a named artifact. Also the data of
+ * GECL_OTA_EVENT_ARTIFACT_UPDATED.
+ */
+typedef struct {
+    char name[14];
+    char version[32];
+    uint8_t sha256[32];
+    size_t size;
+    const esp_partition_t *partition; // Active slot of a partition artifact, NULL for artifacts kept in NVS
+} ota_artifact_info_t;
+
+ESP_EVENT_DECLARE_BASE(GECL_OTA_EVENT);
+
+typedef enum {
+    GECL_OTA_EVENT_START,            // Update session started
+    GECL_OTA_EVENT_CONNECTED,        // Image source opened
+    GECL_OTA_EVENT_FINISH,           // Image written, verified and set as boot partition
+    GECL_OTA_EVENT_ABORT,            // Update failed
+    GECL_OTA_EVENT_ARTIFACT_UPDATED, // Artifact swapped in, event data is its ota_artifact_info_t
+} gecl_ota_event_t;
+
 void ota_task(void *pvParameter);
 void init_ota_handler();
+
+esp_err_t ota_session_begin(const ota_session_config_t *config, ota_session_handle_t *out_session);
+esp_err_t ota_session_feed(ota_session_handle_t session, const void *data, size_t len);
+size_t ota_session_resume_offset(ota_session_handle_t session);
+esp_err_t ota_session_finish(ota_session_handle_t session);
+void ota_session_abort(ota_session_handle_t session);
+esp_err_t ota_engine_start(const ota_config_t *config, ota_engine_handle_t *out_engine);
+esp_err_t ota_engine_step(ota_engine_handle_t engine, const ota_step_budget_t *budget);
+void ota_engine_abort(ota_engine_handle_t engine);
+esp_err_t ota_get_last_metrics(ota_metrics_t *out_metrics);
+esp_err_t ota_get_task_history(ota_task_stats_t *out_stats, size_t max, size_t *out_count);
+esp_err_t ota_set_decryption_key(const char *rsa_private_key, size_t len);
+void ota_set_pacing(const ota_pacing_t *pacing);
+void ota_critical_enter(void);
+void ota_critical_exit(void);
+esp_err_t ota_bench_run(const ota_config_t *ota, const ota_bench_mode_t *modes, size_t count,
+                        ota_bench_result_t *results);
+esp_err_t ota_trace_read(void *buf, size_t len, size_t *out_len);
+const esp_partition_t *ota_get_data_partition(const char *label);
+const char *ota_get_server_cert(void);
+esp_err_t ota_artifact_update(const char *manifest_url);
+esp_err_t ota_artifact_get(const char *name, ota_artifact_info_t *out_info);
+esp_err_t ota_artifact_read(const char *name, void *buf, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // OTA_UPDATE_H
@@ -0,0 +1,289 @@
+/*
+ * C++ OTA Pipelines
+ * =================
+ *
+ * Header-only C++17 layer over the C API for firmware written in C++. An update
+ * is composed from policies:
+ *
+ *   gecl::ota::Pipeline<Source, Sink, Transforms...>
+ *
+ * Data flows from the source through each transform, in order, into the sink.
+ * The stages are template parameters, not function pointers: the per-chunk
+ * path is inlined and specialized for the stages listed, and a stage that is
+ * not listed costs nothing. Policies are plain classes:
+ *
+ *   Source     int read(uint8_t *buf, size_t len)
+ *              bytes read, 0 at the end of the image, negative on error
+ *   Transform  template <typename Next> esp_err_t apply(const uint8_t *data, size_t len, Next &&next)
+ *              template <typename Next> esp_err_t finish(Next &&next)
+ *              passes its output on by calling next(out, out_len) any number of times
+ *   Sink       esp_err_t begin(), esp_err_t write(const uint8_t *data, size_t len),
+ *              esp_err_t finish(), void abort()
+ *
+ * SessionSink feeds the C verify/write pipeline through a push-style session,
+ * so manifest verification, sector-aligned writes, pacing and metrics apply.
+ * PartitionSink writes the passive app partition with esp_ota_* directly.
+ * Decompression and decryption stages for application-specific formats are
+ * supplied as Transform policies.
+ *
+ * ota_task() and init_ota_handler() remain the C entry points; update() below
+ * is the C++ counterpart of ota_task() built from these policies.
+ */
+
+#ifndef OTA_UPDATE_HPP
+#define OTA_UPDATE_HPP
+
+#include "gecl-ota-manager.h"
+
+#include "mbedtls/sha256.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <utility>
+
+namespace gecl::ota {
+
+// Bytes read from the source per pass through the stages, one flash sector
+constexpr size_t kReadSize = 4096;
+
+/**
+ * Reads an image with a single GET through esp_http_client. Without cert_pem
+ * the server is verified against the component's CA certificates, see
+ * ota_get_server_cert().
+ */
+class HttpSource {
+  public:
+    explicit HttpSource(const char *url, const char *cert_pem = nullptr) {
+        esp_http_client_config_t config = {};
+        config.url = url;
+        config.cert_pem = cert_pem != nullptr ? cert_pem : ota_get_server_cert();
+        config.timeout_ms = 10000;
+        client_ = esp_http_client_init(&config);
+    }
+    HttpSource(HttpSource &&other) noexcept
+        : client_(std::exchange(other.client_, nullptr)), open_(other.open_) {}
+    HttpSource(const HttpSource &) = delete;
+    HttpSource &operator=(const HttpSource &) = delete;
+    ~HttpSource() {
+        if (client_ != nullptr) {
+            esp_http_client_cleanup(client_);
+        }
+    }
+
+    int read(uint8_t *buf, size_t len) {
+        if (!open_) {
+            if (client_ == nullptr || esp_http_client_open(client_, 0) != ESP_OK ||
+                esp_http_client_fetch_headers(client_) < 0 || esp_http_client_get_status_code(client_) != 200) {
+                return -1;
+            }
+            open_ = true;
+        }
+        return esp_http_client_read(client_, reinterpret_cast<char *>(buf), static_cast<int>(len));
+    }
+
+  private:
+    esp_http_client_handle_t client_;
+    bool open_ = false;
+};
+
+/**
+ * Hashes the data passing through and, when given the expected digest, checks
+ * it at the end of the image.
+ */
+class Sha256 {
+  public:
+    explicit Sha256(const uint8_t *expected = nullptr) : expected_(expected) {
+        mbedtls_sha256_init(&ctx_);
+        mbedtls_sha256_starts(&ctx_, 0);
+    }
+    Sha256(Sha256 &&other) noexcept : expected_(other.expected_) {
+        mbedtls_sha256_init(&ctx_);
+        mbedtls_sha256_clone(&ctx_, &other.ctx_);
+    }
+    Sha256(const Sha256 &) = delete;
+    Sha256 &operator=(const Sha256 &) = delete;
+    ~Sha256() { mbedtls_sha256_free(&ctx_); }
+
+    template <typename Next> esp_err_t apply(const uint8_t *data, size_t len, Next &&next) {
+        mbedtls_sha256_update(&ctx_, data, len);
+        return next(data, len);
+    }
+
+    template <typename Next> esp_err_t finish(Next &&) {
+        mbedtls_sha256_finish(&ctx_, digest_.data());
+        if (expected_ != nullptr && std::memcmp(digest_.data(), expected_, digest_.size()) != 0) {
+            return ESP_ERR_INVALID_CRC;
+        }
+        return ESP_OK;
+    }
+
+    const std::array<uint8_t, 32> &digest() const { return digest_; }
+
+  private:
+    mbedtls_sha256_context ctx_;
+    const uint8_t *expected_;
+    std::array<uint8_t, 32> digest_ = {};
+};
+
+/**
+ * Calls on_progress(total bytes) as data passes through.
+ */
+template <typename F> class Progress {
+  public:
+    explicit Progress(F on_progress) : on_progress_(std::move(on_progress)) {}
+
+    template <typename Next> esp_err_t apply(const uint8_t *data, size_t len, Next &&next) {
+        total_ += len;
+        on_progress_(total_);
+        return next(data, len);
+    }
+
+    template <typename Next> esp_err_t finish(Next &&) { return ESP_OK; }
+
+  private:
+    F on_progress_;
+    size_t total_ = 0;
+};
+
+/**
+ * Writes into the C verify/write pipeline through a push-style session. The
+ * optional manifest enables chunk verification; see ota_session_begin().
+ */
+class SessionSink {
+  public:
+    explicit SessionSink(const char *manifest_json = nullptr, size_t manifest_len = 0) {
+        config_.manifest_json = manifest_json;
+        config_.manifest_len = manifest_len;
+    }
+
+    esp_err_t begin() { return ota_session_begin(&config_, &session_); }
+    esp_err_t write(const uint8_t *data, size_t len) { return ota_session_feed(session_, data, len); }
+    esp_err_t finish() { return ota_session_finish(std::exchange(session_, nullptr)); }
+    void abort() {
+        if (session_ != nullptr) {
+            ota_session_abort(std::exchange(session_, nullptr));
+        }
+    }
+
+  private:
+    ota_session_config_t config_ = {};
+    ota_session_handle_t session_ = nullptr;
+};
+
+/**
+ * Writes the passive app partition with esp_ota_* and sets it as the boot
+ * partition on finish, without the C pipeline's verification and pacing.
+ */
+class PartitionSink {
+  public:
+    esp_err_t begin() {
+        partition_ = esp_ota_get_next_update_partition(nullptr);
+        if (partition_ == nullptr) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        return esp_ota_begin(partition_, OTA_WITH_SEQUENTIAL_WRITES, &handle_);
+    }
+    esp_err_t write(const uint8_t *data, size_t len) { return esp_ota_write(handle_, data, len); }
+    esp_err_t finish() {
+        esp_err_t err = esp_ota_end(std::exchange(handle_, 0));
+        return err == ESP_OK ? esp_ota_set_boot_partition(partition_) : err;
+    }
+    void abort() {
+        if (handle_ != 0) {
+            esp_ota_abort(std::exchange(handle_, 0));
+        }
+    }
+
+  private:
+    const esp_partition_t *partition_ = nullptr;
+    esp_ota_handle_t handle_ = 0;
+};
+
+template <typename Source, typename Sink, typename... Transforms> class Pipeline {
+  public:
+    Pipeline(Source source, Sink sink, Transforms... transforms)
+        : source_(std::move(source)), sink_(std::move(sink)), transforms_(std::move(transforms)...) {}
+
+    /**
+     * Moves the whole image from the source through the transforms into the
+     * sink. The sink is aborted on any error. The read buffer is allocated on
+     * the heap, so a pipeline fits on a small stack such as app_main's.
+     */
+    esp_err_t run() {
+        std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[kReadSize]);
+        if (buffer == nullptr) {
+            return ESP_ERR_NO_MEM;
+        }
+        esp_err_t err = sink_.begin();
+        if (err != ESP_OK) {
+            return err;
+        }
+        for (;;) {
+            int n = source_.read(buffer.get(), kReadSize);
+            if (n <= 0) {
+                err = n == 0 ? ESP_OK : ESP_FAIL;
+                break;
+            }
+            err = push<0>(buffer.get(), static_cast<size_t>(n));
+            if (err != ESP_OK) {
+                break;
+            }
+        }
+        if (err == ESP_OK) {
+            err = flush<0>();
+        }
+        if (err != ESP_OK) {
+            sink_.abort();
+            return err;
+        }
+        return sink_.finish();
+    }
+
+    template <size_t I> auto &transform() { return std::get<I>(transforms_); }
+
+  private:
+    template <size_t I> esp_err_t push(const uint8_t *data, size_t len) {
+        if constexpr (I == sizeof...(Transforms)) {
+            return sink_.write(data, len);
+        } else {
+            return std::get<I>(transforms_).apply(
+                data, len, [this](const uint8_t *out, size_t out_len) { return push<I + 1>(out, out_len); });
+        }
+    }
+
+    /**
+     * Finishes the transforms in order; what a transform flushes passes
+     * through the later ones.
+     */
+    template <size_t I> esp_err_t flush() {
+        if constexpr (I == sizeof...(Transforms)) {
+            return ESP_OK;
+        } else {
+            esp_err_t err = std::get<I>(transforms_).finish(
+                [this](const uint8_t *out, size_t out_len) { return push<I + 1>(out, out_len); });
+            return err == ESP_OK ? flush<I + 1>() : err;
+        }
+    }
+
+    Source source_;
+    Sink sink_;
+    std::tuple<Transforms...> transforms_;
+};
+
+/**
+ * Downloads url through the C pipeline into the passive app partition and sets
+ * it as the boot partition. The caller decides when to reboot. A NULL cert_pem
+ * uses the component's CA certificates.
+ */
+inline esp_err_t update(const char *url, const char *cert_pem = nullptr, const char *manifest_json = nullptr,
+                        size_t manifest_len = 0) {
+    return Pipeline(HttpSource(url, cert_pem), SessionSink(manifest_json, manifest_len)).run();
+}
+
+} // namespace gecl::ota
+
+#endif // OTA_UPDATE_HPP
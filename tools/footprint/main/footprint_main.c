@@ -0,0 +1,46 @@
+/*
+ * Footprint Reference Application
+ * ===============================
+ *
+ * Built by tools/ota_size_budget.py in each budgeted configuration. Runs one
+ * push-style session that writes the first part of the running app into the
+ * passive slot and aborts it, then prints the peak heap the session used. No
+ * network is involved, so TLS and transport buffers are not included.
+ */
+
+#include "esp_heap_caps.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "gecl-ota-manager.h"
+#include <stdio.h>
+
+// Image bytes fed, enough for every buffer of the session to be in use
+#define FOOTPRINT_IMAGE_BYTES (256 * 1024)
+
+static uint8_t feed_buf[4096]; // Static, so it is not counted as session heap
+
+void app_main(void) {
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    init_ota_handler();
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    ESP_ERROR_CHECK(heap_caps_monitor_local_minimum_free_size_start());
+
+    ota_session_config_t config = {0};
+    ota_session_handle_t session = NULL;
+    esp_err_t err = ota_session_begin(&config, &session);
+    for (size_t offset = 0; err == ESP_OK && offset < FOOTPRINT_IMAGE_BYTES; offset += sizeof(feed_buf)) {
+        err = esp_partition_read(running, offset, feed_buf, sizeof(feed_buf));
+        if (err == ESP_OK) {
+            err = ota_session_feed(session, feed_buf, sizeof(feed_buf));
+        }
+    }
+    if (session != NULL) {
+        ota_session_abort(session);
+    }
+
+    size_t min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    heap_caps_monitor_local_minimum_free_size_stop();
+    printf("GECL_OTA_FOOTPRINT %s session_heap=%u\n", esp_err_to_name(err), (unsigned)(free_before - min_free));
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Minimal CoAP server serving a firmware image with Block2 transfers.
+
+A stand-in for a real CoAP server when testing the coap:// OTA source. It
+answers confirmable GETs for one resource with piggybacked block-wise
+responses, honours the client's block size and reports Size2. --loss drops
+requests and responses at random to exercise retransmission and block-size
+adaptation. DTLS is not supported; use a full server such as libcoap's
+coap-server for coaps://.
+
+    ota_coap_server.py firmware.bin --path ota/firmware.bin --loss 0.1
+"""
+
+import argparse
+import random
+import socket
+import struct
+
+CON, NON, ACK, RST = range(4)
+CONTENT = 0x45
+BAD_OPTION = 0x82
+NOT_FOUND = 0x84
+URI_PATH, URI_QUERY, BLOCK2, SIZE2 = 11, 15, 23, 28
+
+
+def parse(msg):
+    first, code, mid = struct.unpack_from("!BBH", msg)
+    tkl = first & 0x0F
+    token = msg[4:4 + tkl]
+    pos = 4 + tkl
+    number = 0
+    options = []
+    while pos < len(msg) and msg[pos] != 0xFF:
+        delta, length = msg[pos] >> 4, msg[pos] & 0x0F
+        pos += 1
+        ext = {13: (1, 13), 14: (2, 269)}
+        if delta in ext:
+            size, base = ext[delta]
+            delta = base + int.from_bytes(msg[pos:pos + size], "big")
+            pos += size
+        if length in ext:
+            size, base = ext[length]
+            length = base + int.from_bytes(msg[pos:pos + size], "big")
+            pos += size
+        number += delta
+        options.append((number, msg[pos:pos + length]))
+        pos += length
+    return (first >> 4) & 0x3, code, mid, token, options
+
+
+def encode_options(options):
+    out = b""
+    last = 0
+    for number, value in sorted(options, key=lambda o: o[0]):
+        delta, length = number - last, len(value)
+        last = number
+
+        def nibble(v):
+            return (v, b"") if v < 13 else (13, bytes([v - 13])) if v < 269 else (14, struct.pack("!H", v - 269))
+
+        d, dext = nibble(delta)
+        n, lext = nibble(length)
+        out += bytes([d << 4 | n]) + dext + lext + value
+    return out
+
+
+def uint_bytes(value):
+    return value.to_bytes((value.bit_length() + 7) // 8, "big")
+
+
+def respond(kind, code, mid, token, options=(), payload=b""):
+    header = struct.pack("!BBH", 0x40 | kind << 4 | len(token), code, mid) + token
+    return header + encode_options(options) + (b"\xff" + payload if payload else b"")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image")
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5683)
+    parser.add_argument("--path", default="firmware.bin", help="resource path, without the leading /")
+    parser.add_argument("--max-block-size", type=int, default=1024)
+    parser.add_argument("--loss", type=float, default=0.0, help="fraction of datagrams to drop each way")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    max_szx = args.max_block_size.bit_length() - 5
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.bind, args.port))
+    print(f"Serving {len(image)} bytes at coap://{args.bind}:{args.port}/{args.path}")
+
+    served = 0
+    while True:
+        msg, peer = sock.recvfrom(2048)
+        if random.random() < args.loss or len(msg) < 4:
+            continue
+        kind, code, mid, token, options = parse(msg)
+        if kind != CON or code != 0x01:
+            continue
+        path = "/".join(v.decode() for n, v in options if n == URI_PATH)
+        if path != args.path:
+            reply = respond(ACK, NOT_FOUND, mid, token)
+        else:
+            block = next((int.from_bytes(v, "big") for n, v in options if n == BLOCK2), 0)
+            num, szx = block >> 4, min(block & 0x7, max_szx)
+            size = 16 << szx
+            offset = (num << ((block & 0x7) + 4))  # The requested offset, at the client's block size
+            num = offset // size
+            if offset >= len(image) and len(image) > 0:
+                reply = respond(ACK, BAD_OPTION, mid, token)
+            else:
+                payload = image[offset:offset + size]
+                more = offset + size < len(image)
+                opts = [(BLOCK2, uint_bytes(num << 4 | more << 3 | szx))]
+                if any(n == SIZE2 for n, _ in options):
+                    opts.append((SIZE2, uint_bytes(len(image))))
+                reply = respond(ACK, CONTENT, mid, token, opts, payload)
+                served += 1
+                if not more:
+                    print(f"Last block served, {served} blocks in total")
+        if random.random() >= args.loss:
+            sock.sendto(reply, peer)
+
+
+if __name__ == "__main__":
+    main()
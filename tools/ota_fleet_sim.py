@@ -0,0 +1,426 @@
+#!/usr/bin/env python3
+"""Simulate a fleet rollout against a local origin and CDN stand-in.
+
+Runs hundreds of simulated devices on localhost. Each device fetches the
+manifest, the chunk map and the image over HTTP the way the OTA manager does:
+one after the other on the kept-alive connection of the session's image
+source, with one TCP and TLS handshake per session. A lost
+connection is resumed at once with an open-ended Range request. A corrupted
+chunk is re-fetched with a bounded one. Either counts against --chunk-retries,
+GECL_OTA_CHUNK_MAX_RETRIES on the device. A session that fails is retried by
+the application's --retry policy. Devices either start together on a broadcast
+trigger or poll at a random phase of --poll-interval, each plus up to --jitter
+seconds.
+
+The devices talk to the origin, or with --cache to a caching edge in front of
+it. "coalesce" makes concurrent misses for the same object share one origin
+request. Lists of strategies run one scenario each:
+
+    ota_fleet_sim.py --devices 300 --retry fixed,exponential --cache none,edge,coalesce
+    ota_fleet_sim.py --image build/app.bin --drop-rate 0.05 --speed 20
+
+Each scenario reports the origin's request count, peak request rate, peak
+concurrent connections and bytes served, and the completion-time distribution
+of the fleet. Times are simulated seconds: --speed runs the clock faster than
+real time.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import itertools
+import json
+import os
+import random
+import resource
+import socket
+import statistics
+import time
+
+MANIFEST_PATH = "/manifest.json"
+CHUNK_MAP_PATH = "/firmware.chunks"
+IMAGE_PATH = "/firmware.bin"
+READ_SIZE = 4096  # GECL_OTA_STREAM_BUFFER_SIZE default
+WRITE_SLICE = 16384  # Server writes, counted as served once the socket took them
+DEVICE_WINDOW = 5744  # lwIP TCP_WND default, what a device lets the server send ahead
+SERVER_SEND_BUFFER = 4096
+REQUEST_TIMEOUT_S = 10  # timeout_ms of the HTTP source
+
+
+class Clock:
+    """Simulated time, running --speed times faster than real time."""
+
+    def __init__(self, speed):
+        self.speed = speed
+        self.origin = time.monotonic()
+
+    def now(self):
+        return (time.monotonic() - self.origin) * self.speed
+
+    async def sleep(self, seconds):
+        if seconds > 0:
+            await asyncio.sleep(seconds / self.speed)
+
+
+class Stats:
+    def __init__(self):
+        self.requests = []  # Simulated times of the requests
+        self.connections = 0
+        self.peak_connections = 0
+        self.bytes = 0
+        self.rejected = 0
+
+
+class Server:
+    """Minimal HTTP/1.1 server with keep-alive and Range support. The origin
+    serves objects from memory; an edge serves them from fetch(path)."""
+
+    def __init__(self, clock, fetch, max_connections=0):
+        self.clock = clock
+        self.fetch = fetch
+        self.max_connections = max_connections
+        self.stats = Stats()
+
+    async def start(self):
+        self.server = await asyncio.start_server(self.handle, "127.0.0.1", 0, backlog=4096)
+        self.port = self.server.sockets[0].getsockname()[1]
+
+    async def handle(self, reader, writer):
+        # drain() waits until the socket took the data, and the socket takes
+        # little more than the client's window, so a dropped client stops the
+        # count close to the bytes it received
+        writer.transport.set_write_buffer_limits(0)
+        writer.get_extra_info("socket").setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, SERVER_SEND_BUFFER)
+        stats = self.stats
+        stats.connections += 1
+        stats.peak_connections = max(stats.peak_connections, stats.connections)
+        try:
+            while True:
+                request = await reader.readuntil(b"\r\n\r\n")
+                lines = request.decode().split("\r\n")
+                path = lines[0].split(" ")[1]
+                headers = dict(line.lower().split(": ", 1) for line in lines[1:] if ": " in line)
+                stats.requests.append(self.clock.now())
+
+                if self.max_connections and stats.connections > self.max_connections:
+                    stats.rejected += 1
+                    writer.write(b"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n")
+                    await writer.drain()
+                    break
+                body = await self.fetch(path)
+                if body is None:
+                    writer.write(b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n")
+                    await writer.drain()
+                    continue
+                if "range" in headers:
+                    first, _, last = headers["range"][len("bytes="):].partition("-")
+                    first, last = int(first), min(int(last) if last else len(body) - 1, len(body) - 1)
+                    writer.write(b"HTTP/1.1 206 Partial Content\r\nContent-Length: %d\r\n"
+                                 b"Content-Range: bytes %d-%d/%d\r\n\r\n" % (last - first + 1, first, last, len(body)))
+                    body = body[first:last + 1]
+                else:
+                    writer.write(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n" % len(body))
+                # drain() raises once the client has dropped the connection
+                for offset in range(0, len(body), WRITE_SLICE):
+                    piece = body[offset:offset + WRITE_SLICE]
+                    writer.write(piece)
+                    await writer.drain()
+                    stats.bytes += len(piece)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            stats.connections -= 1
+            writer.close()
+
+
+class Edge:
+    """Caching edge: misses go to the origin, hits are served from memory for
+    ttl seconds. With coalesce, concurrent misses wait for one origin fetch."""
+
+    def __init__(self, clock, origin_port, ttl, coalesce):
+        self.clock = clock
+        self.origin_port = origin_port
+        self.ttl = ttl
+        self.coalesce = coalesce
+        self.cache = {}  # path: (time, body)
+        self.inflight = {}  # path: future
+
+    async def fetch(self, path):
+        cached = self.cache.get(path)
+        if cached is not None and self.clock.now() - cached[0] < self.ttl:
+            return cached[1]
+        if self.coalesce and path in self.inflight:
+            return await asyncio.shield(self.inflight[path])
+
+        future = asyncio.get_running_loop().create_future()
+        if self.coalesce:
+            self.inflight[path] = future
+        try:
+            conn = Connection(self.origin_port, self.clock)
+            status, body = await conn.get(path)
+            await conn.close()
+            body = body if status == 200 else None
+            if body is not None:
+                self.cache[path] = (self.clock.now(), body)
+        except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError):
+            body = None
+        future.set_result(body)
+        self.inflight.pop(path, None)
+        return body
+
+
+class Connection:
+    """HTTP client connection of one device, kept alive across requests. window
+    limits the receive buffer like the device's TCP window."""
+
+    def __init__(self, port, clock, window=None):
+        self.port = port
+        self.clock = clock
+        self.window = window
+        self.reader = self.writer = None
+        self.remaining = 0  # Unread body bytes of the current response
+
+    async def request(self, path, first=0, last=None):
+        if self.writer is not None and self.remaining:
+            await self.close()  # Dropping a body means dropping the connection
+        if self.writer is None:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            if self.window:
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, self.window)  # Before connect, for the window
+            sock.setblocking(False)
+            try:
+                await asyncio.get_running_loop().sock_connect(sock, ("127.0.0.1", self.port))
+            except OSError:
+                sock.close()
+                raise
+            self.reader, self.writer = await asyncio.open_connection(sock=sock, limit=READ_SIZE)
+        ranged = first != 0 or last is not None
+        header = "Range: bytes=%d-%s\r\n" % (first, "" if last is None else last) if ranged else ""
+        self.writer.write(("GET %s HTTP/1.1\r\nHost: origin\r\n%s\r\n" % (path, header)).encode())
+        response = await asyncio.wait_for(self.reader.readuntil(b"\r\n\r\n"), REQUEST_TIMEOUT_S / self.clock.speed)
+        lines = response.decode().split("\r\n")
+        headers = dict(line.lower().split(": ", 1) for line in lines[1:] if ": " in line)
+        self.remaining = int(headers.get("content-length", 0))
+        return int(lines[0].split(" ")[1])
+
+    async def read(self, size):
+        data = await asyncio.wait_for(self.reader.read(min(size, self.remaining)),
+                                      REQUEST_TIMEOUT_S / self.clock.speed)
+        if not data:
+            raise ConnectionResetError("connection closed")
+        self.remaining -= len(data)
+        return data
+
+    async def get(self, path):
+        status = await self.request(path)
+        body = bytearray()
+        while self.remaining:
+            body += await self.read(self.remaining)
+        return status, bytes(body)
+
+    async def close(self):
+        if self.writer is not None:
+            self.writer.close()
+        self.reader = self.writer = None
+        self.remaining = 0
+
+
+class Device:
+    def __init__(self, args, clock, port, rng):
+        self.args = args
+        self.clock = clock
+        self.port = port
+        self.rng = rng
+        self.attempts = 0
+        self.finished = None  # Simulated completion time
+
+    async def pace(self, n):
+        await self.clock.sleep(n / (self.args.link_kbps * 1024))
+
+    async def session(self):
+        """One update session; returns True when the image was installed."""
+        conn = Connection(self.port, self.clock, DEVICE_WINDOW)  # Manifest, chunk map and image
+        try:
+            if not self.args.no_manifest:
+                status, body = await conn.get(MANIFEST_PATH)
+                if status != 200:
+                    return False
+                manifest = json.loads(body)
+                status, chunk_map = await conn.get(CHUNK_MAP_PATH)
+                if status != 200:
+                    return False
+                await self.pace(len(body) + len(chunk_map))
+                size, chunk_size = manifest["size"], manifest["chunk_size"]
+            else:
+                size, chunk_size = None, self.args.chunk_size
+
+            pos = 0
+            retries = 0
+            retry_chunk = 0
+            drop_at = self.drop_point(0, chunk_size)
+            if await conn.request(IMAGE_PATH) != 200:
+                return False
+            size = size or conn.remaining
+            while pos < size:
+                try:
+                    if not conn.remaining:
+                        if await conn.request(IMAGE_PATH, pos) != 206:
+                            return False
+                    n = len(await conn.read(min(READ_SIZE, drop_at - pos if drop_at is not None else READ_SIZE)))
+                    await self.pace(n)
+                    if drop_at is not None and pos + n >= drop_at:
+                        drop_at = None
+                        raise ConnectionResetError("dropped")
+                except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError):
+                    await conn.close()
+                    retries += 1
+                    if retries > self.args.chunk_retries:
+                        return False
+                    continue  # Resumed by the next read
+
+                chunk = pos // chunk_size
+                pos += n
+                if pos // chunk_size != chunk or pos == size:  # Chunk complete
+                    while self.rng.random() < self.args.corrupt_rate:
+                        retries += 1
+                        if retries > self.args.chunk_retries:
+                            return False
+                        start = chunk * chunk_size
+                        if await conn.request(IMAGE_PATH, start, min(start + chunk_size, size) - 1) != 206:
+                            return False
+                        while conn.remaining:
+                            await self.pace(len(await conn.read(READ_SIZE)))
+                    if pos // chunk_size != retry_chunk:
+                        retry_chunk = pos // chunk_size
+                        retries = 0
+                    drop_at = self.drop_point(pos // chunk_size * chunk_size, chunk_size)
+            return True
+        except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, ValueError):
+            return False
+        finally:
+            await conn.close()
+
+    def drop_point(self, chunk_start, chunk_size):
+        if self.rng.random() < self.args.drop_rate:
+            return chunk_start + self.rng.randrange(1, chunk_size)
+        return None
+
+    def retry_delay(self, attempt):
+        args = self.args
+        delay = args.retry_delay * (2 ** (attempt - 1) if args.retry == "exponential" else 1)
+        delay = min(delay, args.retry_max_delay)
+        return delay * (1 - args.retry_jitter * self.rng.random())
+
+    async def run(self, trigger):
+        await self.clock.sleep(self.rng.uniform(0, self.args.poll_interval) if trigger == "poll" else 0)
+        await self.clock.sleep(self.rng.uniform(0, self.args.jitter))
+        while True:
+            self.attempts += 1
+            if await self.session():
+                self.finished = self.clock.now()
+                return
+            if self.args.retry == "none" or self.attempts >= self.args.max_attempts:
+                return
+            await self.clock.sleep(self.retry_delay(self.attempts))
+
+
+def make_objects(image, chunk_size):
+    leaves = [hashlib.sha256(b"\x00" + image[i:i + chunk_size]).digest() for i in range(0, len(image), chunk_size)]
+    level = leaves
+    while len(level) > 1:
+        level = [hashlib.sha256(b"\x01" + level[i] + level[i + 1]).digest() if i + 1 < len(level) else level[i]
+                 for i in range(0, len(level), 2)]
+    manifest = {"version": "sim", "image": IMAGE_PATH[1:], "size": len(image),
+                "sha256": hashlib.sha256(image).hexdigest(), "chunk_size": chunk_size,
+                "merkle_root": level[0].hex(), "chunk_map": CHUNK_MAP_PATH[1:]}
+    return {MANIFEST_PATH: json.dumps(manifest).encode(), CHUNK_MAP_PATH: b"".join(leaves), IMAGE_PATH: image}
+
+
+async def scenario(args, objects, trigger, retry, cache):
+    clock = Clock(args.speed)
+
+    async def serve(path):
+        return objects.get(path)
+
+    origin = Server(clock, serve, args.origin_max_connections)
+    await origin.start()
+    port = origin.port
+    if cache != "none":
+        edge = Edge(clock, origin.port, args.cache_ttl, cache == "coalesce")
+        edge_server = Server(clock, edge.fetch)
+        await edge_server.start()
+        port = edge_server.port
+
+    scenario_args = argparse.Namespace(**vars(args))
+    scenario_args.retry = retry
+    rng = random.Random(args.seed)
+    devices = [Device(scenario_args, clock, port, random.Random(rng.random())) for _ in range(args.devices)]
+    await asyncio.gather(*(device.run(trigger) for device in devices))
+    origin.server.close()
+    if cache != "none":
+        edge_server.server.close()
+
+    stats = origin.stats
+    per_second = {}
+    for t in stats.requests:
+        per_second[int(t)] = per_second.get(int(t), 0) + 1
+    times = sorted(device.finished for device in devices if device.finished is not None)
+
+    def quantile(q):
+        return "%.1f" % times[min(len(times) - 1, int(len(times) * q))] if times else "-"
+
+    return ("| %s | %s | %s | %d | %d | %d | %d | %.1f | %s | %s | %s | %s | %d | %.2f |" % (
+        trigger, retry, cache, len(stats.requests), max(per_second.values(), default=0), stats.peak_connections,
+        stats.rejected, stats.bytes / 1024 / 1024, quantile(0.5), quantile(0.9), quantile(0.99),
+        "%.1f" % times[-1] if times else "-", args.devices - len(times),
+        statistics.mean(device.attempts for device in devices)))
+
+
+async def run(args, objects):
+    print("| Trigger | Retry | Cache | Origin requests | Peak req/s | Peak connections | Rejected | Origin MB | "
+          "p50 s | p90 s | p99 s | Max s | Failed | Attempts |")
+    print("|---|---|---|" + "---:|" * 11)
+    for trigger, retry, cache in itertools.product(args.trigger.split(","), args.retry.split(","),
+                                                   args.cache.split(",")):
+        print(await scenario(args, objects, trigger, retry, cache), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--devices", type=int, default=200)
+    parser.add_argument("--image", help="image to serve, random bytes of --size without")
+    parser.add_argument("--size", type=int, default=1024 * 1024)
+    parser.add_argument("--chunk-size", type=int, default=16384, help="manifest chunk size")
+    parser.add_argument("--no-manifest", action="store_true", help="download the image without a manifest")
+    parser.add_argument("--link-kbps", type=float, default=100, help="per-device link rate in KB/s")
+    parser.add_argument("--trigger", default="broadcast", help="broadcast or poll, comma-separated")
+    parser.add_argument("--poll-interval", type=float, default=3600, help="seconds between device polls")
+    parser.add_argument("--jitter", type=float, default=0, help="random start delay in seconds")
+    parser.add_argument("--retry", default="fixed", help="none, fixed or exponential, comma-separated")
+    parser.add_argument("--retry-delay", type=float, default=30, help="first retry delay in seconds")
+    parser.add_argument("--retry-max-delay", type=float, default=3600)
+    parser.add_argument("--retry-jitter", type=float, default=0, help="fraction of each delay randomized, 0 to 1")
+    parser.add_argument("--max-attempts", type=int, default=5, help="update sessions per device")
+    parser.add_argument("--chunk-retries", type=int, default=3, help="GECL_OTA_CHUNK_MAX_RETRIES of the devices")
+    parser.add_argument("--drop-rate", type=float, default=0, help="probability a chunk loses the connection")
+    parser.add_argument("--corrupt-rate", type=float, default=0, help="probability a chunk fails verification")
+    parser.add_argument("--cache", default="none", help="none, edge or coalesce, comma-separated")
+    parser.add_argument("--cache-ttl", type=float, default=300, help="edge cache lifetime in seconds")
+    parser.add_argument("--origin-max-connections", type=int, default=0,
+                        help="origin answers 503 beyond this many connections, 0 for no limit")
+    parser.add_argument("--speed", type=float, default=1, help="simulated seconds per real second")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    # Each device holds a connection, and so does the edge or origin side of it
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    wanted = 4 * args.devices + 64
+    if soft < wanted:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(wanted, hard), hard))
+
+    image = open(args.image, "rb").read() if args.image else os.urandom(args.size)
+    asyncio.run(run(args, make_objects(image, args.chunk_size)))
+
+
+if __name__ == "__main__":
+    main()
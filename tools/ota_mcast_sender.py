@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""Stream a firmware image to a multicast group for the mcast:// OTA source.
+
+The image is sent as groups of k data blocks followed by one XOR parity block,
+repeated in a carousel. --loss drops datagrams at random to simulate a lossy
+network. The receive subcommand runs the device's reassembly logic on the
+host, so the whole path can be tested on Linux loopback multicast:
+
+    ota_mcast_sender.py send firmware.bin --loss 0.05 --loops 3 &
+    ota_mcast_sender.py receive firmware.bin
+
+The receiver reports the blocks it had to fetch from the fallback, which it
+reads from the local copy of the image, and checks the result's SHA-256.
+"""
+
+import argparse
+import hashlib
+import random
+import socket
+import struct
+import time
+
+MAGIC = b"GMCF"
+HEADER = struct.Struct("<4sIIHBB")
+
+
+def blocks_of(image, block_size, k):
+    """Yields (group, index, payload) for every datagram of one carousel pass."""
+    group_len = block_size * k
+    for group, start in enumerate(range(0, len(image), group_len)):
+        parity = bytearray(block_size)
+        for index in range(k):
+            offset = start + index * block_size
+            if offset >= len(image):
+                break  # Implied zero blocks are never sent
+            block = image[offset:offset + block_size].ljust(block_size, b"\0")
+            parity = bytearray(a ^ b for a, b in zip(parity, block))
+            yield group, index, block
+        yield group, k, bytes(parity)
+
+
+def send(args):
+    image = open(args.image, "rb").read()
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+    if args.interface:
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+
+    interval = args.block_size * 8 / (args.rate_kbps * 1000)
+    sent = dropped = 0
+    for loop in range(args.loops):
+        for group, index, payload in blocks_of(image, args.block_size, args.k):
+            if random.random() >= args.loss:
+                header = HEADER.pack(MAGIC, len(image), group, args.block_size, args.k, index)
+                sock.sendto(header + payload, (args.group, args.port))
+            else:
+                dropped += 1
+            sent += 1
+            time.sleep(interval)
+        print(f"Pass {loop + 1}/{args.loops} done, {dropped} of {sent} datagrams dropped")
+
+
+def receive(args):
+    image = open(args.image, "rb").read() if args.image else None
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", args.port))
+    mreq = socket.inet_aton(args.group) + socket.inet_aton(args.interface or "0.0.0.0")
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    sock.settimeout(args.timeout)
+
+    groups = {}
+    size = block_size = k = None
+    current = 0
+    out = bytearray()
+    recovered = fetched = 0
+    while size is None or len(out) < size:
+        try:
+            data = sock.recv(2048)
+            magic, pkt_size, group, pkt_block, pkt_k, index = HEADER.unpack_from(data)
+            if magic != MAGIC or len(data) != HEADER.size + pkt_block:
+                continue
+            if size is None:
+                size, block_size, k = pkt_size, pkt_block, pkt_k
+            if current <= group < current + args.window:
+                groups.setdefault(group, {})[index] = data[HEADER.size:]
+            overrun = group >= current + args.window
+        except socket.timeout:
+            if size is None:
+                raise SystemExit("No datagrams received")
+            overrun = True
+
+        # Deliver every group that is complete, or force the current one on overrun
+        while size is not None and len(out) < size:
+            start = current * k * block_size
+            data_count = min(k, -(-(size - start) // block_size))
+            blocks = groups.get(current, {})
+            missing = [i for i in range(data_count) if i not in blocks]
+            if len(missing) == 1 and k in blocks:
+                rebuilt = bytearray(blocks[k])
+                for i in range(data_count):
+                    if i != missing[0]:
+                        rebuilt = bytearray(a ^ b for a, b in zip(rebuilt, blocks[i]))
+                blocks[missing[0]] = bytes(rebuilt)
+                recovered += 1
+                missing = []
+            if missing and not overrun:
+                break
+            for i in missing:
+                if image is None:
+                    raise SystemExit(f"Group {current} incomplete and no fallback image given")
+                offset = start + i * block_size
+                blocks[i] = image[offset:offset + block_size].ljust(block_size, b"\0")
+                fetched += 1
+            group_data = b"".join(blocks[i] for i in range(data_count))
+            out += group_data[:size - start]
+            groups.pop(current, None)
+            current += 1
+            overrun = False
+
+    digest = hashlib.sha256(out).hexdigest()
+    print(f"Received {size} bytes, {recovered} blocks rebuilt from parity, {fetched} fetched from fallback")
+    print(f"SHA-256 {digest}" + ("" if image is None else (" matches" if out == image else " MISMATCH")))
+    if image is not None and out != image:
+        raise SystemExit(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--group", default="239.255.42.1")
+    parser.add_argument("--port", type=int, default=5007)
+    parser.add_argument("--interface", help="local interface address, e.g. 127.0.0.1 for loopback tests")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("send", help="stream an image in a carousel")
+    p.add_argument("image")
+    p.add_argument("--block-size", type=int, default=1024, help="bytes per datagram payload, at most 1456")
+    p.add_argument("--k", type=int, default=8, help="data blocks per parity block, at most 31")
+    p.add_argument("--loops", type=int, default=3, help="carousel passes")
+    p.add_argument("--rate-kbps", type=float, default=2000)
+    p.add_argument("--loss", type=float, default=0.0, help="fraction of datagrams to drop")
+    p.add_argument("--ttl", type=int, default=1)
+    p.set_defaults(func=send)
+
+    p = sub.add_parser("receive", help="reassemble like a device does, for host testing")
+    p.add_argument("image", nargs="?", help="local copy of the image, used as the fallback and to check the result")
+    p.add_argument("--window", type=int, default=4, help="same as GECL_OTA_MCAST_WINDOW")
+    p.add_argument("--timeout", type=float, default=3.0, help="same as GECL_OTA_MCAST_TIMEOUT_MS, in seconds")
+    p.set_defaults(func=receive)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""Serve a firmware image to one device over the MQTT OTA transport.
+
+Publishes the manifest (chunk map inline) to <base>/manifest, then streams the
+image to <base>/data while honouring the device's windowed acks on <base>/ack.
+Works against any broker, including a local mosquitto instance.
+
+    ota_mqtt_sender.py --broker localhost --base gecl/ota/a0b1c2d3e4f5 firmware.bin
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import threading
+
+import paho.mqtt.client as mqtt
+
+MAGIC = b"GOTA"
+
+
+def merkle_leaves(image, chunk_size):
+    return [hashlib.sha256(b"\x00" + image[i:i + chunk_size]).digest() for i in range(0, len(image), chunk_size)]
+
+
+def merkle_root(leaves):
+    level = list(leaves)
+    while len(level) > 1:
+        nxt = [hashlib.sha256(b"\x01" + level[i] + level[i + 1]).digest() for i in range(0, len(level) - 1, 2)]
+        if len(level) % 2:
+            nxt.append(level[-1])
+        level = nxt
+    return level[0]
+
+
+class Sender:
+    def __init__(self, client, base, image, message_size):
+        self.client = client
+        self.base = base
+        self.image = image
+        self.message_size = message_size
+        self.cond = threading.Condition()
+        self.acked = None  # Offset the device expects next
+        self.window = 1
+        self.rewound = False
+
+    def on_ack(self, _client, _userdata, msg):
+        ack = json.loads(msg.payload)
+        with self.cond:
+            if self.acked is not None and ack["next"] <= self.acked:  # Non-advancing ack asks for a resend
+                self.rewound = True
+            self.acked = ack["next"]
+            self.window = ack["window"]
+            self.cond.notify()
+
+    def run(self):
+        seq = 0
+        offset = None
+        while True:
+            with self.cond:
+                while self.acked is None or (
+                        offset is not None and not self.rewound and
+                        (offset >= len(self.image) or offset - self.acked >= self.window * self.message_size)):
+                    if self.acked is not None and self.acked >= len(self.image):
+                        return
+                    self.cond.wait(timeout=1.0)
+                if offset is None or self.rewound or offset < self.acked:
+                    offset = self.acked
+                    self.rewound = False
+            payload = self.image[offset:offset + self.message_size]
+            header = MAGIC + struct.pack("<III", seq, offset, len(payload))
+            self.client.publish(f"{self.base}/data", header + payload, qos=1)
+            seq += 1
+            offset += len(payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image")
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--base", required=True, help="device topic base, e.g. gecl/ota/<mac>")
+    parser.add_argument("--version", default="")
+    parser.add_argument("--chunk-size", type=int, default=16384, help="verified chunk size")
+    parser.add_argument("--message-size", type=int, default=4096, help="image bytes per data message")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    leaves = merkle_leaves(image, args.chunk_size)
+    manifest = {
+        "version": args.version,
+        "size": len(image),
+        "sha256": hashlib.sha256(image).hexdigest(),
+        "chunk_size": args.chunk_size,
+        "merkle_root": merkle_root(leaves).hex(),
+        "leaves": b"".join(leaves).hex(),
+    }
+
+    client = mqtt.Client()
+    sender = Sender(client, args.base, image, args.message_size)
+    client.message_callback_add(f"{args.base}/ack", sender.on_ack)
+    client.connect(args.broker, args.port)
+    client.subscribe(f"{args.base}/ack", qos=1)
+    client.loop_start()
+    client.publish(f"{args.base}/manifest", json.dumps(manifest), qos=1, retain=True).wait_for_publish()
+    print(f"Serving {len(image)} bytes on {args.base}/data")
+    sender.run()
+    client.publish(f"{args.base}/manifest", b"", qos=1, retain=True).wait_for_publish()
+    client.loop_stop()
+    print("Device acknowledged the whole image")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,335 @@
+#!/usr/bin/env python3
+"""Run LAN peer-to-peer distribution with simulated devices on loopback.
+
+Each simulated device follows gecl-ota-p2p.c and run_update(): it announces
+itself on the discovery port during the election window, the lowest MAC
+becomes the leader, installs from a local origin and serves the image with
+Range support, and the others wait for its HAVE announcement, download from
+it and verify every chunk against the manifest. A chunk that fails is
+re-fetched with a Range request up to --chunk-retries times, after which the
+device falls back to the origin, as does a device that hears no leader
+within --wait.
+
+    ota_p2p_sim.py --devices 8
+    ota_p2p_sim.py --devices 8 --late 2 --image build/app.bin
+    ota_p2p_sim.py --devices 4 --faulty-leader
+
+--late devices start after the election window and must join as peers.
+--faulty-leader corrupts one byte per served chunk, which peers must reject.
+The run checks that exactly one device led, that every device installed an
+image with the manifest's SHA-256, and without --faulty-leader that the
+origin served the image once. It exits with status 1 when a check fails.
+Devices announce to --broadcast, 127.255.255.255 to stay on loopback.
+"""
+
+import argparse
+import hashlib
+import http.client
+import os
+import random
+import socket
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+MAGIC = "GOTA-P2P"
+ANNOUNCE_INTERVAL_S = 0.5  # P2P_ANNOUNCE_INTERVAL_US
+
+
+def leaf(chunk):
+    return hashlib.sha256(b"\x00" + chunk).digest()
+
+
+class ImageServer(ThreadingHTTPServer):
+    """Serves one image at path with Range support and a Content-Length, as
+    the origin or as a leader. corrupt flips a byte in every chunk."""
+
+    daemon_threads = True
+
+    def __init__(self, bind, image, path, chunk_size, corrupt=False):
+        self.image = image
+        self.path = path
+        self.chunk_size = chunk_size
+        self.corrupt = corrupt
+        self.bytes = 0
+        self.requests = 0
+        self.lock = threading.Lock()
+        super().__init__((bind, 0), ImageHandler)
+
+    def body(self, first, last):
+        data = self.image[first:last + 1]
+        if not self.corrupt:
+            return data
+        data = bytearray(data)
+        for offset in range(-first % self.chunk_size, len(data), self.chunk_size):
+            data[offset] ^= 0xFF
+        return bytes(data)
+
+    def handle_error(self, request, client_address):
+        pass  # Peers drop the connection after a chunk fails
+
+
+class ImageHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        server = self.server
+        image = server.image
+        with server.lock:
+            server.requests += 1
+        if self.path != server.path:
+            self.send_error(404)
+            return
+        first, last = 0, len(image) - 1
+        header = self.headers.get("Range")
+        if header:
+            start, _, end = header[len("bytes="):].partition("-")
+            first = int(start)
+            if first >= len(image):
+                self.send_response(416)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            if end:
+                last = min(int(end), last)
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, len(image)))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(last - first + 1))
+        self.end_headers()
+        body = server.body(first, last)
+        for offset in range(0, len(body), server.chunk_size):
+            try:
+                self.wfile.write(body[offset:offset + server.chunk_size])
+            except OSError:
+                return
+            with server.lock:
+                server.bytes += len(body[offset:offset + server.chunk_size])
+
+    def log_message(self, *args):
+        pass
+
+
+class Device:
+    def __init__(self, fleet, mac):
+        self.fleet = fleet
+        self.mac = mac
+        self.role = None
+        self.source = None
+        self.rejected = 0  # Chunks that failed verification
+        self.installed = None
+        self.announcement = None
+        self.server = None
+
+    # Discovery, as in gecl-ota-p2p.c
+
+    def open_socket(self):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.settimeout(0.1)
+        self.sock.bind(("", self.fleet.args.discovery_port))
+        self.announcing = True
+        threading.Thread(target=self.announcer, daemon=True).start()
+
+    def close_socket(self):
+        self.announcing = False
+        self.announcement = None
+        self.sock.close()
+
+    def announcer(self):
+        while self.announcing:
+            message = self.announcement
+            if message is not None:
+                try:
+                    self.sock.sendto(message.encode(), (self.fleet.args.broadcast, self.fleet.args.discovery_port))
+                except OSError:
+                    return
+            time.sleep(ANNOUNCE_INTERVAL_S)
+
+    def announce(self, kind, port=None):
+        self.announcement = "%s %s %s %s%s" % (MAGIC, kind, self.fleet.image_id, self.mac,
+                                               "" if port is None else " %d" % port)
+
+    def receive(self):
+        """Returns (type, mac, port, address) of an announcement for our
+        image from another device, or None."""
+        try:
+            data, address = self.sock.recvfrom(96)
+        except (socket.timeout, OSError):
+            return None
+        fields = data.decode(errors="replace").split()
+        if len(fields) < 4 or fields[0] != MAGIC or fields[2] != self.fleet.image_id or fields[3] == self.mac:
+            return None
+        port = int(fields[4]) if len(fields) > 4 and fields[4].isdigit() else 0
+        return fields[1], fields[3], port, address[0]
+
+    def elect(self):
+        args = self.fleet.args
+        self.open_socket()
+        lowest = self.mac
+        leader_seen = False
+        self.announce("WANT")
+        deadline = time.monotonic() + args.election_ms / 1000
+        while time.monotonic() < deadline and not leader_seen:
+            announcement = self.receive()
+            if announcement is None:
+                continue
+            kind, mac, _, _ = announcement
+            if kind in ("LEAD", "HAVE"):
+                leader_seen = True  # Joined late, an elected leader already exists
+            elif kind == "WANT" and mac < lowest:
+                lowest = mac
+
+        if not leader_seen and lowest == self.mac:
+            self.announce("LEAD")
+            return "leader", None
+
+        self.announcement = None  # Peers stay silent while waiting
+        deadline = time.monotonic() + args.wait
+        while time.monotonic() < deadline:
+            announcement = self.receive()
+            if announcement is not None and announcement[0] == "HAVE" and announcement[2] > 0:
+                _, mac, port, address = announcement
+                self.close_socket()
+                return "peer", "http://%s:%d/ota/%s.bin" % (address, port, self.fleet.image_id)
+        self.close_socket()
+        return "origin", None
+
+    # Install, as run_update() and the verify/write pipeline
+
+    def install(self, url):
+        """Downloads url, verifying each chunk and re-fetching failed ones.
+        Returns the image, or None when a chunk kept failing."""
+        fleet = self.fleet
+        chunk_size = fleet.args.chunk_size
+        host, _, rest = url[len("http://"):].partition("/")
+        address, _, port = host.partition(":")
+        path = "/" + rest
+        image = bytearray()
+        try:
+            conn = http.client.HTTPConnection(address, int(port), timeout=10)
+            conn.request("GET", path)
+            response = conn.getresponse()
+            if response.status != 200 or response.getheader("Content-Length") is None:
+                return None
+            for index, expected in enumerate(fleet.leaves):
+                chunk = response.read(min(chunk_size, len(fleet.image) - len(image)))
+                for _ in range(fleet.args.chunk_retries):
+                    if leaf(chunk) == expected:
+                        break
+                    self.rejected += 1
+                    first = index * chunk_size
+                    ranged = http.client.HTTPConnection(address, int(port), timeout=10)
+                    ranged.request("GET", path, headers={"Range": "bytes=%d-%d" % (first, first + len(chunk) - 1)})
+                    chunk = ranged.getresponse().read()
+                    ranged.close()
+                if leaf(chunk) != expected:
+                    self.rejected += 1
+                    conn.close()
+                    return None
+                image += chunk
+            conn.close()
+        except (OSError, http.client.HTTPException):
+            return None
+        return bytes(image)
+
+    def serve(self):
+        args = self.fleet.args
+        self.server = ImageServer(args.bind, self.installed, "/ota/%s.bin" % self.fleet.image_id, args.chunk_size,
+                                  corrupt=args.faulty_leader)
+        threading.Thread(target=self.server.serve_forever, daemon=True).start()
+        self.announce("HAVE", self.server.server_address[1])
+        time.sleep(args.serve)
+        self.announcement = None
+        self.server.shutdown()
+        self.server.server_close()
+        self.close_socket()
+
+    def run(self):
+        self.role, peer_url = self.elect()
+        if self.role == "peer":
+            self.installed = self.install(peer_url)
+            self.source = "leader" if self.installed is not None else None
+        if self.installed is None:
+            self.installed = self.install(self.fleet.origin_url)
+            self.source = "origin" if self.installed is not None else "failed"
+        if self.role == "leader":
+            if self.installed is not None:
+                self.serve()
+            else:
+                self.close_socket()
+
+
+class Fleet:
+    def __init__(self, args, image):
+        self.args = args
+        self.image = image
+        self.image_id = hashlib.sha256(image).hexdigest()[:16]
+        self.leaves = [leaf(image[i:i + args.chunk_size]) for i in range(0, len(image), args.chunk_size)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--devices", type=int, default=8, help="devices starting together")
+    parser.add_argument("--late", type=int, default=0, help="devices starting after the election window")
+    parser.add_argument("--image", help="image to distribute, default random bytes")
+    parser.add_argument("--size", type=int, default=256 * 1024, help="size of the random image")
+    parser.add_argument("--chunk-size", type=int, default=16384)
+    parser.add_argument("--chunk-retries", type=int, default=3, help="same as GECL_OTA_CHUNK_MAX_RETRIES")
+    parser.add_argument("--election-ms", type=int, default=1500, help="same as GECL_OTA_P2P_ELECTION_MS")
+    parser.add_argument("--wait", type=float, default=10, help="same as GECL_OTA_P2P_WAIT_S")
+    parser.add_argument("--serve", type=float, default=5, help="same as GECL_OTA_P2P_SERVE_S")
+    parser.add_argument("--discovery-port", type=int, default=47474, help="same as GECL_OTA_P2P_DISCOVERY_PORT")
+    parser.add_argument("--broadcast", default="127.255.255.255")
+    parser.add_argument("--bind", default="127.0.0.1", help="address the origin and leaders listen on")
+    parser.add_argument("--faulty-leader", action="store_true", help="leaders serve corrupted chunks")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read() if args.image else os.urandom(args.size)
+    fleet = Fleet(args, image)
+    origin = ImageServer(args.bind, image, "/firmware.bin", args.chunk_size)
+    threading.Thread(target=origin.serve_forever, daemon=True).start()
+    fleet.origin_url = "http://%s:%d/firmware.bin" % (args.bind, origin.server_address[1])
+
+    macs = random.sample(range(1 << 24), args.devices + args.late)
+    devices = [Device(fleet, "240ac4%06x" % mac) for mac in macs]
+    threads = [threading.Thread(target=device.run) for device in devices]
+    for thread in threads[:args.devices]:
+        thread.start()
+    time.sleep(args.election_ms / 1000 + 0.5)
+    for thread in threads[args.devices:]:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    origin.shutdown()
+
+    print("%d devices, %d late, image %s, %d bytes" % (args.devices, args.late, fleet.image_id, len(image)))
+    for index, device in enumerate(devices):
+        print("  %s %-6s %-6s from %-6s %d chunks rejected%s" % (
+            device.mac, device.role, "late" if index >= args.devices else "", device.source, device.rejected,
+            ", served %d bytes" % device.server.bytes if device.server is not None else ""))
+    print("Origin served %d bytes in %d requests" % (origin.bytes, origin.requests))
+
+    digest = hashlib.sha256(image).digest()
+    failures = []
+    leaders = [device for device in devices if device.role == "leader"]
+    if len(leaders) != 1:
+        failures.append("%d leaders elected" % len(leaders))
+    if any(device.installed is None or hashlib.sha256(device.installed).digest() != digest for device in devices):
+        failures.append("a device did not install the image")
+    if not args.faulty_leader and origin.bytes != len(image):
+        failures.append("origin served %d bytes for a %d byte image" % (origin.bytes, len(image)))
+    if args.faulty_leader and any(device.source == "leader" for device in devices):
+        failures.append("a peer accepted a corrupted image")
+    for failure in failures:
+        print("FAIL: " + failure)
+    if not failures:
+        print("OK")
+    raise SystemExit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""Package an ESP-IDF app image for manifest-verified OTA updates.
+
+Writes the image, its chunk map and a manifest.json in the format the device
+reads (see gecl-ota-manifest.c), plus a chunk map per --partition image, and
+prints the expected transfer size of each download strategy:
+
+    ota_package.py build/app.bin --out dist --partition assets=build/assets.bin
+    ota_package.py build/app.bin --out dist --previous releases/1.4.1.bin --sign-key manifest_key.pem
+
+The version defaults to the one in the image's app descriptor. --inline-leaves
+carries the chunk map in the manifest instead, as the MQTT transport needs.
+--sign-key writes a detached SHA-256 signature of the manifest to
+manifest.json.sig, made with openssl from a PEM private key.
+
+--previous names earlier release images. The strategies compared are the full
+image, the image compressed with zlib and LZMA, a delta against each previous
+release (block-matched copies and literals, LZMA-compressed), and only the
+chunks whose leaf differs from the previous release. --variants also writes
+the compressed images and delta patches. The device installs the full image
+only; the variants show whether compression or deltas would pay off on the
+device before that is built.
+"""
+
+import argparse
+import hashlib
+import json
+import lzma
+import os
+import struct
+import subprocess
+import zlib
+
+APP_DESC_MAGIC = 0xABCD5432
+APP_DESC_OFFSET = 32  # After the image header and the first segment header
+DELTA_MAGIC = b"GDLT"
+DELTA_BLOCK = 64
+DELTA_ALIGN = 4
+
+
+def merkle_leaves(image, chunk_size):
+    return [hashlib.sha256(b"\x00" + image[i:i + chunk_size]).digest() for i in range(0, len(image), chunk_size)]
+
+
+def merkle_root(leaves):
+    level = list(leaves)
+    while len(level) > 1:
+        nxt = [hashlib.sha256(b"\x01" + level[i] + level[i + 1]).digest() for i in range(0, len(level) - 1, 2)]
+        if len(level) % 2:
+            nxt.append(level[-1])
+        level = nxt
+    return level[0]
+
+
+def app_version(image):
+    """Returns the version string of the image's esp_app_desc_t, None for
+    images without one."""
+    if len(image) < APP_DESC_OFFSET + 48:
+        return None
+    magic, = struct.unpack_from("<I", image, APP_DESC_OFFSET)
+    if magic != APP_DESC_MAGIC:
+        return None
+    return image[APP_DESC_OFFSET + 16:APP_DESC_OFFSET + 48].split(b"\0", 1)[0].decode(errors="replace")
+
+
+def describe(image, name, chunk_size, out, inline_leaves):
+    """Writes the image and its chunk map to out and returns its manifest entry."""
+    leaves = merkle_leaves(image, chunk_size)
+    with open(os.path.join(out, name + ".bin"), "wb") as f:
+        f.write(image)
+    entry = {
+        "image": name + ".bin",
+        "size": len(image),
+        "sha256": hashlib.sha256(image).hexdigest(),
+        "chunk_size": chunk_size,
+        "merkle_root": merkle_root(leaves).hex(),
+    }
+    if inline_leaves:
+        entry["leaves"] = b"".join(leaves).hex()
+    else:
+        with open(os.path.join(out, name + ".chunks"), "wb") as f:
+            f.write(b"".join(leaves))
+        entry["chunk_map"] = name + ".chunks"
+    return entry
+
+
+def delta(old, new):
+    """Encodes new as copies from old and literals:
+
+        "GDLT" u32 new size, then ops until the end:
+        0x00 u32 len, len literal bytes
+        0x01 u32 old offset, u32 len
+
+    Blocks of DELTA_BLOCK bytes at DELTA_ALIGN-aligned offsets of old are
+    matched and extended forward, which finds code and data that stayed the
+    same or only moved."""
+    index = {}
+    for offset in range(0, len(old) - DELTA_BLOCK + 1, DELTA_ALIGN):
+        index.setdefault(old[offset:offset + DELTA_BLOCK], offset)
+
+    out = bytearray(DELTA_MAGIC + struct.pack("<I", len(new)))
+    literal = 0
+    pos = 0
+
+    def flush(end):
+        if end > literal:
+            out.extend(b"\x00" + struct.pack("<I", end - literal) + new[literal:end])
+
+    while pos + DELTA_BLOCK <= len(new):
+        match = index.get(new[pos:pos + DELTA_BLOCK])
+        if match is None:
+            pos += DELTA_ALIGN
+            continue
+        length = DELTA_BLOCK
+        while pos + length < len(new) and match + length < len(old) and new[pos + length] == old[match + length]:
+            length += 1
+        flush(pos)
+        out.extend(b"\x01" + struct.pack("<II", match, length))
+        pos += length
+        literal = pos
+    flush(len(new))
+    return bytes(out)
+
+
+def changed_chunks(old, new, chunk_size):
+    old_leaves = merkle_leaves(old, chunk_size)
+    new_leaves = merkle_leaves(new, chunk_size)
+    changed = [i for i, leaf in enumerate(new_leaves) if i >= len(old_leaves) or old_leaves[i] != leaf]
+    return sum(len(new[i * chunk_size:(i + 1) * chunk_size]) for i in changed), len(changed), len(new_leaves)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="app image, e.g. build/app.bin")
+    parser.add_argument("--out", default="dist", help="output directory")
+    parser.add_argument("--name", default="firmware", help="base name of the image files")
+    parser.add_argument("--version", help="manifest version, default from the app descriptor")
+    parser.add_argument("--chunk-size", type=int, default=16384,
+                        help="verified chunk size, at most GECL_OTA_MAX_CHUNK_SIZE")
+    parser.add_argument("--partition", action="append", default=[], metavar="LABEL=IMAGE",
+                        help="data partition image to update with the app")
+    parser.add_argument("--inline-leaves", action="store_true", help="chunk maps inline in the manifest")
+    parser.add_argument("--sign-key", help="PEM private key to sign the manifest with")
+    parser.add_argument("--previous", nargs="*", default=[], help="earlier release images to compare against")
+    parser.add_argument("--variants", action="store_true", help="also write compressed images and delta patches")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    os.makedirs(args.out, exist_ok=True)
+
+    manifest = {"version": args.version or app_version(image) or ""}
+    manifest.update(describe(image, args.name, args.chunk_size, args.out, args.inline_leaves))
+    partitions = []
+    for spec in args.partition:
+        label, _, path = spec.partition("=")
+        entry = {"label": label}
+        entry.update(describe(open(path, "rb").read(), label, args.chunk_size, args.out, args.inline_leaves))
+        partitions.append(entry)
+    if partitions:
+        manifest["partitions"] = partitions
+
+    manifest_path = os.path.join(args.out, "manifest.json")
+    with open(manifest_path, "w") as f:
+        json.dump(manifest, f, indent=2)
+        f.write("\n")
+    if args.sign_key:
+        subprocess.run(["openssl", "dgst", "-sha256", "-sign", args.sign_key, "-out", manifest_path + ".sig",
+                        manifest_path], check=True)
+    print("Wrote %s, version %s, %d chunks of %d bytes" % (
+        os.path.relpath(manifest_path), manifest["version"] or "(none)",
+        (len(image) + args.chunk_size - 1) // args.chunk_size, args.chunk_size))
+
+    # Metadata every strategy downloads before the image
+    overhead = os.path.getsize(manifest_path)
+    if not args.inline_leaves:
+        overhead += os.path.getsize(os.path.join(args.out, args.name + ".chunks"))
+    variants = os.path.join(args.out, "variants")
+    if args.variants:
+        os.makedirs(variants, exist_ok=True)
+
+    rows = [("Full image", len(image))]
+    for label, data, suffix in (("zlib", zlib.compress(image, 9), ".zz"), ("LZMA", lzma.compress(image), ".xz")):
+        rows.append(("Full image, " + label, len(data)))
+        if args.variants:
+            with open(os.path.join(variants, args.name + ".bin" + suffix), "wb") as f:
+                f.write(data)
+    for path in args.previous:
+        old = open(path, "rb").read()
+        release = app_version(old) or os.path.basename(path)
+        patch = lzma.compress(delta(old, image))
+        rows.append(("Delta from %s" % release, len(patch)))
+        size, count, total = changed_chunks(old, image, args.chunk_size)
+        rows.append(("Changed chunks from %s (%d of %d)" % (release, count, total), size))
+        if args.variants:
+            with open(os.path.join(variants, "%s-from-%s.patch.xz" % (args.name, release)), "wb") as f:
+                f.write(patch)
+
+    print()
+    print("| Strategy | Image bytes | Transfer bytes | vs. full |")
+    print("|---|---:|---:|---:|")
+    for strategy, size in rows:
+        print("| %s | %d | %d | %.1f%% |" % (strategy, size, size + overhead, 100.0 * size / len(image)))
+    print()
+    print("Transfer bytes include the manifest and chunk map, %d bytes." % overhead)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Check the component's footprint against the budgets in footprint/budgets.json.
+
+Builds the reference application in tools/footprint once per configuration in
+budgets.json and reports this component's .text, .rodata, .data and .bss, its
+static RAM, and, with --port, the peak heap of a simulated update session
+measured on the device. Any value over its budget fails the check, as does a
+configuration without a recorded budget:
+
+    ota_size_budget.py --port /dev/ttyUSB0 --update   # record the current values
+    ota_size_budget.py --port /dev/ttyUSB0
+    ota_size_budget.py --report                       # print only, never fail
+
+--report prints the same table against whatever budgets are recorded and
+exits successfully, whether values are over budget or budgets are missing.
+
+--update writes the measured values, plus --margin percent, as the new
+budgets. Budgets are only comparable for the target and IDF version they were
+recorded with; budgets.json names the target.
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+from ota_size_report import archive_sizes, build
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+FOOTPRINT_DIR = os.path.join(TOOLS_DIR, "footprint")
+BUDGETS_FILE = os.path.join(FOOTPRINT_DIR, "budgets.json")
+COLUMNS = ["text", "rodata", "data", "bss", "static_ram", "session_heap"]
+
+
+def sections(build_dir, component):
+    """Returns the component's section sizes and static RAM from the linker map."""
+    description = json.load(open(os.path.join(build_dir, "project_description.json")))
+    archive = archive_sizes(os.path.join(build_dir, description["project_name"] + ".map")).get(
+        "lib%s.a" % component, {})
+    sizes = dict.fromkeys(COLUMNS[:-1], 0)
+    for name, size in archive.items():
+        if not isinstance(size, int) or "total" in name:
+            continue
+        if "bss" in name:
+            sizes["bss"] += size
+        elif "rodata" in name:
+            sizes["rodata"] += size
+        elif "data" in name:
+            sizes["data"] += size
+        else:
+            sizes["text"] += size
+        if not name.startswith("flash"):
+            sizes["static_ram"] += size  # DRAM data and bss, IRAM code
+    return sizes
+
+
+def session_heap(build_dir, port, timeout=60):
+    """Flashes the reference application and returns the session heap it reports."""
+    import serial  # pyserial, part of the ESP-IDF Python environment
+
+    subprocess.run(["idf.py", "-C", FOOTPRINT_DIR, "-B", build_dir, "-p", port, "flash"], check=True,
+                   stdout=subprocess.DEVNULL)
+    deadline = time.time() + timeout
+    with serial.Serial(port, 115200, timeout=1) as console:
+        while time.time() < deadline:
+            line = console.readline().decode(errors="replace")
+            match = re.search(r"GECL_OTA_FOOTPRINT (\S+) session_heap=(\d+)", line)
+            if match:
+                if match.group(1) != "ESP_OK":
+                    raise RuntimeError("simulated session failed: " + match.group(1))
+                return int(match.group(2))
+    raise RuntimeError("no footprint report from the device on " + port)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", help="device to measure the session heap on, skipped without")
+    parser.add_argument("--update", action="store_true", help="record the measured values as the budgets")
+    parser.add_argument("--report", action="store_true", help="print the footprint without failing the check")
+    parser.add_argument("--margin", type=float, default=5.0, help="percent added to values recorded by --update")
+    parser.add_argument("--build-root", default=os.path.join(FOOTPRINT_DIR, "build-budget"))
+    args = parser.parse_args()
+
+    budgets = json.load(open(BUDGETS_FILE))
+    component = os.path.basename(os.path.dirname(TOOLS_DIR))
+    over = []
+
+    print("| Configuration | " + " | ".join(COLUMNS) + " |")
+    print("|---|" + "---:|" * len(COLUMNS))
+    for name, config in budgets["configurations"].items():
+        build_dir = os.path.join(args.build_root, name)
+        os.makedirs(build_dir, exist_ok=True)
+        defaults = os.path.join(build_dir, "sdkconfig.budget")
+        with open(defaults, "w") as f:
+            f.write("\n".join(config["sdkconfig"]) + "\n")
+        build(FOOTPRINT_DIR, build_dir, [os.path.join(FOOTPRINT_DIR, "sdkconfig.defaults"), defaults],
+              budgets["target"])
+        measured = sections(build_dir, component)
+        measured["session_heap"] = session_heap(build_dir, args.port) if args.port else None
+
+        budget = config.get("budget") or {}
+        if not budget and not args.update and not args.report:
+            over.append("%s (no budget recorded)" % name)
+        cells = []
+        for column in COLUMNS:
+            value, limit = measured[column], budget.get(column)
+            if value is None:
+                cells.append("-")
+            elif limit is not None and value > limit:
+                cells.append("**%d** > %d" % (value, limit))
+                over.append("%s %s" % (name, column))
+            else:
+                cells.append("%d" % value if limit is None else "%d / %d" % (value, limit))
+        print("| %s | %s |" % (name, " | ".join(cells)))
+
+        if args.update:
+            config["budget"] = {column: int(value * (100 + args.margin) / 100)
+                                for column, value in measured.items() if value is not None}
+            config["budget"].update({column: limit for column, limit in budget.items()
+                                     if measured.get(column) is None})
+
+    if args.update:
+        with open(BUDGETS_FILE, "w") as f:
+            json.dump(budgets, f, indent=4)
+            f.write("\n")
+        print("Budgets recorded in " + os.path.relpath(BUDGETS_FILE))
+    elif over:
+        print("Over budget: " + ", ".join(over))
+        if not args.report:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Report the flash and RAM cost of each optional OTA manager capability.
+
+Builds the application once with its own configuration and once with each
+capability switched off, each in its own build directory under
+<project>/build-ota-size, and prints what the capability adds to this
+component's archive and to the app image, the bytes every OTA update carries:
+
+    idf.py gecl-ota-size-report
+    ota_size_report.py --project ~/my-app --component GECL-ota-manager
+
+Capabilities the application's configuration already leaves out are listed
+as off. Builds are incremental, so later runs only rebuild what changed.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+# Capability name and the sdkconfig lines that remove it
+FEATURES = [
+    ("HTTP without esp_http_client", ["# CONFIG_GECL_OTA_HTTP_DIRECT is not set"]),
+    ("MQTT transport", ["# CONFIG_GECL_OTA_MQTT_TRANSPORT is not set"]),
+    ("Multicast transport", ["# CONFIG_GECL_OTA_MCAST_TRANSPORT is not set"]),
+    ("CoAP transport", ["# CONFIG_GECL_OTA_COAP_TRANSPORT is not set"]),
+    ("Peer-to-peer distribution", ["# CONFIG_GECL_OTA_P2P_ENABLED is not set"]),
+    ("Readback verification", ["# CONFIG_GECL_OTA_READBACK_VERIFY is not set"]),
+    ("Session metrics", ["# CONFIG_GECL_OTA_METRICS is not set"]),
+    ("Chunk re-fetch", ["CONFIG_GECL_OTA_CHUNK_MAX_RETRIES=0"]),
+    ("Update history", ["# CONFIG_GECL_OTA_UPDATE_HISTORY is not set"]),
+    ("Info logs", ["CONFIG_GECL_OTA_LOG_LEVEL_WARN=y"]),
+    ("Benchmark", ["# CONFIG_GECL_OTA_BENCH is not set"]),
+    ("Session trace", ["# CONFIG_GECL_OTA_TRACE is not set"]),
+]
+
+
+def parse_sdkconfig(lines):
+    """Returns {name: value} of sdkconfig lines, "n" for options not set."""
+    values = {}
+    for line in lines:
+        line = line.strip()
+        if line.startswith("# CONFIG_") and line.endswith(" is not set"):
+            values[line[2:-len(" is not set")]] = "n"
+        elif line.startswith("CONFIG_") and "=" in line:
+            name, value = line.split("=", 1)
+            values[name] = value
+    return values
+
+
+def build(project, build_dir, defaults, target=None):
+    """Builds the project with the given sdkconfig defaults files."""
+    os.makedirs(build_dir, exist_ok=True)
+    command = ["idf.py", "-C", project, "-B", build_dir, "-D", "SDKCONFIG=" + os.path.join(build_dir, "sdkconfig"),
+               "-D", "SDKCONFIG_DEFAULTS=" + ";".join(defaults)]
+    if target is not None:
+        command += ["-D", "IDF_TARGET=" + target]
+    subprocess.run(command + ["build"], check=True, stdout=subprocess.DEVNULL)
+
+
+def archive_sizes(map_file):
+    """Returns {archive: sections} from the linker map, through esp_idf_size
+    or the idf_size.py of older IDF versions."""
+    tools = [[sys.executable, "-m", "esp_idf_size", "--archives", "--format", "json", map_file],
+             [sys.executable, os.path.join(os.environ.get("IDF_PATH", ""), "tools", "idf_size.py"), "--archives",
+              "--json", map_file]]
+    for command in tools:
+        result = subprocess.run(command, capture_output=True, text=True)
+        if result.returncode == 0:
+            return json.loads(result.stdout)
+    raise RuntimeError("no size tool found, run from an ESP-IDF environment")
+
+
+def measure(build_dir, component):
+    """Returns (component flash, component RAM, app image) in bytes."""
+    description = json.load(open(os.path.join(build_dir, "project_description.json")))
+    archives = archive_sizes(os.path.join(build_dir, description["project_name"] + ".map"))
+    sections = archives.get("lib%s.a" % component, {})
+    flash = ram = 0
+    for name, size in sections.items():
+        if not isinstance(size, int):
+            continue
+        if not name.endswith("bss"):
+            flash += size  # Initialized data is stored in the image too
+        if not name.startswith("flash_"):
+            ram += size
+    return flash, ram, os.path.getsize(os.path.join(build_dir, description["app_bin"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--project", default=".", help="application project directory")
+    parser.add_argument("--component", default=os.path.basename(os.path.dirname(os.path.dirname(
+        os.path.abspath(__file__)))), help="name of this component in the application")
+    parser.add_argument("--build-root", help="where the build directories go, default <project>/build-ota-size")
+    args = parser.parse_args()
+
+    project = os.path.abspath(args.project)
+    root = args.build_root or os.path.join(project, "build-ota-size")
+    base_defaults = [path for path in (os.path.join(project, "sdkconfig"), os.path.join(project, "sdkconfig.defaults"))
+                     if os.path.exists(path)][:1]
+
+    base_dir = os.path.join(root, "base")
+    build(project, base_dir, base_defaults)
+    base = measure(base_dir, args.component)
+    config = parse_sdkconfig(open(os.path.join(base_dir, "sdkconfig")))
+
+    print("| Capability | Component flash | Component RAM | App image |")
+    print("|---|---:|---:|---:|")
+    print("| Application configuration | %d | %d | %d |" % base)
+    for index, (name, lines) in enumerate(FEATURES):
+        overlay = parse_sdkconfig(lines)
+        if all(config.get(option, "n") == value for option, value in overlay.items()):
+            print("| %s | off | off | off |" % name)
+            continue
+        feature_dir = os.path.join(root, "feature%d" % index)
+        os.makedirs(feature_dir, exist_ok=True)
+        overlay_file = os.path.join(feature_dir, "sdkconfig.feature")
+        with open(overlay_file, "w") as f:
+            f.write("\n".join(lines) + "\n")
+        build(project, feature_dir, base_defaults + [overlay_file])
+        without = measure(feature_dir, args.component)
+        print("| %s | %+d | %+d | %+d |" % ((name,) + tuple(b - w for b, w in zip(base, without))))
+
+
+if __name__ == "__main__":
+    main()
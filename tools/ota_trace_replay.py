@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+"""Decode an OTA session trace, convert it for a timeline viewer and replay
+its network timing.
+
+A trace is what ota_trace_read() returns on a device built with
+GECL_OTA_TRACE, or a captured console log of a device built with
+GECL_OTA_TRACE_LOG, of which the last complete trace is used. show prints a
+summary, or every event with --events:
+
+    ota_trace_replay.py show trace.bin
+
+chrome writes the Chrome trace-event JSON that chrome://tracing and
+ui.perfetto.dev open, with network, processing and flash events on separate
+tracks to show where they overlap and where they wait for each other:
+
+    idf.py monitor | tee session.log
+    ota_trace_replay.py chrome session.log -o session.json
+
+serve replays the arrival times and read sizes of one image of the trace
+while streaming a local image, so the same field network behavior can be
+played against a device on the bench, with any pipeline change applied. The
+device downloads from tcp://<host>:<port>, or from http://<host>:<port>/ with
+--http (ranged re-fetches are answered at once, without recorded timing):
+
+    ota_trace_replay.py serve trace.bin firmware.bin --port 5000 --http
+
+Data is sent when the device received it in the field, independent of how
+fast the device on the bench consumes it. Failed reads in the trace become
+pauses of the same length.
+"""
+
+import argparse
+import base64
+import json
+import re
+import socket
+import statistics
+import struct
+import time
+
+HEADER = struct.Struct("<4sBBHIiI")
+RECORD = struct.Struct("<IIiB3x")
+TYPES = ["IMAGE", "RECV", "CHUNK", "WRITE", "DEFER", "REFETCH", "ERROR", "END", "CONNECT", "REQUEST", "HASH",
+         "DECRYPT", "ERASE"]
+LOG_LINE = re.compile(rb"GOTR (\d+) (\d+) ([A-Za-z0-9+/=]+)")
+
+# Timeline track of each event type
+TRACKS = {"CONNECT": "Network", "REQUEST": "Network", "RECV": "Network", "REFETCH": "Network",
+          "CHUNK": "Processing", "HASH": "Processing", "DECRYPT": "Processing",
+          "ERASE": "Flash", "WRITE": "Flash", "DEFER": "Flash"}
+TRACK_IDS = {"Session": 0, "Network": 1, "Processing": 2, "Flash": 3}
+
+
+def from_log(data):
+    """Returns the last complete trace printed in a console log, or None."""
+    trace = None
+    parts = []
+    for line, lines, text in LOG_LINE.findall(data):
+        if int(line) != len(parts):
+            parts = []  # A new trace, or a line was lost
+            if int(line) != 0:
+                continue
+        parts.append(base64.b64decode(text))
+        if len(parts) == int(lines):
+            trace = b"".join(parts)
+            parts = []
+    return trace
+
+
+def load(path):
+    """Returns (header fields, [(type, start_us, duration_us, value)])."""
+    data = open(path, "rb").read()
+    if not data.startswith(b"GOTR\x01"):
+        data = from_log(data) or data
+    magic, version, record_size, count, dropped, result, start_time = HEADER.unpack_from(data)
+    if magic != b"GOTR" or version != 1 or record_size != RECORD.size:
+        raise SystemExit("%s is not an OTA trace" % path)
+    records = []
+    for i in range(count):
+        start_us, duration_us, value, kind = RECORD.unpack_from(data, HEADER.size + i * RECORD.size)
+        records.append((TYPES[kind] if kind < len(TYPES) else str(kind), start_us, duration_us, value))
+    return {"dropped": dropped, "result": result, "start_time": start_time}, records
+
+
+def image_reads(records, image):
+    """Returns the RECV records of the image-th image of the trace."""
+    current = -1
+    reads = []
+    for kind, start_us, duration_us, value in records:
+        if kind == "IMAGE":
+            current += 1
+        elif kind == "RECV" and current == image:
+            reads.append((start_us, duration_us, value))
+    return reads
+
+
+def percentile(values, p):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))] if ordered else 0
+
+
+def show(args):
+    info, records = load(args.trace)
+    if args.events:
+        for kind, start_us, duration_us, value in records:
+            print("%12.3f ms %-8s %10d us  %d" % (start_us / 1000, kind, duration_us, value))
+        return
+
+    by_kind = {}
+    for kind, start_us, duration_us, value in records:
+        by_kind.setdefault(kind, []).append((start_us, duration_us, value))
+    reads = by_kind.get("RECV", [])
+    received = sum(value for _, _, value in reads if value > 0)
+    span_us = records[-1][1] + records[-1][2] - records[0][1] if records else 0
+    print("Result %d, %d records, %d dropped%s" % (info["result"], len(records), info["dropped"],
+                                                   ", started %s" % time.strftime(
+                                                       "%Y-%m-%d %H:%M:%S", time.gmtime(info["start_time"]))
+                                                   if info["start_time"] else ""))
+    print("Duration %.1f s, %d bytes received, %.1f KB/s" % (span_us / 1e6, received,
+                                                            received / 1024 / max(span_us / 1e6, 1e-6)))
+    waits = [duration for _, duration, value in reads if value > 0]
+    if waits:
+        print("Reads: %d, %d failed, wait median %d us, p95 %d us, max %d us, %d bytes median size" % (
+            len(reads), sum(1 for _, _, value in reads if value < 0), statistics.median(waits),
+            percentile(waits, 95), max(waits), statistics.median(value for _, _, value in reads if value > 0)))
+    for kind in ("CONNECT", "REQUEST", "HASH", "DECRYPT", "CHUNK", "ERASE", "WRITE", "DEFER"):
+        durations = [duration for _, duration, _ in by_kind.get(kind, [])]
+        if durations:
+            print("%s: %d, median %d us, p95 %d us, max %d us, total %.1f ms" % (
+                kind.capitalize(), len(durations), statistics.median(durations), percentile(durations, 95),
+                max(durations), sum(durations) / 1000))
+    for kind in ("REFETCH", "ERROR"):
+        for start_us, _, value in by_kind.get(kind, []):
+            print("%s at %.3f ms: %d" % (kind.capitalize(), start_us / 1000, value))
+
+
+def chrome(args):
+    info, records = load(args.trace)
+    events = [{"ph": "M", "name": "process_name", "pid": 1, "args": {"name": "OTA session"}}]
+    events += [{"ph": "M", "name": "thread_name", "pid": 1, "tid": tid, "args": {"name": name}}
+               for name, tid in TRACK_IDS.items()]
+    for kind, start_us, duration_us, value in records:
+        event = {"name": kind.lower(), "cat": TRACKS.get(kind, "Session").lower(), "pid": 1,
+                 "tid": TRACK_IDS[TRACKS.get(kind, "Session")], "ts": start_us, "args": {"value": value}}
+        if duration_us:
+            event.update(ph="X", dur=duration_us)
+        else:
+            event.update(ph="i", s="p" if kind in ("END", "ERROR") else "t")
+        events.append(event)
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms",
+                   "otherData": {"result": info["result"], "dropped": info["dropped"]}}, f)
+    print("Wrote %d events to %s" % (len(records), args.output))
+
+
+def replay(conn, image, reads, offset, speed):
+    """Sends image from offset on the recorded schedule."""
+    origin = reads[0][0]
+    start = time.monotonic()
+    for start_us, duration_us, value in reads:
+        due = (start_us + duration_us - origin) / 1e6 / speed
+        delay = start + due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        if value > 0 and offset < len(image):
+            conn.sendall(image[offset:offset + value])
+            offset += value
+    if offset < len(image):
+        conn.sendall(image[offset:])  # Beyond the recorded part of the trace
+
+
+def serve_http(conn, image, reads, speed):
+    request = b""
+    while b"\r\n\r\n" not in request:
+        data = conn.recv(4096)
+        if not data:
+            return
+        request += data
+    headers = request.decode(errors="replace").lower()
+    if "range: bytes=" in headers:
+        first, _, last = headers.split("range: bytes=", 1)[1].split("\r\n", 1)[0].partition("-")
+        first, last = int(first), int(last) if last else len(image) - 1
+        conn.sendall(b"HTTP/1.1 206 Partial Content\r\nContent-Length: %d\r\nContent-Range: bytes %d-%d/%d\r\n"
+                     b"Connection: close\r\n\r\n" % (last - first + 1, first, last, len(image)))
+        conn.sendall(image[first:last + 1])
+        return
+    conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n" % len(image))
+    replay(conn, image, reads, 0, speed)
+
+
+def serve(args):
+    _, records = load(args.trace)
+    reads = image_reads(records, args.image)
+    if not reads:
+        raise SystemExit("no reads recorded for image %d" % args.image)
+    image = open(args.firmware, "rb").read()
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind((args.bind, args.port))
+    server.listen(1)
+    print("Replaying %d reads on %s:%d" % (len(reads), args.bind, args.port))
+    while True:
+        conn, peer = server.accept()
+        print("Connection from %s:%d" % peer)
+        try:
+            if args.http:
+                serve_http(conn, image, reads, args.speed)
+            else:
+                replay(conn, image, reads, 0, args.speed)
+        except OSError as e:
+            print("Connection ended: %s" % e)
+        finally:
+            conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("show", help="summarize a trace")
+    p.add_argument("trace")
+    p.add_argument("--events", action="store_true", help="print every event")
+    p.set_defaults(func=show)
+
+    p = sub.add_parser("chrome", help="convert a trace to Chrome trace-event JSON")
+    p.add_argument("trace")
+    p.add_argument("-o", "--output", default="trace.json")
+    p.set_defaults(func=chrome)
+
+    p = sub.add_parser("serve", help="stream an image with the network timing of a trace")
+    p.add_argument("trace")
+    p.add_argument("firmware")
+    p.add_argument("--bind", default="0.0.0.0")
+    p.add_argument("--port", type=int, default=5000)
+    p.add_argument("--http", action="store_true", help="serve HTTP instead of a raw TCP stream")
+    p.add_argument("--image", type=int, default=0, help="which image of the trace, 0 for the app")
+    p.add_argument("--speed", type=float, default=1.0, help="replay speed factor")
+    p.set_defaults(func=serve)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()